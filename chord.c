@@ -7,6 +7,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "csapp.h"
+#include "pool.h"
+#include "wire.h"
+#include "reactor.h"
+#include "ring.h"
+#include "routing.h"
+#include "maint.h"
+#include "lcache.h"
+#include "store.h"
+#include "replica.h"
+#include "wal.h"
+#include "filter.h"
+#include "dispatch.h"
+#include "stats.h"
+#include "log.h"
 #include <pthread.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -16,22 +30,29 @@
 #include <openssl/sha.h>
 #include <ifaddrs.h>
 #include <netinet/in.h> 
+#include <signal.h>
 
 
 #define   FILTER_FILE   "chord.filter"
-#define   LOG_FILE      "chord.log"
-#define   DEBUG_FILE    "chord.debug"
-#define   KEY_SIZE      32
+#define   LOG_FILE      "chord-%d.log"   // Per node, by listening port
+#define   DEBUG_FILE    "chord-%d.debug"
 #define   KEY_SPACE     4294967296
 #define   LOCAL_IP_ADDRESS "127.0.0.1" 
 #define   KEEP_ALIVE    5 // In seconds
-
-typedef struct Node 
-{
-  uint32_t key;
-  char ip_address[12];
-  int port;
-} Node;
+#define   STABILIZE_PERIOD         1000 // In milliseconds
+#define   FIX_FINGERS_PERIOD       500  // In milliseconds, one finger per run
+#define   CHECK_PREDECESSOR_PERIOD 2000 // In milliseconds
+#define   LOOKUP_TIMEOUT 5 // In seconds, before a recursive lookup is retried iteratively
+#define   SUCCESSOR_LIST_LENGTH 8 // Default r, the successors each node tracks
+#define   SUCCESSOR_CACHE_SIZE 64 // Direct mapped by node key
+#define   SUCCESSOR_CACHE_TTL  KEEP_ALIVE // In seconds
+#define   MIGRATE_CHUNK   (64 * 1024) // Bytes of keys per frame when handing a range over
+#define   HANDOFF_TIMEOUT (2 * KEEP_ALIVE) // In seconds without a chunk before a handoff is given up
+#define   FILTER_CACHE_SIZE 16 // Peers' filters kept, direct mapped by node key
+
+/* Lookup modes */
+#define   LOOKUP_ITERATIVE 0 // Originator asks each hop in turn
+#define   LOOKUP_RECURSIVE 1 // Each hop forwards, the owner answers the originator
 
 /*============================================================
  * function declarations
@@ -40,56 +61,297 @@ typedef struct Node
 void initialize_chord(int port);
 void join_node(char *ip_address, int node_port, int listen_port);
 void* begin_listening(void *args);
-void* receive_client(void *args);
-
-void keep_alive();
+void register_handlers();
+void reply_node(reactor_conn *c, Node n, int flags);
+
+void start_maintenance();
+void stabilize();
+void fix_fingers();
+void check_predecessor();
+void reap_pool();
+void sync_replicas();
+void fetch_filters();
 bool ping(Node n);
+size_t put_successor_list(char *buf, bool text);
+int get_successor_list(wire_reader *r, Node list[], int max);
 
 Node find_successor(uint32_t key);
-Node find_predecessor(uint32_t key);
-Node closest_preceding_finger(uint32_t key);
-bool is_between(uint32_t key, uint32_t a, uint32_t b);
-
-void update_successor(Node successor);
-void update_predecessor(Node predecessor);
-void update_finger_table(Node s, int i);
-
-void remove_node(Node old, int i, Node replace);
+Node lookup_successor(uint32_t key, int mode);
+Node resolve_successor(uint32_t key, int mode, uint32_t *start);
+Node find_successor_recursive(uint32_t key, uint32_t *start, int *hops);
+void route_lookup(uint32_t key, uint32_t id, Node origin, int hops);
+void complete_lookup(uint32_t id, Node successor, uint32_t start, int hops);
+Node cached_successor(Node n);
+void cache_successor(Node n, Node successor);
+void forget_successors(Node changed);
+bool peer_may_have(Node n, uint32_t id, char *key, size_t klen);
+void peer_added(Node n, uint32_t id, char *key, size_t klen);
+void forget_filters();
+filter *fetch_filter(Node n);
+Node next_known_node(Node n);
+
+Node get_successor();
+Node get_predecessor();
+
+
+/* Data requests */
+bool owns(uint32_t id);
+int route_data(int opcode, char *key, size_t klen, char *value, size_t vlen, char *out, size_t *outlen);
+int execute_data(int opcode, uint32_t id, char *key, size_t klen, char *value, size_t vlen, char *out, size_t *outlen);
+int request_data(Node n, int opcode, int flags, char *key, size_t klen, char *value, size_t vlen, char *out, size_t *outlen);
+
+/* Moving keys on join and leave */
+void *pull_keys(void *args);
+void *wait_for_leave(void *args);
+void leave_ring();
+int push_keys(Node n, uint32_t start);
+int stream_keys(reactor_conn *c, int flags, uint32_t start, uint32_t end);
+int apply_keys(wire_reader *r);
+void drop_keys(uint32_t start, uint32_t end);
+void handoff_begin(Node source, uint32_t start, uint32_t end);
+void handoff_end();
+bool handoff_lock(uint32_t id, Node *source);
+void handoff_unlock();
+
+/* Request handlers, by opcode */
+void handle_fetch_suc(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_fetch_pre(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_query_suc(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_query_pre(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_query_cpf(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_query_hop(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_update_suc(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_update_pre(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_update_fin(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_remove_node(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_search_query(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_data(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_print_table(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_find_suc(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_found_suc(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_notify(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_pull_keys(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_push_keys(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_keys_done(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_replicate(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_filter(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_ping(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
+void handle_stats(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r);
 
 /* Remote functions */
 Node fetch_successor(Node n);
 Node fetch_predecessor(Node n);
+int fetch_neighbours(Node n, Node *predecessor, Node list[], int max);
 Node query_successor(uint32_t key, Node n);
 Node query_predecessor(uint32_t key, Node n);
 Node query_closest_preceding_finger(uint32_t key, Node n);
+Node query_closest_preceding_hop(uint32_t key, Node n, Node *successor);
 void request_update_successor(Node successor, Node n);
 void request_update_predecessor(Node predecessor, Node n);
+void request_notify(Node n);
 void request_update_finger_table(Node s, int i, Node n);
-Node parse_incoming_node(rio_t *client);
+Node parse_incoming_node(wire_reader *r);
 void request_remove_node(Node old, int i, Node replace, Node n);
+void request_find_successor(uint32_t key, uint32_t id, Node origin, int hops, Node n);
+void request_found_successor(uint32_t id, Node successor, Node origin, int hops);
 
 /* Utility functions */
 uint32_t hash_address(char *ip_address, int port);
+void put_sample(char *key);
+void open_store(int port);
+void open_log(int port);
 
-Node fetch_query(Node n, char message[]);
-void send_request(Node n, char message[]);
+Node fetch_query(Node n, int opcode, int flags, char payload[], size_t len);
+void send_request(Node n, int opcode, char payload[], size_t len);
+int exchange(Node n, int opcode, int flags, char payload[], size_t len, char response[]);
+int exchangev(Node n, int opcode, int flags, struct iovec *iov, int iovcnt, char response[]);
+static bool closed_idle(pool_conn *conn, ssize_t written, ssize_t read);
 
 void print_node(Node n);
 void println();
-bool is_equal(Node a, Node b);
 
 Node self_node;
-Node self_predecessor;
-Node self_successor;
-Node second_successor; // For node leaving replacement
-Node self_finger_table[KEY_SIZE];
-char self_data[32][MAXLINE]; // Array of keys for simulating <key value> pairs
+store *self_store; // Keys this node holds
+wal *self_wal; // Log of self_store, NULL if it could not be opened
+int wal_flush_interval = WAL_FLUSH_INTERVAL;
+int peer_filter_ttl = 0; // In seconds a peer's filter is trusted; 0 never fetches them
+int lookup_mode = LOOKUP_ITERATIVE; // For lookups this node starts itself
+int successor_list_length = SUCCESSOR_LIST_LENGTH; // r
+int stabilize_period = STABILIZE_PERIOD;
+int fix_fingers_period = FIX_FINGERS_PERIOD;
+int check_predecessor_period = CHECK_PREDECESSOR_PERIOD;
+routing_node self_route; // Our routing state, over ring.c and the network
+routing_ops network_routing;
+volatile bool leaving; // Handing our keys over; we own nothing any more
+
+/* Recursive lookups started here, waiting for their found_suc */
+typedef struct pending_lookup
+{
+  uint32_t id;
+  bool done;
+  Node result;
+  uint32_t start;     /* result owns (start, result] */
+  int hops;           /* nodes the lookup was forwarded through */
+  pthread_cond_t cond;
+  struct pending_lookup *next;
+} pending_lookup;
+
+pending_lookup *pending_lookups;
+uint32_t next_lookup_id;
+pthread_mutex_t lookups_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Successors of other nodes (mostly our fingers), for answering query_hop */
+typedef struct successor_entry
+{
+  Node node;
+  Node successor;
+  time_t fetched;
+} successor_entry;
 
-pthread_mutex_t mutex;
+successor_entry successor_cache[SUCCESSOR_CACHE_SIZE];
+pthread_mutex_t successor_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Filters of other nodes' keys, so a get for a key the owner does not
+ * have is answered without asking it. A copy misses keys written at the
+ * owner since it was fetched, except those we routed there ourselves,
+ * so it is trusted for peer_filter_ttl seconds only.
+ */
+typedef struct filter_entry
+{
+  Node node;
+  filter *filter;     /* NULL until fetched */
+  time_t fetched;
+  bool wanted;        /* used while missing or stale, so fetch_filters gets it */
+  int writes;         /* puts routed to node, to spot ones racing a fetch */
+} filter_entry;
+
+filter_entry filter_cache[FILTER_CACHE_SIZE];
+pthread_mutex_t filter_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Keys on their way here from another node. We answer for them already;
+ * reads for ones that have not arrived go back to the source, and keys
+ * written or deleted here meanwhile are not overwritten by the transfer.
+ * One handoff runs at a time.
+ */
+typedef struct handoff
+{
+  volatile bool active;
+  Node source;
+  uint32_t start, end;  /* keys in (start, end] */
+  store *deleted;       /* deleted here during the handoff */
+  time_t touched;       /* last chunk, to give up on a source that died */
+} handoff;
+
+handoff incoming;
+pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t handoff_cond = PTHREAD_COND_INITIALIZER;
+
+/* Encoded keys of one range, MIGRATE_CHUNK bytes or so per chunk */
+typedef struct key_chunk
+{
+  struct key_chunk *next;
+  size_t len, cap;
+  char data[];
+} key_chunk;
 
 int main(int argc, char *argv[])
 { 
-  int listen_port, node_port;
+  int listen_port, node_port, opt;
+  int jitter = MAINT_JITTER, rate = MAINT_RATE;
+  int replicas = REPLICA_FACTOR, ack_policy = ACK_OWNER;
+  int level = LEVEL_INFO;
+  char *prog = argv[0];
+
+  while ((opt = getopt(argc, argv, "tRr:s:f:p:j:m:k:a:w:F:l:")) != -1) {
+    switch (opt) {
+    case 't': /* text debug encoding for routing messages */
+      wire_text = true;
+      break;
+    case 'R': /* resolve our own lookups recursively */
+      lookup_mode = LOOKUP_RECURSIVE;
+      break;
+    case 'r': /* successor list length */
+      successor_list_length = atoi(optarg);
+      if (successor_list_length < 1 || successor_list_length > SUCCESSOR_LIST_MAX) {
+        printf("Successor list length must be between 1 and %d\n", SUCCESSOR_LIST_MAX);
+        exit(1);
+      }
+      break;
+    case 's': /* stabilize period, ms */
+      stabilize_period = atoi(optarg);
+      break;
+    case 'f': /* fix_fingers period, ms */
+      fix_fingers_period = atoi(optarg);
+      break;
+    case 'p': /* check_predecessor period, ms */
+      check_predecessor_period = atoi(optarg);
+      break;
+    case 'j': /* maintenance jitter, percent of a period */
+      jitter = atoi(optarg);
+      break;
+    case 'm': /* maintenance runs per second, at most */
+      rate = atoi(optarg);
+      break;
+    case 'k': /* replicas of each key, on the first k successors */
+      replicas = atoi(optarg);
+      break;
+    case 'a': /* ack policy for writes: owner, quorum or all */
+      if ((ack_policy = ack_policy_of(optarg)) < 0) {
+        printf("Ack policy must be owner, quorum or all\n");
+        exit(1);
+      }
+      break;
+    case 'w': /* write-ahead log flush interval, ms */
+      wal_flush_interval = atoi(optarg);
+      break;
+    case 'F': /* seconds to trust peers' filters for, 0 for never */
+      peer_filter_ttl = atoi(optarg);
+      break;
+    case 'l': /* log level: error, info or debug */
+      if ((level = log_level_of(optarg)) < 0) {
+        printf("Log level must be error, info or debug\n");
+        exit(1);
+      }
+      break;
+    default:
+      printf("Usage: %s [-t] [-R] [-r length] [-s ms] [-f ms] [-p ms] [-j percent] [-m rate] [-k replicas] [-a owner|quorum|all] [-w ms] [-F seconds] [-l error|info|debug] port [node_ip_address node_port]\n", prog);
+      exit(1);
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (stabilize_period <= 0 || fix_fingers_period <= 0 || check_predecessor_period <= 0 ||
+      jitter < 0 || jitter > 100 || rate <= 0 || wal_flush_interval < 0) {
+    printf("Periods and rate must be positive, jitter between 0 and 100, the flush interval not negative\n");
+    exit(1);
+  }
+  maint_configure(jitter, rate);
+  if (peer_filter_ttl < 0) {
+    printf("Filter trust must not be negative\n");
+    exit(1);
+  }
+  if (replicas < 0 || replicas > successor_list_length) {
+    printf("Replicas must be between 0 and the successor list length\n");
+    exit(1);
+  }
+  replica_configure(replicas, ack_policy);
+  log_level = level;
+
+  /* Peers may drop pooled connections at any time */
+  Signal(SIGPIPE, SIG_IGN);
+
+  /* Ctrl-C hands our keys over before exiting; threads inherit the mask */
+  sigset_t leave_signals;
+  sigemptyset(&leave_signals);
+  sigaddset(&leave_signals, SIGINT);
+  sigaddset(&leave_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &leave_signals, NULL);
+  pthread_t leave_thread;
+  if (pthread_create(&leave_thread, NULL, &wait_for_leave, NULL) < 0) {
+    printf("leave thread error\n");
+  }
 
   if (argc == 2) {
     listen_port = atoi(argv[1]);
@@ -99,7 +361,7 @@ int main(int argc, char *argv[])
     node_port = atoi(argv[3]);
     join_node(argv[2], node_port, listen_port);
   } else {
-    printf("Usage: %s port [node_ip_address node_port]\n", argv[0]);
+    printf("Usage: %s [-t] [-R] [-r length] [-s ms] [-f ms] [-p ms] [-j percent] [-m rate] [-k replicas] [-a owner|quorum|all] [-w ms] [-F seconds] [-l error|info|debug] port [node_ip_address node_port]\n", prog);
     exit(1);
   }
 }
@@ -132,7 +394,7 @@ void get_local_ip_address() {
       break;
     }
   }
-  printf("Local IP Address: %s\n", LOCAL_IP_ADDRESS);
+  log_info("Local IP Address: %s", LOCAL_IP_ADDRESS);
   
   if (ifAddrStruct!=NULL) freeifaddrs(ifAddrStruct);
 }
@@ -144,31 +406,18 @@ void initialize_chord(int port) {
   self_node.port = port;
   self_node.key = hash_address(LOCAL_IP_ADDRESS, port);
 
-  /* Set self to predecessor and successor */
-  self_predecessor = self_node;
-  self_successor = self_node;
-  second_successor = self_node;
+  /* Set self to predecessor, successor and fingers */
+  ring_init(self_node);
+  routing_init(&self_route, self_node, successor_list_length, &network_routing, NULL);
 
-  /* Set self for fingers */
-  int i;
-  for (i = 0; i < KEY_SIZE; i++) {
-    self_finger_table[i] = self_node;
-  }
-
-  /* set data to blank */
-  int size = sizeof(self_data) / sizeof(self_data[0]);
-  for (i = 0; i < size; i++) {
-    self_data[i][0] = 0;
-  }
+  open_log(port);
+  open_store(port);
 
   /* SAMPLE data for testing query */
-  strcpy(self_data[1], "Gettysburg Address");
-  strcpy(self_data[2], "The Art of Computer Programming");
+  put_sample("Gettysburg Address");
+  put_sample("The Art of Computer Programming");
 
-  pthread_t thread;
-  if (pthread_create(&thread, NULL, &keep_alive, NULL) < 0) {
-    printf("receive_client thread error\n");
-  }
+  start_maintenance();
 
   int *args = malloc(sizeof(int));
   args[0] = port;
@@ -178,39 +427,74 @@ void initialize_chord(int port) {
   begin_listening((void *)args);
 }
 
-void keep_alive() {
-  while (1) {
-    /* Send ping to successor*/
-    if (ping(self_successor) == false) {
-      /* successor has left */
-      printf("Successor has left. Updating...\n");
+/* Run the stabilization protocol in the background */
+void start_maintenance() {
+  maint_add("stabilize", stabilize, stabilize_period);
+  maint_add("fix_fingers", fix_fingers, fix_fingers_period);
+  maint_add("check_predecessor", check_predecessor, check_predecessor_period);
+  maint_add("reap_pool", reap_pool, KEEP_ALIVE * 1000);
+  if (replica_factor() > 0) {
+    maint_add("sync_replicas", sync_replicas, stabilize_period);
+  }
+  if (peer_filter_ttl > 0) {
+    maint_add("fetch_filters", fetch_filters, peer_filter_ttl * 1000 / 2);
+  }
 
-      if (is_equal(self_successor, self_predecessor)) {
-        /* Set self to predecessor and successor */
-        self_predecessor = self_node;
-        self_successor = self_node;
-        second_successor = self_node;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, &maint_run, NULL) < 0) {
+    log_error("maintenance thread error");
+  }
+}
 
-        /* Set self for fingers */
-        int i;
-        for (i = 0; i < KEY_SIZE; i++) {
-          self_finger_table[i] = self_node;
-        }
-      }
-      else {
-        request_update_predecessor(self_node, second_successor);
-        int product = 1;
-        int i;
-        for (i = 0; i < KEY_SIZE; i++) {
-          Node p = find_predecessor(self_successor.key - product + 1);
-          request_remove_node(self_successor, i, second_successor, p);
-        }
-      }
-      printf("Finished updating all nodes due to successor leaving\n");
-    }
+/* Maintenance tasks, run by maint */
+void stabilize() {
+  routing_stabilize(&self_route);
+}
+
+void fix_fingers() {
+  routing_fix_fingers(&self_route);
+}
+
+void check_predecessor() {
+  routing_check_predecessor(&self_route);
+}
+
+void reap_pool() {
+  pool_reap(POOL_IDLE_TIMEOUT);
+}
 
-    sleep(5);
+/*
+ * sync_replicas - Point replication at our first k successors. A node
+ * new to that set gets a full copy of the keys we own; when a dead
+ * predecessor leaves our range larger, the part we took over is copied
+ * to all of them, since the last of them never held it.
+ */
+void sync_replicas() {
+  const ring_state *ring = ring_read_lock();
+  Node targets[SUCCESSOR_LIST_MAX], fresh[SUCCESSOR_LIST_MAX];
+  int count = ring->successor_count, i;
+  Node p = ring->predecessor;
+  static uint32_t replicated_from; /* our range started after this key at the last run */
+  static bool replicated;
+
+  memcpy(targets, ring->successor_list, count * sizeof(Node));
+  ring_read_unlock();
+
+  if (p.port == 0) {
+    return; /* until notify tells us where our range starts */
+  }
+  uint32_t start = is_equal(p, self_node) ? self_node.key : p.key;
+  int fresh_count = replica_retarget(targets, count, fresh);
+  for (i = 0; i < fresh_count; i++) {
+    log_node(LEVEL_INFO, "Copying keys to new replica", fresh[i]);
+    replica_sync(&fresh[i], self_store, start + 1, self_node.key);
+  }
+  if (replicated && start != replicated_from && replicated_from != self_node.key &&
+      is_between(replicated_from, start + 1, self_node.key)) {
+    replica_sync(NULL, self_store, start + 1, replicated_from);
   }
+  replicated_from = start;
+  replicated = true;
 }
 
 bool ping(Node n) {
@@ -218,363 +502,482 @@ bool ping(Node n) {
     return true;
   }
 
-  Node return_node;
-  int sock;
-  struct sockaddr_in server_addr;
-  rio_t server;
+  char response[MAXLINE];
+  if (exchange(n, OP_PING, 0, "", 0, response) < 0) {
+    return false;
+  }
+  return true;
+}
+
+/* Encode our successor list as a count followed by the nodes */
+size_t put_successor_list(char *buf, bool text) {
+  const ring_state *ring = ring_read_lock();
+  size_t len = wire_put_u32(buf, ring->successor_count, text);
+  int i;
 
-  if ((sock = socket(AF_INET, SOCK_STREAM/* use tcp */, 0)) < 0) {
-    perror("Create socket error:");
+  for (i = 0; i < ring->successor_count; i++) {
+    len += wire_put_node(buf + len, ring->successor_list[i], text);
   }
+  ring_read_unlock();
+  return len;
+}
 
-  server_addr.sin_addr.s_addr = inet_addr(n.ip_address);
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(n.port);
+/* Decode up to max entries of a successor list; returns the number decoded */
+int get_successor_list(wire_reader *r, Node list[], int max) {
+  uint32_t count;
+  int i;
 
-  if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-    Close(sock);
-    return false;
-  } else {
-    char message[MAXLINE];
-    strcpy(message, "ping\n");
-    if (send(sock, message, MAXLINE,0) < 0) {
-      perror("Send error:");
+  if (wire_get_u32(r, &count) < 0) {
+    return 0; /* peer without a successor list */
+  }
+  for (i = 0; i < (int) count && i < max; i++) {
+    if (wire_get_node(r, &list[i]) < 0) {
+      break;
     }
-    Close(sock);
-    return true;
-  } 
+  }
+  return i;
 }
 
 void* begin_listening(void *args) {
   int port = ((int*)args)[0];
-  int listenfd, connfd, optval, clientlen;
-  struct sockaddr_in clientaddr;
+  int listenfd, optval;
 
   listenfd = Open_listenfd(port);
   optval = 1;
   setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void*)&optval, sizeof(int));
+  Node predecessor = get_predecessor();
+  Node successor = get_successor();
   printf("You are listening on port %d\n", port);
   printf("Your position is %u\n", self_node.key);
-  printf("Your predecessor is node %s, port %d, position %u\n", self_predecessor.ip_address, self_predecessor.port, self_predecessor.key);
-  printf("Your successor is node %s, port %d, position %u\n", self_successor.ip_address, self_successor.port, self_successor.key);
+  printf("Your predecessor is node %s, port %d, position %u\n", predecessor.ip_address, predecessor.port, predecessor.key);
+  printf("Your successor is node %s, port %d, position %u\n", successor.ip_address, successor.port, successor.key);
 
-  pthread_mutex_init(&mutex, NULL);
-  while(1) {
-    clientlen = sizeof(clientaddr); //struct sockaddr_in
+  register_handlers();
+  reactor_run(listenfd, dispatch_request, dispatch_may_block);
+  return NULL;
+}
 
-    /* accept a new connection from a client here */
-    connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-    printf("Connected to new client, fd: %d\n", connfd);
+/* Route each opcode to its handler; those making remote calls run on reactor workers, not I/O threads */
+void register_handlers() {
+  dispatch_register(OP_FETCH_SUC, handle_fetch_suc, 0);
+  dispatch_register(OP_FETCH_PRE, handle_fetch_pre, 0);
+  dispatch_register(OP_QUERY_SUC, handle_query_suc, DISPATCH_BLOCKING);
+  dispatch_register(OP_QUERY_PRE, handle_query_pre, DISPATCH_BLOCKING);
+  dispatch_register(OP_QUERY_CPF, handle_query_cpf, 0);
+  dispatch_register(OP_QUERY_HOP, handle_query_hop, DISPATCH_BLOCKING);
+  dispatch_register(OP_UPDATE_SUC, handle_update_suc, 0);
+  dispatch_register(OP_UPDATE_PRE, handle_update_pre, 0);
+  dispatch_register(OP_UPDATE_FIN, handle_update_fin, DISPATCH_BLOCKING);
+  dispatch_register(OP_REMOVE_NODE, handle_remove_node, DISPATCH_BLOCKING);
+  dispatch_register(OP_SEARCH_QUERY, handle_search_query, DISPATCH_BLOCKING);
+  dispatch_register(OP_PUT, handle_data, DISPATCH_BLOCKING);
+  dispatch_register(OP_GET, handle_data, DISPATCH_BLOCKING);
+  dispatch_register(OP_DELETE, handle_data, DISPATCH_BLOCKING);
+  dispatch_register(OP_PRINT_TABLE, handle_print_table, 0);
+  dispatch_register(OP_FIND_SUC, handle_find_suc, DISPATCH_BLOCKING);
+  dispatch_register(OP_FOUND_SUC, handle_found_suc, 0);
+  dispatch_register(OP_NOTIFY, handle_notify, 0);
+  dispatch_register(OP_PULL_KEYS, handle_pull_keys, DISPATCH_BLOCKING);
+  dispatch_register(OP_PUSH_KEYS, handle_push_keys, DISPATCH_BLOCKING);
+  dispatch_register(OP_KEYS_DONE, handle_keys_done, DISPATCH_BLOCKING);
+  dispatch_register(OP_REPLICATE, handle_replicate, DISPATCH_BLOCKING);
+  dispatch_register(OP_FILTER, handle_filter, DISPATCH_BLOCKING);
+  dispatch_register(OP_PING, handle_ping, 0);
+  dispatch_register(OP_STATS, handle_stats, 0);
+}
 
-    int *args = malloc(sizeof(int));
-    args[0] = connfd;
+/* fetch node's successor */
+void handle_fetch_suc(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling fetch_suc");
+  Node successor = get_successor();
+  reply_node(c, successor, hdr->flags);
+  log_node(LEVEL_DEBUG, "Successor", successor);
 
-    pthread_t thread;
-    
-    if (pthread_create(&thread, NULL, &receive_client, (void *)args) < 0) {
-      printf("receive_client thread error\n");
-    }
-    
-  }
-  pthread_mutex_destroy(&mutex);
+  log_debug("Response sent.");
 }
 
-void* receive_client(void *args) {
-  int numBytes, clientfd;
-  int byteCount = 0;
-  char buf1[MAXLINE], buf2[MAXLINE], buf3[MAXLINE];
-  rio_t server, client;
-  
-  clientfd = ((int*)args)[0];
-  free(args);
-
-  char request[MAXLINE];
-  request[0] = 0;
-
-  printf("Waiting for client request...\n");
-  /* Read first line of request */
-  Rio_readinitb(&client, clientfd);
-  numBytes = Rio_readlineb(&client, request, MAXLINE);
-  if (numBytes <= 0) {
-    printf("No request received\n");
-  }
-  printf("Request: %s\n", request);
-
-  pthread_mutex_lock(&mutex);
-
-  /* Check type of connection */
-
-  /* fetch node's successor */
-  if (strncmp(request, "fetch_suc", 9) == 0) {
-    printf("Handling fetch_suc\n");
-    buf1[0] = 0;
-    sprintf(buf1, "%u\n", self_successor.key);
-    strcat(buf1, self_successor.ip_address);
-    strcat(buf1, "\n");
-    sprintf(buf2, "%d\n", self_successor.port);
-    strcat(buf1, buf2);
-    if (rio_writen(clientfd, buf1, MAXLINE) < 0) {
-      perror("Send error:");
-    }
-    print_node(self_successor);
-    printf("%s\n", buf1);
-
-    shutdown(clientfd, SHUT_WR);
-    printf("Response sent.\n");
-  }  
-
-  /* fetch node's predecessor */
-  if (strncmp(request, "fetch_pre", 9) == 0) {
-    printf("Handling fetch_pre\n");
-    buf1[0] = 0;
-    sprintf(buf1, "%u\n", self_predecessor.key);
-    strcat(buf1, self_predecessor.ip_address);
-    strcat(buf1, "\n");
-    sprintf(buf2, "%d\n", self_predecessor.port);
-    strcat(buf1, buf2);
-    if (rio_writen(clientfd, buf1, MAXLINE) < 0) {
-      perror("Send error:");
-    }
-
-    printf("Result: \n");
-    shutdown(clientfd, SHUT_WR);
-    printf("Response sent.\n");
-  }
-
-  /* ask node for successor of key */
-  if (strncmp(request, "query_suc", 9) == 0) {
-    printf("Handling query_suc\n");
-    uint32_t key = 0;
-    key = (uint32_t) atoi(request+9);
-    printf("%u\n", key);
-
-    Node successor = find_successor(key);
-    print_node(successor);
-
-    buf1[0] = 0;
-    sprintf(buf1, "%u\n", successor.key);
-    strcat(buf1, successor.ip_address);
-    strcat(buf1, "\n");
-    sprintf(buf2, "%d\n", successor.port);
-    strcat(buf1, buf2);
-    if (rio_writen(clientfd, buf1, MAXLINE) < 0) {
-      perror("Send error:");
-    }
-
-    shutdown(clientfd, SHUT_WR);
-    printf("Response sent.\n");
-  }
-
-  /* ask node for predecessor of key */
-  if (strncmp(request, "query_pre", 9) == 0) {
-    printf("Handling query_pre\n");
-    uint32_t key = 0;
-    key = (uint32_t) atoi(request+9);
-    printf("%u\n", key);
-
-    Node predecessor = find_predecessor(key);
-    print_node(predecessor);
-
-    buf1[0] = 0;
-    sprintf(buf1, "%u\n", predecessor.key);
-    strcat(buf1, predecessor.ip_address);
-    strcat(buf1, "\n");
-    sprintf(buf2, "%d\n", predecessor.port);
-    strcat(buf1, buf2);
-    if (rio_writen(clientfd, buf1, MAXLINE) < 0) {
-      perror("Send error:");
-    }
-
-    shutdown(clientfd, SHUT_WR);
-    printf("Response sent.\n");
-  }
-
-  /* ask node for closest preceding finger of key */
-  if (strncmp(request, "query_cpf", 9) == 0) {
-    printf("Handling query_cpf\n");
-    uint32_t key = 0;
-    key = (uint32_t) atoi(request+9);
-    printf("%u\n", key);
-
-    Node cpf = closest_preceding_finger(key);
-    print_node(cpf);
-
-    buf1[0] = 0;
-    sprintf(buf1, "%u\n", cpf.key);
-    strcat(buf1, cpf.ip_address);
-    strcat(buf1, "\n");
-    sprintf(buf2, "%d\n", cpf.port);
-    strcat(buf1, buf2);
-    if (rio_writen(clientfd, buf1, MAXLINE) < 0) {
-      perror("Send error:");
-    }
-
-    shutdown(clientfd, SHUT_WR);
-    printf("Response sent.\n");
-  }
-
-  /* update node's successor */
-  if (strncmp(request, "update_suc", 10) == 0) {
-    printf("Handling update_suc\n");
-
-    Node n = parse_incoming_node(&client);
-    self_successor = n;
-    self_finger_table[0] = n;
-    second_successor = fetch_successor(self_successor);
-    printf("New successor: \n");
-    print_node(self_successor);
-    Close(clientfd);
-    printf("Done update_suc\n");
-  }
+/* fetch node's predecessor, followed by our successor list for stabilize */
+void handle_fetch_pre(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling fetch_pre");
+  char buf[WIRE_NODE_MAX + WIRE_U32_MAX + SUCCESSOR_LIST_MAX * WIRE_NODE_MAX];
+  bool text = hdr->flags & FRAME_TEXT;
+  size_t len = wire_put_node(buf, get_predecessor(), text);
+  len += put_successor_list(buf + len, text);
+  conn_reply(c, OP_REPLY, hdr->flags, buf, len);
+
+  log_debug("Response sent.");
+}
+
+/* ask node for successor of key */
+void handle_query_suc(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling query_suc");
+  uint32_t key = 0;
+  wire_get_u32(r, &key);
+  log_debug("Key %u", key);
+
+  int mode = (hdr->flags & FRAME_RECURSIVE) ? LOOKUP_RECURSIVE : LOOKUP_ITERATIVE;
+  Node successor = lookup_successor(key, mode);
+  log_node(LEVEL_DEBUG, "Successor", successor);
+
+  reply_node(c, successor, hdr->flags);
 
-  /* update node's predecessor */
-  if (strncmp(request, "update_pre", 10) == 0) {
-    printf("Handling update_pre\n");
+  log_debug("Response sent.");
+}
+
+/* ask node for predecessor of key */
+void handle_query_pre(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling query_pre");
+  uint32_t key = 0;
+  wire_get_u32(r, &key);
+  log_debug("Key %u", key);
+
+  Node predecessor = routing_find_predecessor(&self_route, key, NULL);
+  log_node(LEVEL_DEBUG, "Predecessor", predecessor);
+
+  reply_node(c, predecessor, hdr->flags);
+
+  log_debug("Response sent.");
+}
 
-    Node n = parse_incoming_node(&client);
-    self_predecessor = n;
-    printf("New predecessor: \n");
-    print_node(self_predecessor);
-    Close(clientfd);
-    printf("Done update_pre\n");
+/* ask node for closest preceding finger of key */
+void handle_query_cpf(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling query_cpf");
+  uint32_t key = 0;
+  wire_get_u32(r, &key);
+  log_debug("Key %u", key);
+
+  Node cpf = routing_closest_preceding_finger(&self_route, key);
+  log_node(LEVEL_DEBUG, "Closest preceding finger", cpf);
+
+  reply_node(c, cpf, hdr->flags);
+
+  log_debug("Response sent.");
+}
+
+/* ask node for closest preceding finger of key and its successor */
+void handle_query_hop(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling query_hop");
+  uint32_t key = 0;
+  wire_get_u32(r, &key);
+  log_debug("Key %u", key);
+
+  Node successor;
+  Node cpf = routing_closest_preceding_hop(&self_route, key, &successor);
+  log_node(LEVEL_DEBUG, "Closest preceding finger", cpf);
+  log_node(LEVEL_DEBUG, "Its successor", successor);
+
+  char buf[2 * WIRE_NODE_MAX];
+  size_t len = wire_put_node(buf, cpf, hdr->flags & FRAME_TEXT);
+  len += wire_put_node(buf + len, successor, hdr->flags & FRAME_TEXT);
+  conn_reply(c, OP_REPLY, hdr->flags, buf, len);
+
+  log_debug("Response sent.");
+}
+
+/* update node's successor */
+void handle_update_suc(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling update_suc");
+
+  Node n = parse_incoming_node(r);
+  routing_update_successor(&self_route, n);
+  log_node(LEVEL_INFO, "New successor", n);
+  log_debug("Done update_suc");
+}
+
+/* update node's predecessor */
+void handle_update_pre(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling update_pre");
+
+  Node n = parse_incoming_node(r);
+  routing_update_predecessor(&self_route, n);
+  log_node(LEVEL_INFO, "New predecessor", n);
+  log_debug("Done update_pre");
+}
+
+/* update node's finger table (entry) */
+void handle_update_fin(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling update_fin");
+  uint32_t index = 0;
+
+  Node s;
+
+  if (wire_get_node(r, &s) < 0 || wire_get_u32(r, &index) < 0 || index >= KEY_SIZE) {
+    log_error("Bad update_fin request");
+    dispatch_failed();
+    return;
   }
 
-  /* update node's finger table (entry) */
-  if (strncmp(request, "update_fin", 10) == 0) {
-    printf("Handling update_fin\n");
-    uint32_t index;
+  routing_update_finger_table(&self_route, s, index);
 
-    Node s = parse_incoming_node(&client);
+  log_debug("Done update_fin");
+}
 
-    numBytes = Rio_readlineb(&client, request, MAXLINE);
-    if (numBytes <= 0) {
-      printf("No request received\n");
-    } else {
-      index = (uint32_t) atoi(request);
-    }
+/* Handle remove_node request */
+void handle_remove_node(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling remove_node");
+  uint32_t index = 0;
 
-    update_finger_table(s, index);
+  Node old, replace;
 
-    Close(clientfd);
-    printf("Done update_fin\n");
+  if (wire_get_node(r, &old) < 0 || wire_get_u32(r, &index) < 0 || index >= KEY_SIZE ||
+      wire_get_node(r, &replace) < 0) {
+    log_error("Bad remove_node request");
+    dispatch_failed();
+    return;
   }
 
-  /* Handle remove_node request */
-  if (strncmp(request, "remove_node", 11) == 0) {
-    printf("Handling remove_node\n");
-    uint32_t index;
+  routing_remove_node(&self_route, old, index, replace);
 
-    Node old = parse_incoming_node(&client);
+  log_debug("Done remove_node");
+}
 
-    numBytes = Rio_readlineb(&client, request, MAXLINE);
-    if (numBytes <= 0) {
-      printf("No request received\n");
-    } else {
-      index = (uint32_t) atoi(request);
-    }
+/* QUERY - ask for data given search_key */
+void handle_search_query(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling search_query");
+
+  char response[MAXLINE];
+  size_t outlen = 0;
+  bool key_found = route_data(OP_GET, payload, hdr->length, NULL, 0, response, &outlen) == STATUS_OK;
+
+  if (key_found) {
+    strcpy(response, "Search key found.");
+  } else {
+    strcpy(response, "Not found.");
+  }
 
-    Node replace = parse_incoming_node(&client);
+  conn_reply(c, OP_REPLY, 0, response, strlen(response));
 
-    remove_node(old, index, replace);
+  log_debug("Response sent.");
+}
 
-    Close(clientfd);
-    printf("Done remove_node\n");
+/* put/get/delete: run it if we own the key, else pass it to the owner */
+void handle_data(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  int opcode = hdr->opcode;
+  log_debug("Handling %s", opcode_name(opcode));
+  char *key = NULL, out[MAXLINE];
+  size_t klen = 0, outlen = 0;
+  int status;
+
+  if (wire_get_bytes(r, &key, &klen) < 0) {
+    status = STATUS_ERROR;
+  } else if (hdr->flags & FRAME_DIRECT) {
+    uint32_t id = hash_key(key, klen);
+    bool handoff = opcode == OP_GET && (hdr->flags & FRAME_HANDOFF);
+    status = owns(id) || handoff ? execute_data(opcode, id, key, klen, r->pos, r->end - r->pos, out, &outlen)
+                                 : STATUS_NOT_OWNER;
+  } else {
+    status = route_data(opcode, key, klen, r->pos, r->end - r->pos, out, &outlen);
   }
 
-  /* QUERY - ask for data given search_key */
-  if (strncmp(request, "search_query", 12) == 0) {
-    printf("Handling search_query\n");
+  if (status == STATUS_ERROR) {
+    dispatch_failed();
+  }
+  char buf[WIRE_U32_MAX];
+  struct iovec iov[2] = {
+    { buf, wire_put_u32(buf, status, hdr->flags & FRAME_TEXT) },
+    { out, outlen }
+  };
+  conn_replyv(c, OP_REPLY, hdr->flags, iov, 2);
+  log_debug("Response sent.");
+}
 
-    char search_key[MAXLINE], response[MAXLINE];
-    strcpy(search_key, request+12);
-    int size = sizeof(self_data) / sizeof(self_data[0]);
-    bool key_found = false;
-    int i;
-    for (i = 0; i < size; i++) {
-      if (strcmp(self_data[i], search_key) == 0) {
-        key_found = true;
-      }
-    }
+/* Ask for finger table */
+void handle_print_table(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  printf("Printing self finger table: \n");
+  const ring_state *ring = ring_read_lock();
+  int i;
+  for (i = 0; i < KEY_SIZE; i++) {
+    printf("Finger %d: \n", i);
+    print_node(ring->finger_table[i]);
+    println();
+  }
+  ring_read_unlock();
+  unsigned long hits, misses;
+  lcache_counters(&hits, &misses);
+  printf("Lookup cache: %lu hits, %lu misses\n", hits, misses);
+  size_t len;
+  char *report = stats_report(&len);
+  printf("%s", report);
+  Free(report);
+  printf("Finished printing finger table.\n");
+}
 
-    if (key_found) {
-      strcpy(response, "Search key found.");
-    } else {
-      strcpy(response, "Not found.");
-    }
+/* Recursive lookup: answer the origin if we know the owner, else pass it on */
+void handle_find_suc(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling find_suc");
+  uint32_t key = 0, id = 0;
+  wire_get_u32(r, &key);
+  wire_get_u32(r, &id);
+  Node origin = parse_incoming_node(r);
+  uint32_t hops = 0;
+  wire_get_u32(r, &hops); /* absent from older nodes */
+
+  route_lookup(key, id, origin, hops);
+  log_debug("Done find_suc");
+}
 
-    if (rio_writen(clientfd, response, MAXLINE) < 0) {
-      perror("Send error:");
-    }
+/* Result of a recursive lookup we started */
+void handle_found_suc(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling found_suc");
+  uint32_t id = 0;
+  wire_get_u32(r, &id);
+  Node successor = parse_incoming_node(r);
+  uint32_t start = successor.key, hops = 0;
+  wire_get_u32(r, &start);
+  wire_get_u32(r, &hops);
+
+  complete_lookup(id, successor, start, hops);
+  log_debug("Done found_suc");
+}
+
+/* n may be our predecessor */
+void handle_notify(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling notify");
+  Node n = parse_incoming_node(r);
+  routing_notify(&self_route, n);
+}
 
-    shutdown(clientfd, SHUT_WR);
-    printf("Response sent.\n");
+/*
+ * n joined just before us: stream it the keys it now owns, after the
+ * predecessor it joined after. By now n may have notified us, so our own
+ * predecessor only stands in for a request without the start.
+ */
+void handle_pull_keys(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling pull_keys");
+  Node n = parse_incoming_node(r);
+  Node p = get_predecessor();
+  uint32_t start = p.port == 0 || is_equal(p, n) ? self_node.key : p.key; /* not replicas of earlier ranges */
+  wire_get_u32(r, &start);
+  routing_notify(&self_route, n);
+  int chunks = stream_keys(c, hdr->flags, start, n.key);
+  log_info("Sent %d chunks of keys", chunks);
+}
+
+/* A leaving predecessor hands us its keys; an empty chunk ends it */
+void handle_push_keys(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  Node source = parse_incoming_node(r);
+  uint32_t start = 0, end = 0;
+  wire_get_u32(r, &start);
+  wire_get_u32(r, &end);
+
+  handoff_begin(source, start, end);
+  if (r->pos < r->end) {
+    apply_keys(r);
+    wal_commit(self_wal);
+  } else {
+    handoff_end();
+    log_node(LEVEL_INFO, "Keys received from leaving node", source);
+    char buf[WIRE_U32_MAX];
+    size_t len = wire_put_u32(buf, STATUS_OK, hdr->flags & FRAME_TEXT);
+    conn_reply(c, OP_REPLY, hdr->flags, buf, len);
   }
+}
 
-  /* Ask for finger table */
-  if (strncmp(request, "print_table", 11) == 0) {
-    printf("Printing self finger table: \n");
-    int i;
-    for (i = 0; i < KEY_SIZE; i++) {
-      printf("Finger %d: \n", i);
-      print_node(self_finger_table[i]);
-      println();
-    }
-    printf("Finished printing finger table.\n");
+/* Keys we streamed arrived, so our copies of them can go, unless we keep them as a replica */
+void handle_keys_done(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling keys_done");
+  uint32_t start = 0, end = 0;
+  wire_get_u32(r, &start);
+  wire_get_u32(r, &end);
+  if (replica_factor() == 0) {
+    drop_keys(start, end);
   }
+}
 
-  /* Received ping. Do nothing */
-  if (strncmp(request, "ping", 4) == 0) {
-    printf("Received ping.\n");
+/* Updates from a node we hold replicas for */
+void handle_replicate(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  int count = replica_apply(self_store, r);
+  if (wal_commit(self_wal) < 0) {
+    count = -1;
   }
+  if (count < 0) {
+    dispatch_failed();
+  }
+  char buf[WIRE_U32_MAX];
+  size_t len = wire_put_u32(buf, count < 0 ? STATUS_ERROR : STATUS_OK, hdr->flags & FRAME_TEXT);
+  conn_reply(c, OP_REPLY, hdr->flags, buf, len);
+}
+
+/* Our filter, for a peer or client to skip gets we could not answer */
+void handle_filter(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Handling filter");
+  size_t len = 0;
+  char *buf = NULL;
+  /* Keys on their way here or away would be missing from it */
+  if (!incoming.active && !leaving) {
+    buf = store_filter(self_store, &len);
+  }
+  conn_reply(c, OP_REPLY, 0, buf != NULL && len <= REACTOR_MAX_FRAME ? buf : "",
+             buf != NULL && len <= REACTOR_MAX_FRAME ? len : 0);
+  Free(buf);
+}
+
+/* Our RPC and lookup stats, as a table for query to print */
+void handle_stats(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  size_t len;
+  char *report = stats_report(&len);
+  conn_reply(c, OP_REPLY, 0, report, len);
+  Free(report);
+}
 
-  Close(clientfd);
-  pthread_mutex_unlock(&mutex);
+/* Received ping. Answer so the sender knows we are alive */
+void handle_ping(reactor_conn *c, frame_header *hdr, char payload[], wire_reader *r) {
+  log_debug("Received ping.");
+  conn_reply(c, OP_REPLY, hdr->flags, "", 0);
 }
 
-Node parse_incoming_node(rio_t *client) {
-  int numBytes;
-  char request[MAXLINE];
+Node parse_incoming_node(wire_reader *r) {
   Node n;
 
-  numBytes = Rio_readlineb(client, request, MAXLINE);
-  if (numBytes <= 0) {
-    printf("No request received\n");
-  } else {
-    n.key = (uint32_t) atoi(request);
+  memset(&n, 0, sizeof(Node));
+  if (wire_get_node(r, &n) < 0) {
+    log_error("No request received");
   }
-  request[0] = 0;
-  numBytes = Rio_readlineb(client, request, MAXLINE);
-  if (numBytes <= 0) {
-    printf("No request received\n");
-  } else {
-    int len = strlen(request);
-    if (len > 0 && request[len-1] == '\n') request[len-1] = '\0';
-    strcpy(n.ip_address, request);
-  }
-  request[0] = 0;
-  numBytes = Rio_readlineb(client, request, MAXLINE);
-  if (numBytes <= 0) {
-    printf("No request received\n");
-  } else {
-    n.port = atoi(request);
+  return n;
+}
+
+/* Answer a request with a single node, in the request's encoding */
+void reply_node(reactor_conn *c, Node n, int flags) {
+  char buf[WIRE_NODE_MAX];
+  size_t len = wire_put_node(buf, n, flags & FRAME_TEXT);
+
+  conn_reply(c, OP_REPLY, flags, buf, len);
+}
+
+/* Chord ID of a data key, as query computes it */
+/* Send our records to this node's log files */
+void open_log(int port) {
+  char path[MAXLINE], debug[MAXLINE];
+
+  sprintf(path, LOG_FILE, port);
+  sprintf(debug, DEBUG_FILE, port);
+  if (log_open(path, debug, log_level) < 0) {
+    printf("Could not open %s or %s, logging to neither\n", path, debug);
   }
+}
 
-  return n;
+/* Create our store with what the snapshot and write-ahead log kept from the last run */
+void open_store(int port) {
+  char path[MAXLINE], snapshot[MAXLINE];
+
+  self_store = store_create();
+  sprintf(path, WAL_FILE, port);
+  sprintf(snapshot, WAL_SNAPSHOT_FILE, port);
+  if ((self_wal = wal_recover(path, snapshot, self_store, wal_flush_interval)) == NULL) {
+    log_error("Running without a write-ahead log");
+  }
+}
+
+void put_sample(char *key) {
+  store_put(self_store, hash_key(key, strlen(key)), key, strlen(key), "", 0);
 }
 
 uint32_t hash_address(char *ip_address, int port) {
-  char port_str[5];
   unsigned char hash[SHA_DIGEST_LENGTH];
-  hash[0] = 0;
   uint32_t key;
-  port_str[0] = 0;
-  sprintf(port_str, "%d", port);
-  char data[strlen(ip_address) + strlen(port_str) + sizeof(char)];
-  data[0] = 0;
-  strcat(data, ip_address);
-  strcat(data, ":");
-  strcat(data, port_str);
-  SHA1(data, sizeof(data), hash);
+  char data[strlen(ip_address) + 16];
+  int len = snprintf(data, sizeof(data), "%s:%d", ip_address, port);
+  SHA1((unsigned char *) data, len, hash);
   memcpy(&key, hash + 16, sizeof(key));
   return key;
 }
@@ -582,7 +985,7 @@ uint32_t hash_address(char *ip_address, int port) {
 /* Join */
 void join_node(char *ip_address, int node_port, int listen_port) {
   uint32_t key = 0;
-  int serverfd, i;
+  int serverfd;
 
   /* Set up local node attributes */
   key = hash_address(LOCAL_IP_ADDRESS, listen_port);
@@ -590,399 +993,1236 @@ void join_node(char *ip_address, int node_port, int listen_port) {
   self_node.port = listen_port;
   self_node.key = key;
 
-  /* set data to blank */
-  int size = sizeof(self_data) / sizeof(self_data[0]);
-  for (i = 0; i < size; i++) {
-    self_data[i][0] = 0;
-  }
+  ring_init(self_node);
+  routing_init(&self_route, self_node, successor_list_length, &network_routing, NULL);
+  open_log(listen_port);
+  open_store(listen_port);
 
   /* Initialize remote note */
   Node fetch_node;
   strcpy(fetch_node.ip_address, ip_address);
   fetch_node.port = node_port;
   fetch_node.key = key;
+  self_route.bootstrap = fetch_node;
 
-  /* Initialize predecessor, successor */
-  self_successor = query_successor(key, fetch_node);
-  self_finger_table[0] = self_successor;
-  second_successor = fetch_successor(self_successor);
-  print_node(self_successor);
-  println();
-  self_predecessor = fetch_predecessor(self_successor);
-  print_node(self_predecessor);
-  println();
-  request_update_predecessor(self_node, self_predecessor);
+  /* Only the successor is needed to join; stabilization fills in the rest */
+  Node successor = query_successor(key, fetch_node);
+  routing_update_successor(&self_route, successor);
+  log_node(LEVEL_INFO, "Successor", successor);
+  Node predecessor;
+  memset(&predecessor, 0, sizeof(Node));
+  routing_update_predecessor(&self_route, predecessor);
 
   /* Begin listening */
   int *args = malloc(sizeof(int));
   args[0] = listen_port;
   pthread_t thread;
   if (pthread_create(&thread, NULL, &begin_listening, (void *)args) < 0) {
-    printf("begin_listening thread error\n");
+    log_error("begin_listening thread error");
   }
 
-  /* Initialize finger table */
-  i = 0;
-  int product = 1;
-  /* n+2^i where i = 0..<m */
-  for (i = 1; i < KEY_SIZE; i++) {
-    uint32_t start_key = (key + product) % KEY_SPACE;
-    if (is_between(start_key, self_node.key, self_finger_table[i-1].key - 1)) {
-      self_finger_table[i] = self_finger_table[i-1];
-    } else {
-      self_finger_table[i] = query_successor(start_key, fetch_node);
-      if (!is_between(self_finger_table[i].key, start_key, self_node.key)) {
-        self_finger_table[i] = self_node;
-      }
-    }
-    product = product * 2;
-    printf("finger %d\n", i);
-    print_node(self_finger_table[i]);
-    println();
-  }
+  /* Our keys start after the successor's predecessor, learned before we take its place */
+  Node *joined_after = Malloc(sizeof(Node));
+  *joined_after = fetch_predecessor(successor);
 
-  /* update others */
-  product = 1;
-  for (i = 0; i < KEY_SIZE; i++) {
-    Node p = find_predecessor(self_node.key - product);
-    print_node(p);
-    request_update_finger_table(self_node, i, p);
-    product = product * 2;
+  /* Tell the successor about us now rather than a period from now */
+  stabilize();
+
+  /* Take over our keys from the successor; we serve requests meanwhile */
+  pthread_t pull_thread;
+  if (pthread_create(&pull_thread, NULL, &pull_keys, joined_after) < 0) {
+    log_error("pull_keys thread error");
   }
 
+  predecessor = get_predecessor();
+  successor = get_successor();
   printf("Joining the Chord ring.\n");
   printf("You are listening on port %d\n", self_node.port);
   printf("Your position is %u\n", self_node.key);
-  printf("Your predecessor is node %s, port %d, position %u\n", self_predecessor.ip_address, self_predecessor.port, self_predecessor.key);
-  printf("Your successor is node %s, port %d, position %u\n", self_successor.ip_address, self_successor.port, self_successor.key);
+  printf("Your predecessor is node %s, port %d, position %u\n", predecessor.ip_address, predecessor.port, predecessor.key);
+  printf("Your successor is node %s, port %d, position %u\n", successor.ip_address, successor.port, successor.key);
 
-  pthread_t thread2;
-  if (pthread_create(&thread2, NULL, &keep_alive, NULL) < 0) {
-    printf("receive_client thread error\n");
-  }
+  start_maintenance();
 
   pthread_join(thread, NULL);
 }
 
 Node find_successor(uint32_t key) {
-  Node n = find_predecessor(key);
-  return fetch_successor(n);
+  return lookup_successor(key, lookup_mode);
 }
 
-Node find_predecessor(uint32_t key) {
-  if (self_node.key == self_successor.key) {
-    return self_node;
+/* Successor of key from the lookup cache, else resolved and cached */
+Node lookup_successor(uint32_t key, int mode) {
+  Node owner;
+  uint32_t start;
+
+  if (lcache_lookup(key, &owner)) {
+    stats_hops(0);
+    return owner;
+  }
+  owner = resolve_successor(key, mode, &start);
+  if (owner.port != 0 && is_between(key, start + 1, owner.key)) {
+    lcache_insert(start, owner.key, owner);
   }
-  Node n = self_node;
-  Node suc = self_successor;
+  return owner;
+}
 
-  while (!is_between(key, n.key + 1, suc.key) && key != suc.key) {
-    Node n_prime = query_closest_preceding_finger(key, n);
-    // if (is_equal(n, n_prime))
-    //   break;
-    n = n_prime;
-    suc = fetch_successor(n);
+/* Walk the ring for key's successor, which owns (*start, successor]; counts the hops taken */
+Node resolve_successor(uint32_t key, int mode, uint32_t *start) {
+  Node successor;
+  int hops = 0;
+
+  if (mode == LOOKUP_RECURSIVE) {
+    successor = find_successor_recursive(key, start, &hops);
+  } else {
+    successor = routing_find_successor(&self_route, key, start, &hops);
   }
-  return n;
+  if (successor.port != 0) {
+    stats_hops(hops);
+  }
+  return successor;
 }
 
-Node closest_preceding_finger(uint32_t key) {
-  int i;
-  for (i = KEY_SIZE - 1; i >= 0; i--) {
-    if (is_between(self_finger_table[i].key, self_node.key + 1, key - 1)) {
-      return self_finger_table[i];
+/*
+ * find_successor_recursive - Start a lookup that every hop forwards to its
+ * closest preceding finger; the node that knows the owner sends found_suc
+ * straight back here. Costs the originator one message instead of two
+ * round trips per hop. If no answer arrives in LOOKUP_TIMEOUT (a hop may
+ * have left) the lookup is repeated iteratively.
+ */
+Node find_successor_recursive(uint32_t key, uint32_t *start, int *hops) {
+  pending_lookup l;
+  struct timespec deadline;
+  pending_lookup **prev;
+
+  memset(&l, 0, sizeof(l));
+  pthread_cond_init(&l.cond, NULL);
+  pthread_mutex_lock(&lookups_mutex);
+  l.id = next_lookup_id++;
+  l.next = pending_lookups;
+  pending_lookups = &l;
+  pthread_mutex_unlock(&lookups_mutex);
+
+  route_lookup(key, l.id, self_node, 0);
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += LOOKUP_TIMEOUT;
+  pthread_mutex_lock(&lookups_mutex);
+  while (!l.done) {
+    if (pthread_cond_timedwait(&l.cond, &lookups_mutex, &deadline) != 0) {
+      break;
     }
   }
-  return self_node;
+  for (prev = &pending_lookups; *prev != &l; prev = &(*prev)->next);
+  *prev = l.next;
+  pthread_mutex_unlock(&lookups_mutex);
+  pthread_cond_destroy(&l.cond);
+
+  if (!l.done) {
+    log_info("Recursive lookup for %u timed out, retrying iteratively", key);
+    return routing_find_successor(&self_route, key, start, hops);
+  }
+  *start = l.start;
+  *hops = l.hops;
+  return l.result;
 }
 
-void update_successor(Node successor) {
+/* One hop of a recursive lookup for key started by origin, hops nodes ago */
+void route_lookup(uint32_t key, uint32_t id, Node origin, int hops) {
+  Node successor = get_successor();
 
+  if (is_equal(successor, self_node) || is_between(key, self_node.key + 1, successor.key)) {
+    request_found_successor(id, successor, origin, hops);
+    return;
+  }
+  Node next = routing_closest_preceding_finger(&self_route, key);
+  if (is_equal(next, self_node)) {
+    next = successor;
+  }
+  request_find_successor(key, id, origin, hops + 1, next);
 }
 
-void update_predecessor(Node predecessor) {
+void complete_lookup(uint32_t id, Node successor, uint32_t start, int hops) {
+  pending_lookup *l;
+
+  pthread_mutex_lock(&lookups_mutex);
+  for (l = pending_lookups; l != NULL; l = l->next) {
+    if (l->id == id) {
+      l->result = successor;
+      l->start = start;
+      l->hops = hops;
+      l->done = true;
+      pthread_cond_signal(&l->cond);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lookups_mutex);
+}
+
+/* Successor of n from the cache, else fetched and cached */
+Node cached_successor(Node n) {
+  successor_entry *e = &successor_cache[n.key % SUCCESSOR_CACHE_SIZE];
+  Node successor;
+  bool hit;
 
+  pthread_mutex_lock(&successor_cache_mutex);
+  hit = is_equal(e->node, n) && time(NULL) - e->fetched < SUCCESSOR_CACHE_TTL;
+  successor = e->successor;
+  pthread_mutex_unlock(&successor_cache_mutex);
+
+  if (hit) {
+    return successor;
+  }
+  return fetch_successor(n);
 }
 
-void update_finger_table(Node s, int i) {
-  if (s.key == self_node.key) {
+void cache_successor(Node n, Node successor) {
+  successor_entry *e = &successor_cache[n.key % SUCCESSOR_CACHE_SIZE];
+
+  if (successor.port == 0) { /* no answer */
     return;
   }
-  if (is_between(s.key, self_node.key + 1, self_finger_table[i].key)) {
-    self_finger_table[i] = s;
-    if (i == 0) {
-      self_successor = s;
-      second_successor = fetch_successor(self_successor);
+  pthread_mutex_lock(&successor_cache_mutex);
+  e->node = n;
+  e->successor = successor;
+  e->fetched = time(NULL);
+  pthread_mutex_unlock(&successor_cache_mutex);
+}
+
+/* Drop cached successors, key ranges and filters a node joining or leaving may have changed */
+void forget_successors(Node changed) {
+  successor_entry *e;
+  int i;
+
+  lcache_invalidate(changed);
+  forget_filters();
+
+  pthread_mutex_lock(&successor_cache_mutex);
+  for (i = 0; i < SUCCESSOR_CACHE_SIZE; i++) {
+    e = &successor_cache[i];
+    if (is_equal(e->node, changed) || is_between(changed.key, e->node.key + 1, e->successor.key)) {
+      e->fetched = 0;
     }
-    printf("Finger for index %d is now: \n", i);
-    print_node(s);
-    println();
-    Node p = self_predecessor;
-    if (s.key != p.key) {
-      request_update_finger_table(s, i, p);
+  }
+  pthread_mutex_unlock(&successor_cache_mutex);
+}
+
+/* Whether n's filter, if we have a fresh copy, allows n to hold the key */
+bool peer_may_have(Node n, uint32_t id, char *key, size_t klen) {
+  filter_entry *e = &filter_cache[n.key % FILTER_CACHE_SIZE];
+  bool may = true;
+
+  if (peer_filter_ttl == 0) {
+    return true;
+  }
+  pthread_mutex_lock(&filter_cache_mutex);
+  if (is_equal(e->node, n) && e->filter != NULL && time(NULL) - e->fetched < peer_filter_ttl) {
+    may = filter_contains(e->filter, id, filter_tag(key, klen));
+  } else {
+    if (!is_equal(e->node, n)) {
+      filter_free(e->filter);
+      e->filter = NULL;
+      e->node = n;
     }
+    e->wanted = true;
   }
+  pthread_mutex_unlock(&filter_cache_mutex);
+  return may;
 }
 
-void remove_node(Node old, int i, Node replace) {
-  if (is_equal(self_finger_table[i], old)) {
-    self_finger_table[i] = replace;
-    if (i == 0) {
-      self_successor = replace;
-      second_successor = fetch_successor(self_successor);
+/* We put a key on n; make our copy of its filter agree */
+void peer_added(Node n, uint32_t id, char *key, size_t klen) {
+  filter_entry *e = &filter_cache[n.key % FILTER_CACHE_SIZE];
+
+  if (peer_filter_ttl == 0) {
+    return;
+  }
+  pthread_mutex_lock(&filter_cache_mutex);
+  if (is_equal(e->node, n)) {
+    e->writes++;
+    if (e->filter != NULL && filter_add(e->filter, id, filter_tag(key, klen)) < 0) {
+      filter_free(e->filter);
+      e->filter = NULL;
+    }
+  }
+  pthread_mutex_unlock(&filter_cache_mutex);
+}
+
+/* Drop every peer filter; keys may have changed hands */
+void forget_filters() {
+  int i;
+
+  pthread_mutex_lock(&filter_cache_mutex);
+  for (i = 0; i < FILTER_CACHE_SIZE; i++) {
+    filter_free(filter_cache[i].filter);
+    filter_cache[i].filter = NULL;
+  }
+  pthread_mutex_unlock(&filter_cache_mutex);
+}
+
+/* Refresh the peer filters gets have asked for */
+void fetch_filters() {
+  filter_entry *e;
+  filter *f;
+  Node n;
+  int i, writes;
+
+  for (i = 0; i < FILTER_CACHE_SIZE; i++) {
+    e = &filter_cache[i];
+    pthread_mutex_lock(&filter_cache_mutex);
+    n = e->node;
+    writes = e->writes;
+    if (!e->wanted || n.port == 0) {
+      pthread_mutex_unlock(&filter_cache_mutex);
+      continue;
+    }
+    e->wanted = false;
+    pthread_mutex_unlock(&filter_cache_mutex);
+
+    f = fetch_filter(n);
+
+    pthread_mutex_lock(&filter_cache_mutex);
+    if (f != NULL && is_equal(e->node, n) && e->writes == writes) {
+      filter_free(e->filter);
+      e->filter = f;
+      e->fetched = time(NULL);
+    } else {
+      /* A put we routed may have reached n after it encoded f */
+      filter_free(f);
     }
-    request_remove_node(old, i, replace, self_predecessor);
+    pthread_mutex_unlock(&filter_cache_mutex);
   }
 }
 
-/* inclusive! */
-bool is_between(uint32_t key, uint32_t a, uint32_t b) {
-  if (key == a || key == b || a == b) {
+Node get_successor() {
+  const ring_state *ring = ring_read_lock();
+  Node successor = ring->successor;
+  ring_read_unlock();
+  return successor;
+}
+
+Node get_predecessor() {
+  const ring_state *ring = ring_read_lock();
+  Node predecessor = ring->predecessor;
+  ring_read_unlock();
+  return predecessor;
+}
+
+/* True if id falls in (predecessor, self]; with no predecessor known, assume so */
+bool owns(uint32_t id) {
+  Node p = get_predecessor();
+
+  if (leaving) {
+    return false;
+  }
+  if (p.port == 0 || is_equal(p, self_node)) {
     return true;
   }
-  if (a < key) {
-    if (b < a) { // wrap around
-      return true;
+  return is_between(id, p.key + 1, self_node.key);
+}
+
+/*
+ * route_data - Run a data request on the owner of hash_key(key): here if
+ * we own it, else on the node find_successor names, unless it is a get
+ * the owner's filter rules out. An owner that turns
+ * the key down means our cached range was stale, so it is dropped and
+ * the lookup repeated once. A get whose owner does not answer is read
+ * from the first node after it that we know of, normally its successor
+ * and so its first replica; lookups would still route through the dead
+ * node until the ring repairs itself. For get, the value goes to out.
+ */
+int route_data(int opcode, char *key, size_t klen, char *value, size_t vlen, char *out, size_t *outlen) {
+  uint32_t id = hash_key(key, klen);
+  int attempt, status = STATUS_NOT_OWNER;
+  Node owner;
+
+  for (attempt = 0; attempt < 2 && (status == STATUS_NOT_OWNER || status < 0); attempt++) {
+    if (owns(id)) {
+      return execute_data(opcode, id, key, klen, value, vlen, out, outlen);
+    }
+    owner = find_successor(id);
+    if (owner.port == 0 || is_equal(owner, self_node)) {
+      return execute_data(opcode, id, key, klen, value, vlen, out, outlen);
+    }
+    if (opcode == OP_GET && !peer_may_have(owner, id, key, klen)) {
+      *outlen = 0;
+      return STATUS_NOT_FOUND;
+    }
+    status = request_data(owner, opcode, FRAME_DIRECT, key, klen, value, vlen, out, outlen);
+    if (opcode == OP_PUT && status == STATUS_OK) {
+      peer_added(owner, id, key, klen);
+    }
+    if (status == STATUS_NOT_OWNER || status < 0) {
+      lcache_forget(id);
+    }
+  }
+  if (status < 0 && opcode == OP_GET && replica_factor() > 0) {
+    Node replica = next_known_node(owner);
+    if (replica.port != 0) {
+      status = is_equal(replica, self_node)
+               ? execute_data(opcode, id, key, klen, value, vlen, out, outlen)
+               : request_data(replica, opcode, FRAME_DIRECT | FRAME_HANDOFF, key, klen, value, vlen, out, outlen);
+    }
+  }
+  return status < 0 ? STATUS_ERROR : status;
+}
+
+/*
+ * execute_data - Run a data request against our own store. While a
+ * handoff brings id's range here, a get we miss is asked of the source,
+ * and writes are recorded so the transfer does not undo them.
+ */
+int execute_data(int opcode, uint32_t id, char *key, size_t klen, char *value, size_t vlen, char *out, size_t *outlen) {
+  replica_ticket ticket;
+  Node source;
+  bool deleted;
+  ssize_t n;
+  int status;
+
+  *outlen = 0;
+  switch (opcode) {
+  case OP_PUT:
+    if (vlen > MAXLINE - WIRE_U32_MAX) { /* would not fit in a get reply */
+      return STATUS_ERROR;
+    }
+    replica_lock(id);
+    if (!handoff_lock(id, NULL)) {
+      store_put(self_store, id, key, klen, value, vlen);
     } else {
-      if (key < b) {
-        return true;
+      store_put(self_store, id, key, klen, value, vlen);
+      store_delete(incoming.deleted, id, key, klen);
+      handoff_unlock();
+    }
+    replica_queue(&ticket, REPLICA_PUT, id, key, klen, value, vlen);
+    replica_unlock(id);
+    status = replica_wait(&ticket) == 0 ? STATUS_OK : STATUS_ERROR;
+    if (wal_commit(self_wal) < 0) {
+      status = STATUS_ERROR;
+    }
+    return status;
+  case OP_GET:
+    if ((n = store_get(self_store, id, key, klen, out, MAXLINE - WIRE_U32_MAX)) >= 0) {
+      *outlen = n;
+      return STATUS_OK;
+    }
+    if (!handoff_lock(id, &source)) {
+      return STATUS_NOT_FOUND;
+    }
+    deleted = store_get(incoming.deleted, id, key, klen, NULL, 0) >= 0;
+    handoff_unlock();
+    if (deleted) {
+      return STATUS_NOT_FOUND;
+    }
+    status = request_data(source, OP_GET, FRAME_DIRECT | FRAME_HANDOFF, key, klen, NULL, 0, out, outlen);
+    return status < 0 || status == STATUS_NOT_OWNER ? STATUS_NOT_FOUND : status;
+  case OP_DELETE:
+    replica_lock(id);
+    if (!handoff_lock(id, NULL)) {
+      status = store_delete(self_store, id, key, klen) == 0 ? STATUS_OK : STATUS_NOT_FOUND;
+    } else {
+      /* The key may still be on its way, so the delete counts either way */
+      store_delete(self_store, id, key, klen);
+      store_put(incoming.deleted, id, key, klen, "", 0);
+      handoff_unlock();
+      status = STATUS_OK;
+    }
+    replica_queue(&ticket, REPLICA_DELETE, id, key, klen, "", 0);
+    replica_unlock(id);
+    if (replica_wait(&ticket) < 0) {
+      status = STATUS_ERROR;
+    }
+    if (wal_commit(self_wal) < 0) {
+      status = STATUS_ERROR;
+    }
+    return status;
+  default:
+    return STATUS_ERROR;
+  }
+}
+
+/*
+ * pull_keys - Fetch the keys we own now from our successor, which held
+ * them until we joined: those after args, the predecessor we joined
+ * after. They stream in as chunks, while we already answer for the
+ * range; once all are here the successor drops its copies.
+ */
+void *pull_keys(void *args) {
+  Node source = get_successor(), predecessor = *(Node *) args;
+  char request_string[WIRE_NODE_MAX + WIRE_U32_MAX], *chunk = NULL;
+  size_t len = wire_put_node(request_string, self_node, wire_text), cap = 0;
+  int flags = wire_text ? FRAME_TEXT : 0, chunks = 0, keys = 0, n;
+  frame_header hdr;
+  wire_reader r;
+  pool_conn *conn;
+  bool retry;
+  ssize_t rc, written;
+  uint32_t start;
+
+  Free(args);
+  if (is_equal(source, self_node)) {
+    return NULL;
+  }
+  /* With no predecessor known the successor was alone, and we take what it does not keep */
+  start = predecessor.port == 0 || is_equal(predecessor, self_node) ? source.key : predecessor.key;
+  len += wire_put_u32(request_string + len, start, wire_text);
+  handoff_begin(source, start, self_node.key);
+
+  do {
+    rc = -1;
+    if ((conn = pool_acquire(source.ip_address, source.port)) == NULL) {
+      break;
+    }
+    if ((written = rio_writeframe(conn->fd, OP_PULL_KEYS, flags, request_string, len)) >= 0) {
+      while ((rc = rio_readframe_grow(&conn->rio, &hdr, &chunk, &cap, REACTOR_MAX_FRAME)) == 1 &&
+             hdr.length > 0) {
+        wire_reader_init(&r, &hdr, chunk);
+        if ((n = apply_keys(&r)) < 0) {
+          rc = -1;
+          break;
+        }
+        keys += n;
+        chunks++;
       }
     }
-  } else {
-    if (key < b && b < a) {
-      return true;
+    retry = false;
+    if (rc == 1) {
+      pool_release(conn);
+    } else {
+      retry = chunks == 0 && closed_idle(conn, written, rc);
+      pool_discard(conn);
+    }
+  } while (retry);
+
+  handoff_end();
+  Free(chunk);
+  if (rc != 1) {
+    log_error("Key transfer from successor failed");
+    return NULL;
+  }
+  log_info("Received %d keys in %d chunks from successor", keys, chunks);
+  wal_commit(self_wal);
+
+  char done_string[2 * WIRE_U32_MAX];
+  len = wire_put_u32(done_string, start, wire_text);
+  len += wire_put_u32(done_string + len, self_node.key, wire_text);
+  send_request(source, OP_KEYS_DONE, done_string, len);
+  return NULL;
+}
+
+/* Leave the ring gracefully on SIGINT or SIGTERM */
+void *wait_for_leave(void *args) {
+  sigset_t leave_signals;
+  int sig;
+
+  sigemptyset(&leave_signals);
+  sigaddset(&leave_signals, SIGINT);
+  sigaddset(&leave_signals, SIGTERM);
+  sigwait(&leave_signals, &sig);
+
+  printf("Leaving the Chord ring.\n");
+  leave_ring();
+  log_flush();
+  exit(0);
+}
+
+/*
+ * leave_ring - Hand our keys to our successor before exiting. The
+ * neighbours are linked to each other first, so the successor answers
+ * for our range at once; reads for keys that have not reached it yet
+ * come back to us until the last chunk is through.
+ */
+void leave_ring() {
+  if (self_store == NULL) {
+    return;
+  }
+  Node successor = get_successor(), predecessor = get_predecessor();
+  uint32_t start = self_node.key;
+
+  leaving = true;
+  if (is_equal(successor, self_node)) {
+    return;
+  }
+  request_update_predecessor(predecessor, successor);
+  if (predecessor.port != 0 && !is_equal(predecessor, self_node)) {
+    request_update_successor(successor, predecessor);
+    start = predecessor.key;
+  }
+  if (push_keys(successor, start) < 0) {
+    log_error("Could not hand keys to successor");
+  }
+}
+
+/* Add one key to the chunk list; a store_visit */
+typedef struct chunk_list
+{
+  char *prefix;         /* copied to the front of every chunk */
+  size_t prefix_len;
+  bool text;
+  key_chunk *head, *tail;
+} chunk_list;
+
+static void collect_key(uint32_t id, char *key, size_t klen, char *value, size_t vlen, void *arg) {
+  chunk_list *l = arg;
+  size_t need = 3 * WIRE_U32_MAX + klen + vlen + 2;
+  key_chunk *chunk = l->tail;
+
+  if (chunk == NULL || chunk->len + need > chunk->cap) {
+    size_t cap = l->prefix_len + (need > MIGRATE_CHUNK ? need : MIGRATE_CHUNK);
+    chunk = Malloc(sizeof(key_chunk) + cap);
+    chunk->next = NULL;
+    chunk->cap = cap;
+    memcpy(chunk->data, l->prefix, l->prefix_len);
+    chunk->len = l->prefix_len;
+    if (l->tail == NULL) {
+      l->head = chunk;
+    } else {
+      l->tail->next = chunk;
+    }
+    l->tail = chunk;
+  }
+  chunk->len += wire_put_u32(chunk->data + chunk->len, id, l->text);
+  chunk->len += wire_put_bytes(chunk->data + chunk->len, key, klen, l->text);
+  chunk->len += wire_put_bytes(chunk->data + chunk->len, value, vlen, l->text);
+}
+
+/*
+ * collect_keys - Encode our keys in (start, end] into chunks. The store
+ * is only locked while copying, never while the chunks are sent.
+ */
+static key_chunk *collect_keys(uint32_t start, uint32_t end, char *prefix, size_t prefix_len, bool text) {
+  chunk_list l = { prefix, prefix_len, text, NULL, NULL };
+
+  store_foreach_range(self_store, start + 1, end, collect_key, &l);
+  return l.head;
+}
+
+/*
+ * stream_keys - Send our keys in (start, end] down c as reply frames of
+ * about MIGRATE_CHUNK bytes, then an empty frame. Each chunk is freed
+ * once written. Returns the number of chunks, or -1 if c broke.
+ */
+int stream_keys(reactor_conn *c, int flags, uint32_t start, uint32_t end) {
+  key_chunk *chunk = collect_keys(start, end, NULL, 0, flags & FRAME_TEXT), *next;
+  int chunks = 0, rc = 0;
+
+  for (; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    if (rc == 0 && (rc = conn_stream(c, OP_REPLY, flags, chunk->data, chunk->len)) == 0) {
+      chunks++;
+    }
+    Free(chunk);
+  }
+  if (rc < 0 || conn_stream(c, OP_REPLY, flags, "", 0) < 0) {
+    return -1;
+  }
+  return chunks;
+}
+
+/*
+ * push_keys - Send our keys in (start, self] to n as push_keys frames,
+ * then an empty one, and wait for n to confirm. Returns 0 or -1.
+ */
+int push_keys(Node n, uint32_t start) {
+  char prefix[WIRE_NODE_MAX + 2 * WIRE_U32_MAX], response[MAXLINE];
+  size_t prefix_len = wire_put_node(prefix, self_node, wire_text);
+  int flags = wire_text ? FRAME_TEXT : 0, rc = 0, chunks = 0;
+  key_chunk *chunk, *next;
+  frame_header hdr;
+  pool_conn *conn;
+
+  prefix_len += wire_put_u32(prefix + prefix_len, start, wire_text);
+  prefix_len += wire_put_u32(prefix + prefix_len, self_node.key, wire_text);
+  chunk = collect_keys(start, self_node.key, prefix, prefix_len, wire_text);
+
+  if ((conn = pool_acquire(n.ip_address, n.port)) == NULL) {
+    rc = -1;
+  }
+  for (; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    if (rc == 0 && (rc = rio_writeframe(conn->fd, OP_PUSH_KEYS, flags, chunk->data, chunk->len)) >= 0) {
+      rc = 0;
+      chunks++;
+    }
+    Free(chunk);
+  }
+  if (rc < 0 || rio_writeframe(conn->fd, OP_PUSH_KEYS, flags, prefix, prefix_len) < 0 ||
+      rio_readframeb(&conn->rio, &hdr, response, MAXLINE) != 1) {
+    if (conn != NULL) {
+      pool_discard(conn);
+    }
+    return -1;
+  }
+  pool_release(conn);
+  log_info("Handed %d chunks of keys to successor", chunks);
+  return 0;
+}
+
+/*
+ * apply_keys - Store the keys of one chunk, unless already written or
+ * deleted here during the handoff. Returns the number of keys, or -1 if
+ * the chunk is malformed.
+ */
+int apply_keys(wire_reader *r) {
+  char *key, *value;
+  size_t klen, vlen;
+  uint32_t id;
+  int count = 0;
+
+  pthread_mutex_lock(&handoff_mutex);
+  incoming.touched = time(NULL);
+  while (r->pos < r->end) {
+    if (wire_get_u32(r, &id) < 0 || wire_get_bytes(r, &key, &klen) < 0 ||
+        wire_get_bytes(r, &value, &vlen) < 0) {
+      count = -1;
+      break;
+    }
+    if (incoming.deleted == NULL || store_get(incoming.deleted, id, key, klen, NULL, 0) < 0) {
+      store_put_new(self_store, id, key, klen, value, vlen);
+    }
+    count++;
+  }
+  pthread_mutex_unlock(&handoff_mutex);
+  return count;
+}
+
+/* Delete our keys in (start, end] that we do not own, once handed over */
+void drop_keys(uint32_t start, uint32_t end) {
+  key_chunk *chunk = collect_keys(start, end, NULL, 0, false), *next;
+  frame_header hdr;
+  wire_reader r;
+  char *key, *value;
+  size_t klen, vlen;
+  uint32_t id;
+  int dropped = 0;
+
+  hdr.flags = 0;
+  for (; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    hdr.length = chunk->len;
+    wire_reader_init(&r, &hdr, chunk->data);
+    while (wire_get_u32(&r, &id) == 0 && wire_get_bytes(&r, &key, &klen) == 0 &&
+           wire_get_bytes(&r, &value, &vlen) == 0) {
+      if (!owns(id) && store_delete(self_store, id, key, klen) == 0) {
+        dropped++;
+      }
+    }
+    Free(chunk);
+  }
+  log_info("Dropped %d keys handed over", dropped);
+}
+
+/* Start taking (start, end] from source, after any other handoff ends */
+void handoff_begin(Node source, uint32_t start, uint32_t end) {
+  pthread_mutex_lock(&handoff_mutex);
+  while (incoming.active && !is_equal(incoming.source, source) &&
+         time(NULL) - incoming.touched <= HANDOFF_TIMEOUT) {
+    struct timespec deadline = { time(NULL) + 1, 0 };
+    pthread_cond_timedwait(&handoff_cond, &handoff_mutex, &deadline);
+  }
+  if (!incoming.active || !is_equal(incoming.source, source)) {
+    if (incoming.deleted != NULL) {
+      store_free(incoming.deleted);
+    }
+    incoming.source = source;
+    incoming.start = start;
+    incoming.end = end;
+    incoming.deleted = store_create();
+    incoming.active = true;
+  }
+  incoming.touched = time(NULL);
+  pthread_mutex_unlock(&handoff_mutex);
+}
+
+void handoff_end() {
+  pthread_mutex_lock(&handoff_mutex);
+  incoming.active = false;
+  if (incoming.deleted != NULL) {
+    store_free(incoming.deleted);
+    incoming.deleted = NULL;
+  }
+  pthread_cond_broadcast(&handoff_cond);
+  pthread_mutex_unlock(&handoff_mutex);
+}
+
+/*
+ * handoff_lock - If id is in a live handoff, lock the handoff, set
+ * *source (unless NULL) and return true; the caller unlocks. Cheap when
+ * no handoff runs.
+ */
+bool handoff_lock(uint32_t id, Node *source) {
+  if (!incoming.active) {
+    return false;
+  }
+  pthread_mutex_lock(&handoff_mutex);
+  if (incoming.active && is_between(id, incoming.start + 1, incoming.end) &&
+      time(NULL) - incoming.touched <= HANDOFF_TIMEOUT) {
+    if (source != NULL) {
+      *source = incoming.source;
     }
+    return true;
   }
+  pthread_mutex_unlock(&handoff_mutex);
   return false;
 }
 
+void handoff_unlock() {
+  pthread_mutex_unlock(&handoff_mutex);
+}
+
+/* The node closest after n on the ring among those in our routing state, or port 0 */
+Node next_known_node(Node n) {
+  const ring_state *ring = ring_read_lock();
+  Node known[2 + SUCCESSOR_LIST_MAX + KEY_SIZE], best;
+  uint32_t best_distance = UINT32_MAX;
+  int count = 0, i;
+
+  known[count++] = self_node;
+  known[count++] = ring->predecessor;
+  for (i = 0; i < ring->successor_count; i++) {
+    known[count++] = ring->successor_list[i];
+  }
+  for (i = 0; i < KEY_SIZE; i++) {
+    known[count++] = ring->finger_table[i];
+  }
+  ring_read_unlock();
+
+  memset(&best, 0, sizeof(Node));
+  for (i = 0; i < count; i++) {
+    uint32_t distance = known[i].key - n.key - 1;
+    if (known[i].port != 0 && !is_equal(known[i], n) && distance < best_distance) {
+      best = known[i];
+      best_distance = distance;
+    }
+  }
+  return best;
+}
+
 Node fetch_successor(Node n) {
   if (is_equal(n, self_node)) {
-    return self_successor;
+    return get_successor();
   }
-  char request_string[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "fetch_suc");
-  return fetch_query(n, request_string);
+  Node successor = fetch_query(n, OP_FETCH_SUC, 0, "", 0);
+  cache_successor(n, successor);
+  return successor;
 }
 
 Node fetch_predecessor(Node n) {
   if (is_equal(n, self_node)) {
-    return self_predecessor;
+    return get_predecessor();
   }
-  char request_string[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "fetch_pre");
-  return fetch_query(n, request_string);
+  return fetch_query(n, OP_FETCH_PRE, 0, "", 0);
+}
+
+/*
+ * fetch_neighbours - Fetch n's predecessor and up to max entries of its
+ * successor list in one request. Returns the number of list entries, or
+ * -1 if n did not answer.
+ */
+int fetch_neighbours(Node n, Node *predecessor, Node list[], int max) {
+  char response[MAXLINE];
+  frame_header hdr;
+  wire_reader r;
+  int rc;
+
+  memset(predecessor, 0, sizeof(Node));
+  if ((rc = exchange(n, OP_FETCH_PRE, 0, "", 0, response)) < 0) {
+    return -1;
+  }
+  hdr.length = rc;
+  hdr.flags = wire_text ? FRAME_TEXT : 0;
+  wire_reader_init(&r, &hdr, response);
+  if (wire_get_node(&r, predecessor) < 0) {
+    return 0;
+  }
+  return get_successor_list(&r, list, max);
 }
 
 Node query_predecessor(uint32_t key, Node n) {
   if (is_equal(n, self_node)) {
-    return self_predecessor;
+    return get_predecessor();
   }
-  char request_string[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "query_pre");
-  sprintf(request_string+9, "%u", key);
-  return fetch_query(n, request_string);
+  char request_string[WIRE_U32_MAX];
+  size_t len = wire_put_u32(request_string, key, wire_text);
+  return fetch_query(n, OP_QUERY_PRE, 0, request_string, len);
 }
 
 Node query_successor(uint32_t key, Node n) {
   if (is_equal(n, self_node)) {
-    return self_successor;
+    return get_successor();
   }
-  char request_string[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "query_suc");
-  sprintf(request_string+9, "%u", key);
-  return fetch_query(n, request_string);
+  char request_string[WIRE_U32_MAX];
+  size_t len = wire_put_u32(request_string, key, wire_text);
+  int flags = lookup_mode == LOOKUP_RECURSIVE ? FRAME_RECURSIVE : 0;
+  return fetch_query(n, OP_QUERY_SUC, flags, request_string, len);
 }
 
 Node query_closest_preceding_finger(uint32_t key, Node n) {
   if (is_equal(n, self_node)) {
-    return closest_preceding_finger(key);
+    return routing_closest_preceding_finger(&self_route, key);
+  }
+  char request_string[WIRE_U32_MAX];
+  size_t len = wire_put_u32(request_string, key, wire_text);
+  return fetch_query(n, OP_QUERY_CPF, 0, request_string, len);
+}
+
+Node query_closest_preceding_hop(uint32_t key, Node n, Node *successor) {
+  if (is_equal(n, self_node)) {
+    return routing_closest_preceding_hop(&self_route, key, successor);
+  }
+  Node cpf;
+  char request_string[WIRE_U32_MAX], response[MAXLINE];
+  size_t len = wire_put_u32(request_string, key, wire_text);
+  frame_header hdr;
+  wire_reader r;
+  int rc;
+
+  memset(&cpf, 0, sizeof(Node));
+  memset(successor, 0, sizeof(Node));
+  log_debug("Message: %s (%zu bytes)", opcode_name(OP_QUERY_HOP), len);
+  if ((rc = exchange(n, OP_QUERY_HOP, 0, request_string, len, response)) < 0) {
+    log_info("No response received");
+    return cpf;
   }
-  char request_string[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "query_cpf");
-  sprintf(request_string+9, "%u", key);
-  return fetch_query(n, request_string);
+  hdr.length = rc;
+  hdr.flags = wire_text ? FRAME_TEXT : 0;
+  wire_reader_init(&r, &hdr, response);
+  cpf = parse_incoming_node(&r);
+  *successor = parse_incoming_node(&r);
+  cache_successor(cpf, *successor);
+  return cpf;
 }
 
 void request_update_successor(Node successor, Node n) {
   if (is_equal(n, self_node)) {
-    self_successor = successor;
-    self_finger_table[0] = successor;
-    second_successor = fetch_successor(self_successor);
+    routing_update_successor(&self_route, successor);
     return;
   }
-  char request_string[MAXLINE], buf1[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "update_suc\n");
-  sprintf(buf1, "%u\n", successor.key);
-  strcat(request_string, buf1);
-  strcat(request_string, successor.ip_address);
-  strcat(request_string, "\n");
-  sprintf(buf1, "%d\n", successor.port);
-  strcat(request_string, buf1);
+  char request_string[WIRE_NODE_MAX];
+  size_t len = wire_put_node(request_string, successor, wire_text);
 
-  send_request(n, request_string);
+  send_request(n, OP_UPDATE_SUC, request_string, len);
 }
 
 void request_update_predecessor(Node predecessor, Node n) {
   if (is_equal(n, self_node)) {
-    self_predecessor = predecessor;
+    routing_update_predecessor(&self_route, predecessor);
     return;
   }
-  char request_string[MAXLINE], buf1[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "update_pre\n");
-  sprintf(buf1, "%u\n", predecessor.key);
-  strcat(request_string, buf1);
-  strcat(request_string, predecessor.ip_address);
-  strcat(request_string, "\n");
-  sprintf(buf1, "%d\n", predecessor.port);
-  strcat(request_string, buf1);
+  char request_string[WIRE_NODE_MAX];
+  size_t len = wire_put_node(request_string, predecessor, wire_text);
 
-  send_request(n, request_string);
+  send_request(n, OP_UPDATE_PRE, request_string, len);
+}
+
+void request_notify(Node n) {
+  if (is_equal(n, self_node)) {
+    routing_notify(&self_route, self_node);
+    return;
+  }
+  char request_string[WIRE_NODE_MAX];
+  size_t len = wire_put_node(request_string, self_node, wire_text);
+
+  send_request(n, OP_NOTIFY, request_string, len);
 }
 
 void request_update_finger_table(Node s, int i, Node n) {
   if (is_equal(n, self_node)) {
-    self_finger_table[i] = s;
+    ring_state *ring = ring_write_begin();
+    ring->finger_table[i] = s;
+    ring_write_commit(ring);
     return;
   }
-  char request_string[MAXLINE], buf1[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "update_fin\n");
-  sprintf(buf1, "%u\n", s.key);
-  strcat(request_string, buf1);
-  strcat(request_string, s.ip_address);
-  strcat(request_string, "\n");
-  sprintf(buf1, "%d\n", s.port);
-  strcat(request_string, buf1);
-  sprintf(buf1, "%d\n", i);
-  strcat(request_string, buf1);
+  char request_string[WIRE_NODE_MAX + WIRE_U32_MAX];
+  size_t len = wire_put_node(request_string, s, wire_text);
+  len += wire_put_u32(request_string + len, i, wire_text);
 
-  send_request(n, request_string);
+  send_request(n, OP_UPDATE_FIN, request_string, len);
 }
 
 void request_remove_node(Node old, int i, Node replace, Node n) {
   if (is_equal(n, self_node)) {
-    remove_node(old, i, replace);
+    routing_remove_node(&self_route, old, i, replace);
     return;
   }
-  char request_string[MAXLINE], buf1[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "remove_node\n");
-  sprintf(buf1, "%u\n", old.key);
-  strcat(request_string, buf1);
-  strcat(request_string, old.ip_address);
-  strcat(request_string, "\n");
-  sprintf(buf1, "%d\n", old.port);
-  strcat(request_string, buf1);
+  char request_string[2 * WIRE_NODE_MAX + WIRE_U32_MAX];
+  size_t len = wire_put_node(request_string, old, wire_text);
+  len += wire_put_u32(request_string + len, i, wire_text);
+  len += wire_put_node(request_string + len, replace, wire_text);
 
-  sprintf(buf1, "%d\n", i);
-  strcat(request_string, buf1);
+  send_request(n, OP_REMOVE_NODE, request_string, len);
+}
 
-  sprintf(buf1, "%u\n", replace.key);
-  strcat(request_string, buf1);
-  strcat(request_string, replace.ip_address);
-  strcat(request_string, "\n");
-  sprintf(buf1, "%d\n", replace.port);
-  strcat(request_string, buf1);
+void request_find_successor(uint32_t key, uint32_t id, Node origin, int hops, Node n) {
+  char request_string[3 * WIRE_U32_MAX + WIRE_NODE_MAX];
+  size_t len = wire_put_u32(request_string, key, wire_text);
+  len += wire_put_u32(request_string + len, id, wire_text);
+  len += wire_put_node(request_string + len, origin, wire_text);
+  len += wire_put_u32(request_string + len, hops, wire_text);
 
-  send_request(n, request_string);
+  send_request(n, OP_FIND_SUC, request_string, len);
 }
 
-Node fetch_query(Node n, char message[]) {
-  Node return_node;
-  int sock;
-  struct sockaddr_in server_addr;
-  rio_t server;
-
-  if ((sock = socket(AF_INET, SOCK_STREAM/* use tcp */, 0)) < 0) {
-    perror("Create socket error:");
+void request_found_successor(uint32_t id, Node successor, Node origin, int hops) {
+  if (is_equal(origin, self_node)) {
+    complete_lookup(id, successor, self_node.key, hops);
+    return;
   }
+  /* We are the key's predecessor, so the owner's range starts after us */
+  char request_string[3 * WIRE_U32_MAX + WIRE_NODE_MAX];
+  size_t len = wire_put_u32(request_string, id, wire_text);
+  len += wire_put_node(request_string + len, successor, wire_text);
+  len += wire_put_u32(request_string + len, self_node.key, wire_text);
+  len += wire_put_u32(request_string + len, hops, wire_text);
+
+  send_request(origin, OP_FOUND_SUC, request_string, len);
+}
 
-  server_addr.sin_addr.s_addr = inet_addr(n.ip_address);
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(n.port);
+/* Routing over ring.c and the messages above */
+static const ring_state *network_read_lock(routing_node *r) {
+  return ring_read_lock();
+}
 
-  if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-    perror("Connect error:");
-  }
-  printf("Connected to server %s:%d\n", n.ip_address, n.port);
+static void network_read_unlock(routing_node *r) {
+  ring_read_unlock();
+}
 
-  int numBytes;
-  char response[MAXLINE];
-  printf("Message: %s\n", message);
+static ring_state *network_write_begin(routing_node *r) {
+  return ring_write_begin();
+}
 
-  if (send(sock, message, MAXLINE,0) < 0) {
-    perror("Send error:");
-  }
-  // shutdown(sock, SHUT_WR);
+static void network_write_commit(routing_node *r, ring_state *state) {
+  ring_write_commit(state);
+}
 
-  Rio_readinitb(&server, sock);
-  numBytes = Rio_readlineb(&server, response, MAXLINE);
-  if (numBytes <= 0) {
-    printf("No response received\n");
-  } else {
-    return_node.key = (uint32_t) atoi(response);
+static void network_write_abort(routing_node *r, ring_state *state) {
+  ring_write_abort(state);
+}
+
+static Node network_query_hop(routing_node *r, Node n, uint32_t key, Node *successor) {
+  return query_closest_preceding_hop(key, n, successor);
+}
+
+static Node network_query_successor(routing_node *r, Node n, uint32_t key) {
+  return query_successor(key, n);
+}
+
+static Node network_fetch_successor(routing_node *r, Node n) {
+  return fetch_successor(n);
+}
+
+static int network_fetch_neighbours(routing_node *r, Node n, Node *predecessor, Node list[], int max) {
+  return fetch_neighbours(n, predecessor, list, max);
+}
+
+static Node network_successor_of(routing_node *r, Node n) {
+  return cached_successor(n);
+}
+
+static Node network_lookup(routing_node *r, uint32_t key, uint32_t *start) {
+  return resolve_successor(key, lookup_mode, start); /* not from the cache */
+}
+
+static bool network_ping(routing_node *r, Node n) {
+  return ping(n);
+}
+
+static void network_notify(routing_node *r, Node n) {
+  request_notify(n);
+}
+
+static void network_update_finger_table(routing_node *r, Node n, Node s, int i) {
+  request_update_finger_table(s, i, n);
+}
+
+static void network_remove_node(routing_node *r, Node n, Node old, int i, Node replace) {
+  request_remove_node(old, i, replace, n);
+}
+
+static void network_changed(routing_node *r, Node n) {
+  forget_successors(n);
+}
+
+routing_ops network_routing = {
+  network_read_lock, network_read_unlock, network_write_begin, network_write_commit, network_write_abort,
+  network_query_hop, network_query_successor, network_fetch_successor, network_fetch_neighbours,
+  network_successor_of, network_lookup, network_ping, network_notify, network_update_finger_table,
+  network_remove_node, network_changed
+};
+
+/* Send a data request to n, which must run it itself; returns its status, or -1 if n is gone */
+int request_data(Node n, int opcode, int flags, char *key, size_t klen, char *value, size_t vlen, char *out, size_t *outlen) {
+  char response[MAXLINE], length[WIRE_U32_MAX];
+  frame_header hdr;
+  wire_reader r;
+  uint32_t status;
+  int rc;
+
+  /* The key as wire_put_bytes lays it out, then the value, sent where they lie */
+  struct iovec iov[4] = {
+    { length, wire_put_u32(length, klen, wire_text) },
+    { key, klen },
+    { "\n", wire_text ? 1 : 0 },
+    { value, vlen }
+  };
+  log_debug("Message: %s (%zu bytes)", opcode_name(opcode),
+         iov[0].iov_len + klen + iov[2].iov_len + vlen);
+  rc = exchangev(n, opcode, flags, iov, 4, response);
+
+  *outlen = 0;
+  if (rc < 0) {
+    log_info("No response received");
+    return -1;
+  }
+  hdr.length = rc;
+  hdr.flags = wire_text ? FRAME_TEXT : 0;
+  wire_reader_init(&r, &hdr, response);
+  if (wire_get_u32(&r, &status) < 0) {
+    return STATUS_ERROR;
   }
+  *outlen = r.end - r.pos;
+  memcpy(out, r.pos, *outlen);
+  return status;
+}
 
-  response[0] = 0;
-  numBytes = Rio_readlineb(&server, response, MAXLINE);
-  if (numBytes <= 0) {
-    printf("No response received\n");
-  } else {
-    int len = strlen(response);
-    if (len > 0 && response[len-1] == '\n') response[len-1] = '\0';
-    strcpy(return_node.ip_address, response);
+/* Requests that change nothing on the receiver, so sending one twice is harmless */
+static bool is_idempotent(int opcode) {
+  switch (opcode) {
+  case OP_FETCH_SUC: case OP_FETCH_PRE: case OP_QUERY_SUC: case OP_QUERY_PRE:
+  case OP_QUERY_CPF: case OP_QUERY_HOP: case OP_SEARCH_QUERY: case OP_GET:
+  case OP_PING: case OP_FILTER: case OP_STATS:
+    return true;
+  default:
+    return false;
   }
+}
 
-  response[0] = 0;
-  numBytes = Rio_readlineb(&server, response, MAXLINE);
-  if (numBytes <= 0) {
-    printf("No response received\n");
-  } else {
-    return_node.port = atoi(response);
+/*
+ * closed_idle - Whether a request on conn failed because the peer had
+ * closed it while idle, before it could have seen the request: the write
+ * failed other than by timing out (written < 0), or the reply read met
+ * EOF before any byte (read 0). A timeout proves nothing either way.
+ */
+static bool closed_idle(pool_conn *conn, ssize_t written, ssize_t read) {
+  if (!conn->reused) {
+    return false;
   }
-  Close(sock);
+  if (written < 0) {
+    return errno != EAGAIN && errno != EWOULDBLOCK;
+  }
+  return read == 0;
+}
 
-  return return_node;
+/* Fetch n's filter; NULL if it has none to give or is gone */
+filter *fetch_filter(Node n) {
+  char *buf = NULL;
+  size_t cap = 0;
+  frame_header hdr;
+  pool_conn *conn;
+  filter *f = NULL;
+  bool retry;
+  ssize_t rc = -1, written;
+  uint64_t start = stats_now();
+
+  log_debug("Message: %s (0 bytes)", opcode_name(OP_FILTER));
+  do {
+    if ((conn = pool_acquire(n.ip_address, n.port)) == NULL) {
+      break;
+    }
+    rc = -1;
+    if ((written = rio_writeframe(conn->fd, OP_FILTER, 0, "", 0)) >= 0) {
+      rc = rio_readframe_grow(&conn->rio, &hdr, &buf, &cap, REACTOR_MAX_FRAME);
+    }
+    retry = false;
+    if (rc == 1) {
+      pool_release(conn);
+      f = filter_decode(buf, hdr.length);
+    } else {
+      retry = closed_idle(conn, written, rc);
+      pool_discard(conn);
+    }
+  } while (retry);
+  stats_record(STATS_CLIENT, OP_FILTER, stats_now() - start, rc == 1 ? FRAME_HEADER_SIZE + hdr.length : 0,
+               FRAME_HEADER_SIZE, rc != 1);
+  Free(buf);
+  return f;
 }
 
-void send_request(Node n, char message[]) {
+Node fetch_query(Node n, int opcode, int flags, char payload[], size_t len) {
   Node return_node;
-  int sock;
-  struct sockaddr_in server_addr;
-  rio_t server;
+  char response[MAXLINE];
+  frame_header hdr;
+  wire_reader r;
+  int rc;
+
+  memset(&return_node, 0, sizeof(Node));
+  log_debug("Message: %s (%zu bytes)", opcode_name(opcode), len);
+  if ((rc = exchange(n, opcode, flags, payload, len, response)) < 0) {
+    log_info("No response received");
+    return return_node;
+  }
+  hdr.length = rc;
+  hdr.flags = wire_text ? FRAME_TEXT : 0;
+  wire_reader_init(&r, &hdr, response);
+  return parse_incoming_node(&r);
+}
 
-  printf("sending to:\n");
-  print_node(n);
+void send_request(Node n, int opcode, char payload[], size_t len) {
+  log_debug("Message: %s (%zu bytes) to node %s, port %d", opcode_name(opcode), len, n.ip_address, n.port);
 
-  if ((sock = socket(AF_INET, SOCK_STREAM/* use tcp */, 0)) < 0) {
-    perror("Create socket error:");
+  if (exchange(n, opcode, 0, payload, len, NULL) < 0) {
+    log_error("Send error: %s", strerror(errno));
   }
+}
 
-  server_addr.sin_addr.s_addr = inet_addr(n.ip_address);
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(n.port);
+/*
+ * exchange - Send one request frame to n over a pooled connection, with
+ * flags besides the encoding, and,
+ * unless response is NULL, read the reply frame's payload into response
+ * (at most MAXLINE-1 bytes, NUL terminated). Returns the reply length.
+ * A reused connection may have been closed by the peer since it went
+ * idle, so an idempotent request is sent again on a fresh one if the old
+ * one failed before the peer could have taken it (see closed_idle);
+ * other failures, timeouts among them, are returned as -1.
+ */
+int exchange(Node n, int opcode, int flags, char payload[], size_t len, char response[]) {
+  struct iovec iov = { payload, len };
+  return exchangev(n, opcode, flags, &iov, 1, response);
+}
 
-  if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-    perror("Connect error:");
+/* exchangev - Like exchange, with the payload in iovcnt parts written as they lie */
+int exchangev(Node n, int opcode, int flags, struct iovec *iov, int iovcnt, char response[]) {
+  pool_conn *conn;
+  frame_header hdr;
+  bool retry;
+  uint64_t start = stats_now();
+  size_t out = FRAME_HEADER_SIZE;
+  ssize_t written, got = -1;
+  int i, rc = -1;
+
+  if (wire_text) {
+    flags |= FRAME_TEXT;
+  }
+  for (i = 0; i < iovcnt; i++) {
+    out += iov[i].iov_len;
   }
-  printf("Connected to server %s:%d\n", n.ip_address, n.port);
 
-  int numBytes;
-  char response[MAXLINE];
-  printf("Message: %s\n", message);
+  do {
+    if ((conn = pool_acquire(n.ip_address, n.port)) == NULL) {
+      break;
+    }
+    if ((written = rio_writeframev(conn->fd, opcode, flags, iov, iovcnt)) >= 0 &&
+        (response == NULL || (got = rio_readframeb(&conn->rio, &hdr, response, MAXLINE)) == 1)) {
+      pool_release(conn);
+      rc = response == NULL ? 0 : hdr.length;
+      break;
+    }
+    retry = is_idempotent(opcode) && closed_idle(conn, written, got);
+    pool_discard(conn);
+  } while (retry);
 
-  if (send(sock, message, MAXLINE,0) < 0) {
-    perror("Send error:");
-  }
-  shutdown(sock, SHUT_WR);
+  stats_record(STATS_CLIENT, opcode, stats_now() - start,
+               rc >= 0 && response != NULL ? FRAME_HEADER_SIZE + rc : 0, out, rc < 0);
+  return rc;
 }
 
 void print_node(Node n) {
@@ -995,10 +2235,3 @@ void println() {
   printf("\n");
 }
 
-bool is_equal(Node a, Node b) {
-  if (strcmp(a.ip_address, b.ip_address) == 0 && a.port == b.port) {
-    return true;
-  } 
-  return false;
-}
-
@@ -520,10 +520,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
  *    read() if the internal buffer is empty.
  */
 /* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static ssize_t rio_fill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
@@ -536,6 +534,15 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 	else 
 	    rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    if ((cnt = rio_fill(rp)) <= 0)
+	return cnt;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -571,7 +578,12 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
     char *bufp = usrbuf;
     
     while (nleft > 0) {
-	if ((nread = rio_read(rp, bufp, nleft)) < 0) {
+	/* Large reads go straight to the caller once the buffer is drained */
+	if (rp->rio_cnt <= 0 && nleft >= sizeof(rp->rio_buf))
+	    nread = read(rp->rio_fd, bufp, nleft);
+	else
+	    nread = rio_read(rp, bufp, nleft);
+	if (nread < 0) {
 	    if (errno == EINTR) /* interrupted by sig handler return */
 		nread = 0;      /* call read() again */
 	    else
@@ -587,32 +599,85 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - robustly read a text line (buffered)
+ * rio_readlineb - robustly read a text line (buffered). The buffered
+ * bytes are searched for the newline with memchr and copied in one go.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    n = 0;
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
 
-    while (n < maxlen-1){
-	if ((rc = rio_read(rp, &c, 1)) == 1) {
-	  n++;
-	  *bufp++ = c;
-	  if (c == '\n')
-	    break;
-	} else if (rc == 0) {
-	  break;    /* EOF */
-	} else
-	  return -1;	  /* error */
+    while (n < maxlen-1 && nl == NULL) {
+	if ((rc = rio_fill(rp)) == 0)
+	    break;    /* EOF */
+	else if (rc < 0)
+	    return -1;	  /* error */
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen-1 - n)
+	    cnt = maxlen-1 - n;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
     }
     *bufp = 0;
     return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readlineb_view - read a text line without copying it. *line is set
+ * to the line, newline included, inside rp's buffer; it stays valid
+ * until the next read from rp. A partial line at the end of the buffer
+ * is moved to the front before reading more, and a line longer than
+ * the buffer comes back in pieces of RIO_BUFSIZE bytes. Returns the
+ * length, 0 on EOF and -1 on error.
+ */
+/* $begin rio_readlineb_view */
+ssize_t rio_readlineb_view(rio_t *rp, char **line)
+{
+    ssize_t n, nread;
+    char *nl;
+
+    for (;;) {
+	if (rp->rio_cnt > 0 && (nl = memchr(rp->rio_bufptr, '\n', rp->rio_cnt)) != NULL) {
+	    n = nl - rp->rio_bufptr + 1;
+	    break;
+	}
+	if (rp->rio_cnt == sizeof(rp->rio_buf)) {
+	    n = rp->rio_cnt;   /* no newline in a full buffer */
+	    break;
+	}
+	if (rp->rio_cnt <= 0)
+	    rp->rio_cnt = 0;
+	if (rp->rio_bufptr != rp->rio_buf) {
+	    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	    rp->rio_bufptr = rp->rio_buf;
+	}
+	nread = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, sizeof(rp->rio_buf) - rp->rio_cnt);
+	if (nread < 0) {
+	    if (errno != EINTR) /* interrupted by sig handler return */
+		return -1;
+	}
+	else if (nread == 0) {
+	    n = rp->rio_cnt;   /* EOF: the rest, if any */
+	    break;
+	}
+	else
+	    rp->rio_cnt += nread;
+    }
+    *line = rp->rio_bufptr;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    return n;
+}
+/* $end rio_readlineb_view */
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
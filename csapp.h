@@ -135,6 +135,7 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_readlineb_view(rio_t *rp, char **line);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readp(int fd, void *ptr, size_t nbytes);
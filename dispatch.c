@@ -0,0 +1,58 @@
+/*
+ * dispatch.c - request handlers by opcode, with per-request stats
+ *
+ * Handlers are registered in a table indexed by opcode, so finding one
+ * is a bounds check and a load, and each RPC lives in its own function.
+ * Every call is timed and recorded as a server RPC in stats.c, with the
+ * bytes of the request and of the replies it queued. Registration
+ * happens before the reactor starts, and the table is only read
+ * afterwards.
+ */
+
+#include "dispatch.h"
+#include "stats.h"
+#include "log.h"
+
+typedef struct entry
+{
+  dispatch_handler *handler;
+  int flags;
+} entry;
+
+static entry table[OP_COUNT];
+static __thread bool failed; /* the request being handled failed */
+
+void dispatch_register(int opcode, dispatch_handler *handler, int flags) {
+  if (opcode < 0 || opcode >= OP_COUNT) {
+    return;
+  }
+  table[opcode].handler = handler;
+  table[opcode].flags = flags;
+}
+
+bool dispatch_may_block(int opcode) {
+  return opcode >= 0 && opcode < OP_COUNT && (table[opcode].flags & DISPATCH_BLOCKING);
+}
+
+void dispatch_failed(void) {
+  failed = true;
+}
+
+void dispatch_request(reactor_conn *c, frame_header *hdr, char *payload) {
+  unsigned long long queued = conn_queued(c);
+  uint64_t start;
+  wire_reader r;
+
+  log_debug("Request: %s", opcode_name(hdr->opcode));
+  if (hdr->opcode >= OP_COUNT || table[hdr->opcode].handler == NULL) {
+    stats_record(STATS_SERVER, -1, 0, 0, 0, true);
+    return;
+  }
+  wire_reader_init(&r, hdr, payload);
+
+  failed = false;
+  start = stats_now();
+  table[hdr->opcode].handler(c, hdr, payload, &r);
+  stats_record(STATS_SERVER, hdr->opcode, stats_now() - start, FRAME_HEADER_SIZE + hdr->length,
+               conn_queued(c) - queued, failed);
+}
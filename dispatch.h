@@ -0,0 +1,30 @@
+/*
+ * dispatch.h - request handlers by opcode, with per-request stats
+ *
+ */
+
+#ifndef __DISPATCH_H__
+#define __DISPATCH_H__
+
+#include <stdbool.h>
+#include "reactor.h"
+
+/* Flags for dispatch_register */
+#define   DISPATCH_BLOCKING  0x1 // May wait on a remote node, so runs on a reactor worker
+
+/* Handles one request; r is a reader over the payload */
+typedef void dispatch_handler(reactor_conn *c, frame_header *hdr, char *payload, wire_reader *r);
+
+/* Makes handler answer requests with opcode; registering again replaces it */
+void dispatch_register(int opcode, dispatch_handler *handler, int flags);
+
+/* A reactor_handler running the registered handler */
+void dispatch_request(reactor_conn *c, frame_header *hdr, char *payload);
+
+/* A reactor_blocking for the registered flags */
+bool dispatch_may_block(int opcode);
+
+/* Counts the request being handled on this thread as an error in its stats */
+void dispatch_failed(void);
+
+#endif /* __DISPATCH_H__ */
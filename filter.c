@@ -0,0 +1,211 @@
+/*
+ * filter.c - cuckoo filter over the keys of a store
+ *
+ * Each key is reduced to a 16-bit fingerprint of its tag, kept in one
+ * of two buckets of FILTER_BUCKET slots: the first picked by the key's
+ * Chord ID, the second by the first xor a hash of the fingerprint, so
+ * either bucket can be found from the other and a fingerprint can be
+ * moved without knowing its key. A lookup reads the two buckets, eight
+ * bytes each; an insert into two full buckets evicts a fingerprint to
+ * its other bucket, and so on up to FILTER_MAX_KICKS times. Unlike a
+ * Bloom filter it can forget a key, and about 2 * FILTER_BUCKET lookups
+ * in 65536 for absent keys come out positive. The filter has no lock of
+ * its own: the store that owns it serializes access.
+ *
+ * The encoded form is the bucket count and key count (u32) followed by
+ * every fingerprint (u16), all in network byte order.
+ */
+
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+#include "csapp.h"
+#include "filter.h"
+
+struct filter
+{
+  uint16_t (*buckets)[FILTER_BUCKET]; /* 0 marks an empty slot */
+  size_t nbuckets;        /* power of two */
+  size_t count;
+  uint32_t random;        /* picks eviction victims */
+};
+
+static uint32_t mix(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+/* FNV-1a */
+uint32_t hash_key(char *key, size_t klen) {
+  unsigned char hash[SHA_DIGEST_LENGTH];
+  uint32_t id;
+
+  SHA1((unsigned char *) key, klen, hash);
+  memcpy(&id, hash + 16, sizeof(id));
+  return id;
+}
+
+uint32_t filter_tag(char *key, size_t klen) {
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < klen; i++) {
+    h = (h ^ (unsigned char) key[i]) * 16777619u;
+  }
+  return h;
+}
+
+static uint16_t fingerprint(uint32_t tag) {
+  uint16_t fp = tag ^ (tag >> 16);
+  return fp != 0 ? fp : 1;
+}
+
+static size_t first_bucket(filter *f, uint32_t id) {
+  return mix(id) & (f->nbuckets - 1);
+}
+
+static size_t other_bucket(filter *f, size_t b, uint16_t fp) {
+  return (b ^ mix(fp)) & (f->nbuckets - 1);
+}
+
+filter *filter_create(size_t keys) {
+  filter *f = Calloc(1, sizeof(filter));
+
+  for (f->nbuckets = 4; f->nbuckets * FILTER_BUCKET < keys; f->nbuckets *= 2);
+  f->buckets = Calloc(f->nbuckets, sizeof(*f->buckets));
+  f->random = 2463534242u;
+  return f;
+}
+
+void filter_free(filter *f) {
+  if (f == NULL) {
+    return;
+  }
+  Free(f->buckets);
+  Free(f);
+}
+
+static bool insert_into(filter *f, size_t b, uint16_t fp) {
+  int i;
+  for (i = 0; i < FILTER_BUCKET; i++) {
+    if (f->buckets[b][i] == 0) {
+      f->buckets[b][i] = fp;
+      return true;
+    }
+  }
+  return false;
+}
+
+int filter_add(filter *f, uint32_t id, uint32_t tag) {
+  uint16_t fp = fingerprint(tag), victim;
+  size_t b = first_bucket(f, id), b2 = other_bucket(f, b, fp);
+  int kicks;
+
+  f->count++;
+  if (insert_into(f, b, fp) || insert_into(f, b2, fp)) {
+    return 0;
+  }
+  for (kicks = 0; kicks < FILTER_MAX_KICKS; kicks++) {
+    f->random ^= f->random << 13;
+    f->random ^= f->random >> 17;
+    f->random ^= f->random << 5;
+    if (kicks == 0 && (f->random & 0x100)) {
+      b = b2;
+    }
+    victim = f->buckets[b][f->random % FILTER_BUCKET];
+    f->buckets[b][f->random % FILTER_BUCKET] = fp;
+    fp = victim;
+    b = other_bucket(f, b, fp);
+    if (insert_into(f, b, fp)) {
+      return 0;
+    }
+  }
+  f->count--;
+  return -1;
+}
+
+void filter_remove(filter *f, uint32_t id, uint32_t tag) {
+  uint16_t fp = fingerprint(tag);
+  size_t b = first_bucket(f, id), bs[2] = { b, other_bucket(f, b, fp) };
+  int i, j;
+
+  for (j = 0; j < 2; j++) {
+    for (i = 0; i < FILTER_BUCKET; i++) {
+      if (f->buckets[bs[j]][i] == fp) {
+        f->buckets[bs[j]][i] = 0;
+        f->count--;
+        return;
+      }
+    }
+  }
+}
+
+bool filter_contains(filter *f, uint32_t id, uint32_t tag) {
+  uint16_t fp = fingerprint(tag);
+  size_t b = first_bucket(f, id), b2 = other_bucket(f, b, fp);
+  int i;
+
+  for (i = 0; i < FILTER_BUCKET; i++) {
+    if (f->buckets[b][i] == fp || f->buckets[b2][i] == fp) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t filter_count(filter *f) {
+  return f->count;
+}
+
+size_t filter_bytes(filter *f) {
+  return sizeof(filter) + f->nbuckets * sizeof(*f->buckets);
+}
+
+char *filter_encode(filter *f, size_t *len) {
+  size_t n = f->nbuckets * FILTER_BUCKET, i;
+  uint16_t *fps = &f->buckets[0][0];
+  char *buf;
+  uint32_t u;
+
+  *len = 2 * sizeof(uint32_t) + n * sizeof(uint16_t);
+  buf = Malloc(*len);
+  u = htonl(f->nbuckets);
+  memcpy(buf, &u, sizeof(u));
+  u = htonl(f->count);
+  memcpy(buf + sizeof(u), &u, sizeof(u));
+  for (i = 0; i < n; i++) {
+    uint16_t fp = htons(fps[i]);
+    memcpy(buf + 2 * sizeof(u) + i * sizeof(fp), &fp, sizeof(fp));
+  }
+  return buf;
+}
+
+filter *filter_decode(char *buf, size_t len) {
+  uint32_t nbuckets, count;
+  uint16_t *fps;
+  filter *f;
+  size_t i;
+
+  if (len < 2 * sizeof(uint32_t)) {
+    return NULL;
+  }
+  memcpy(&nbuckets, buf, sizeof(nbuckets));
+  memcpy(&count, buf + sizeof(nbuckets), sizeof(count));
+  nbuckets = ntohl(nbuckets);
+  count = ntohl(count);
+  if (nbuckets < 4 || (nbuckets & (nbuckets - 1)) != 0 ||
+      len != 2 * sizeof(uint32_t) + (size_t) nbuckets * FILTER_BUCKET * sizeof(uint16_t)) {
+    return NULL;
+  }
+
+  f = filter_create(nbuckets * FILTER_BUCKET);
+  f->count = count;
+  fps = &f->buckets[0][0];
+  for (i = 0; i < nbuckets * FILTER_BUCKET; i++) {
+    memcpy(&fps[i], buf + 2 * sizeof(uint32_t) + i * sizeof(uint16_t), sizeof(uint16_t));
+    fps[i] = ntohs(fps[i]);
+  }
+  return f;
+}
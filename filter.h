@@ -0,0 +1,46 @@
+/*
+ * filter.h - cuckoo filter over the keys of a store
+ *
+ */
+
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define   FILTER_BUCKET     4   // Fingerprints per bucket
+#define   FILTER_MAX_KICKS  500 // Evictions before an insert gives up
+
+typedef struct filter filter;
+
+/* A key's Chord ID, bytes 16..19 of its SHA-1; nodes place keys and everyone probes filters by it */
+uint32_t hash_key(char *key, size_t klen);
+
+/* Hash of a key's bytes; fingerprints are taken from it */
+uint32_t filter_tag(char *key, size_t klen);
+
+/* A filter with room for about keys keys */
+filter *filter_create(size_t keys);
+void filter_free(filter *f);
+
+/* Returns 0, or -1 if the filter was too full; some fingerprint is then lost */
+int filter_add(filter *f, uint32_t id, uint32_t tag);
+
+/* Removes a fingerprint added for the key */
+void filter_remove(filter *f, uint32_t id, uint32_t tag);
+
+/* False only if the key was never added (or has been removed) */
+bool filter_contains(filter *f, uint32_t id, uint32_t tag);
+
+size_t filter_count(filter *f);
+size_t filter_bytes(filter *f);
+
+/* Portable copy for shipping to peers and clients; Free it when done */
+char *filter_encode(filter *f, size_t *len);
+
+/* Returns NULL if buf does not hold an encoded filter */
+filter *filter_decode(char *buf, size_t len);
+
+#endif /* __FILTER_H__ */
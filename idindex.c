@@ -0,0 +1,234 @@
+/*
+ * idindex.c - ordered index of the Chord IDs of stored keys
+ *
+ * The hash table in store.c finds a key in one probe run but knows
+ * nothing about order, so handing a range of the ring to another node
+ * would mean scanning every slot. This index keeps the distinct IDs in
+ * sorted leaf blocks of up to IDINDEX_BLOCK entries, each with the number
+ * of keys sharing the ID, plus an array of the first ID of every block.
+ * A lookup is a binary search over that array and then within one block,
+ * both contiguous in memory; a range scan walks the blocks in order, so
+ * it costs the size of the range, not of the index. A full block splits
+ * in two and a block that falls below half full together with a
+ * neighbour is merged into it. The index has no lock of its own: the
+ * store that owns it serializes access.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "csapp.h"
+#include "idindex.h"
+
+typedef struct block
+{
+  int count;
+  uint32_t ids[IDINDEX_BLOCK];    /* sorted */
+  uint32_t refs[IDINDEX_BLOCK];   /* keys with the ID */
+} block;
+
+struct idindex
+{
+  block **blocks;         /* in ID order */
+  uint32_t *firsts;       /* lowest ID of each block */
+  size_t nblocks, cap;
+  size_t count;           /* distinct IDs */
+};
+
+idindex *idindex_create(void) {
+  return Calloc(1, sizeof(idindex));
+}
+
+void idindex_free(idindex *x) {
+  size_t i;
+
+  for (i = 0; i < x->nblocks; i++) {
+    Free(x->blocks[i]);
+  }
+  Free(x->blocks);
+  Free(x->firsts);
+  Free(x);
+}
+
+/* Last block whose first ID is at most id, or 0 */
+static size_t locate(idindex *x, uint32_t id) {
+  size_t lo = 0, hi = x->nblocks;
+
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (x->firsts[mid] <= id) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* First position in bl holding an ID of at least id */
+static int lower_bound(block *bl, uint32_t id) {
+  int lo = 0, hi = bl->count;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (bl->ids[mid] < id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static void insert_block(idindex *x, size_t at, block *bl) {
+  if (x->nblocks == x->cap) {
+    x->cap = x->cap ? x->cap * 2 : 8;
+    x->blocks = Realloc(x->blocks, x->cap * sizeof(block *));
+    x->firsts = Realloc(x->firsts, x->cap * sizeof(uint32_t));
+  }
+  memmove(x->blocks + at + 1, x->blocks + at, (x->nblocks - at) * sizeof(block *));
+  memmove(x->firsts + at + 1, x->firsts + at, (x->nblocks - at) * sizeof(uint32_t));
+  x->blocks[at] = bl;
+  x->firsts[at] = bl->count > 0 ? bl->ids[0] : 0;
+  x->nblocks++;
+}
+
+static void remove_block(idindex *x, size_t at) {
+  Free(x->blocks[at]);
+  memmove(x->blocks + at, x->blocks + at + 1, (x->nblocks - at - 1) * sizeof(block *));
+  memmove(x->firsts + at, x->firsts + at + 1, (x->nblocks - at - 1) * sizeof(uint32_t));
+  x->nblocks--;
+}
+
+/* Move the upper half of block b into a new block after it */
+static void split(idindex *x, size_t b) {
+  block *bl = x->blocks[b], *upper = Malloc(sizeof(block));
+  int half = bl->count / 2;
+
+  upper->count = bl->count - half;
+  memcpy(upper->ids, bl->ids + half, upper->count * sizeof(uint32_t));
+  memcpy(upper->refs, bl->refs + half, upper->count * sizeof(uint32_t));
+  bl->count = half;
+  insert_block(x, b + 1, upper);
+}
+
+/* Append block b + 1 to block b and drop it */
+static void merge(idindex *x, size_t b) {
+  block *bl = x->blocks[b], *next = x->blocks[b + 1];
+
+  memcpy(bl->ids + bl->count, next->ids, next->count * sizeof(uint32_t));
+  memcpy(bl->refs + bl->count, next->refs, next->count * sizeof(uint32_t));
+  bl->count += next->count;
+  remove_block(x, b + 1);
+}
+
+void idindex_add(idindex *x, uint32_t id) {
+  size_t b;
+  block *bl;
+  int pos;
+
+  if (x->nblocks == 0) {
+    bl = Malloc(sizeof(block));
+    bl->count = 0;
+    insert_block(x, 0, bl);
+  }
+  b = locate(x, id);
+  bl = x->blocks[b];
+  pos = lower_bound(bl, id);
+  if (pos < bl->count && bl->ids[pos] == id) {
+    bl->refs[pos]++;
+    return;
+  }
+
+  if (bl->count == IDINDEX_BLOCK) {
+    split(x, b);
+    if (id >= x->firsts[b + 1]) {
+      b++;
+    }
+    bl = x->blocks[b];
+    pos = lower_bound(bl, id);
+  }
+  memmove(bl->ids + pos + 1, bl->ids + pos, (bl->count - pos) * sizeof(uint32_t));
+  memmove(bl->refs + pos + 1, bl->refs + pos, (bl->count - pos) * sizeof(uint32_t));
+  bl->ids[pos] = id;
+  bl->refs[pos] = 1;
+  bl->count++;
+  x->firsts[b] = bl->ids[0];
+  x->count++;
+}
+
+void idindex_remove(idindex *x, uint32_t id) {
+  size_t b;
+  block *bl;
+  int pos;
+
+  if (x->nblocks == 0) {
+    return;
+  }
+  b = locate(x, id);
+  bl = x->blocks[b];
+  pos = lower_bound(bl, id);
+  if (pos == bl->count || bl->ids[pos] != id || --bl->refs[pos] > 0) {
+    return;
+  }
+
+  memmove(bl->ids + pos, bl->ids + pos + 1, (bl->count - pos - 1) * sizeof(uint32_t));
+  memmove(bl->refs + pos, bl->refs + pos + 1, (bl->count - pos - 1) * sizeof(uint32_t));
+  bl->count--;
+  x->count--;
+  if (bl->count == 0) {
+    remove_block(x, b);
+    return;
+  }
+  x->firsts[b] = bl->ids[0];
+
+  if (b + 1 < x->nblocks && bl->count + x->blocks[b + 1]->count <= IDINDEX_BLOCK / 2) {
+    merge(x, b);
+  } else if (b > 0 && x->blocks[b - 1]->count + bl->count <= IDINDEX_BLOCK / 2) {
+    merge(x, b - 1);
+  }
+}
+
+/* Visit the IDs in [lo, hi]; returns nonzero if visit stopped the scan */
+static int scan(idindex *x, uint32_t lo, uint32_t hi, idindex_visit *visit, void *arg) {
+  size_t b;
+  int pos;
+
+  if (x->nblocks == 0) {
+    return 0;
+  }
+  b = locate(x, lo);
+  for (pos = lower_bound(x->blocks[b], lo); b < x->nblocks; b++, pos = 0) {
+    block *bl = x->blocks[b];
+    for (; pos < bl->count; pos++) {
+      if (bl->ids[pos] > hi) {
+        return 0;
+      }
+      if (visit(bl->ids[pos], arg)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+void idindex_range(idindex *x, uint32_t a, uint32_t b, idindex_visit *visit, void *arg) {
+  if (a < b) {
+    scan(x, a, b, visit, arg);
+  } else if (a == b) {
+    /* The whole ring, starting at a */
+    if (!scan(x, a, UINT32_MAX, visit, arg) && a > 0) {
+      scan(x, 0, a - 1, visit, arg);
+    }
+  } else if (!scan(x, a, UINT32_MAX, visit, arg)) {
+    scan(x, 0, b, visit, arg);
+  }
+}
+
+size_t idindex_count(idindex *x) {
+  return x->count;
+}
+
+size_t idindex_bytes(idindex *x) {
+  return sizeof(idindex) + x->nblocks * sizeof(block) +
+         x->cap * (sizeof(block *) + sizeof(uint32_t));
+}
@@ -0,0 +1,37 @@
+/*
+ * idindex.h - ordered index of the Chord IDs of stored keys
+ *
+ */
+
+#ifndef __IDINDEX_H__
+#define __IDINDEX_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define   IDINDEX_BLOCK   256 // IDs per leaf block
+
+typedef struct idindex idindex;
+
+/* Called for each ID in a range, in ring order; return nonzero to stop */
+typedef int idindex_visit(uint32_t id, void *arg);
+
+idindex *idindex_create(void);
+void idindex_free(idindex *x);
+
+/* Counts one more key with this ID */
+void idindex_add(idindex *x, uint32_t id);
+
+/* Counts one key fewer with this ID, dropping the ID at zero */
+void idindex_remove(idindex *x, uint32_t id);
+
+/*
+ * Visits the IDs for which is_between(id, a, b) holds: [a, b], wrapping
+ * past the top of the key space if b < a, and every ID if a == b
+ */
+void idindex_range(idindex *x, uint32_t a, uint32_t b, idindex_visit *visit, void *arg);
+
+size_t idindex_count(idindex *x);
+size_t idindex_bytes(idindex *x);
+
+#endif /* __IDINDEX_H__ */
@@ -0,0 +1,219 @@
+/*
+ * lcache.c - cache of recently resolved key ranges and their owners
+ *
+ * A lookup ends at the node whose successor owns the key, which tells us
+ * a whole range (predecessor, owner] rather than a single key, so the
+ * cache stores ranges. The key space is split into LCACHE_SHARDS slices,
+ * each with its own lock, and a range is stored as one piece per slice it
+ * covers. Within a shard the pieces are disjoint and sorted by their
+ * first key, so a lookup is a binary search; a new piece replaces any it
+ * overlaps, since ranges on a ring cannot overlap unless one is stale.
+ * When a shard is full its least recently used piece is evicted.
+ */
+
+#include <time.h>
+#include "lcache.h"
+
+typedef struct piece
+{
+  uint32_t lo, hi;        /* inclusive */
+  Node owner;
+  unsigned long used;     /* shard clock at the last hit */
+  time_t expires;
+} piece;
+
+typedef struct shard
+{
+  pthread_mutex_t mutex;
+  piece pieces[LCACHE_SHARD_SIZE];
+  int count;
+  unsigned long clock;
+  unsigned long hits, misses;
+} shard;
+
+static shard shards[LCACHE_SHARDS];
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void init_shards(void) {
+  int i;
+  for (i = 0; i < LCACHE_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].mutex, NULL);
+  }
+}
+
+static int shard_of(uint32_t key) {
+  return key >> (32 - LCACHE_SHARD_BITS);
+}
+
+static bool same_owner(Node a, Node b) {
+  return a.port == b.port && strcmp(a.ip_address, b.ip_address) == 0;
+}
+
+/* Index of the last piece with lo <= key, or -1 */
+static int find(shard *s, uint32_t key) {
+  int lo = 0, hi = s->count - 1, mid, found = -1;
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if (s->pieces[mid].lo <= key) {
+      found = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return found;
+}
+
+static void drop(shard *s, int i) {
+  memmove(&s->pieces[i], &s->pieces[i + 1], (s->count - i - 1) * sizeof(piece));
+  s->count--;
+}
+
+bool lcache_lookup(uint32_t key, Node *owner) {
+  shard *s;
+  int i;
+  bool hit = false;
+
+  pthread_once(&once, init_shards);
+  s = &shards[shard_of(key)];
+  pthread_mutex_lock(&s->mutex);
+  if ((i = find(s, key)) >= 0 && key <= s->pieces[i].hi) {
+    if (s->pieces[i].expires > time(NULL)) {
+      s->pieces[i].used = ++s->clock;
+      *owner = s->pieces[i].owner;
+      hit = true;
+    } else {
+      drop(s, i);
+    }
+  }
+  if (hit) {
+    s->hits++;
+  } else {
+    s->misses++;
+  }
+  pthread_mutex_unlock(&s->mutex);
+  return hit;
+}
+
+static void insert_piece(shard *s, uint32_t lo, uint32_t hi, Node owner) {
+  int i, lru;
+
+  pthread_mutex_lock(&s->mutex);
+  /* Drop stale pieces overlapping [lo, hi] */
+  for (i = 0; i < s->count; ) {
+    if (s->pieces[i].lo <= hi && lo <= s->pieces[i].hi) {
+      drop(s, i);
+    } else {
+      i++;
+    }
+  }
+  if (s->count == LCACHE_SHARD_SIZE) {
+    lru = 0;
+    for (i = 1; i < s->count; i++) {
+      if (s->pieces[i].used < s->pieces[lru].used) {
+        lru = i;
+      }
+    }
+    drop(s, lru);
+  }
+  i = find(s, lo) + 1;
+  memmove(&s->pieces[i + 1], &s->pieces[i], (s->count - i) * sizeof(piece));
+  s->pieces[i].lo = lo;
+  s->pieces[i].hi = hi;
+  s->pieces[i].owner = owner;
+  s->pieces[i].used = ++s->clock;
+  s->pieces[i].expires = time(NULL) + LCACHE_TTL;
+  s->count++;
+  pthread_mutex_unlock(&s->mutex);
+}
+
+/* Store [lo, hi] (no wraparound) as one piece per shard it covers */
+static void insert_span(uint32_t lo, uint32_t hi, Node owner) {
+  int first = shard_of(lo), last = shard_of(hi), i;
+  uint32_t shard_lo, shard_hi;
+
+  for (i = first; i <= last; i++) {
+    shard_lo = (uint32_t) i << (32 - LCACHE_SHARD_BITS);
+    shard_hi = shard_lo + ((uint32_t) 1 << (32 - LCACHE_SHARD_BITS)) - 1;
+    insert_piece(&shards[i], lo > shard_lo ? lo : shard_lo, hi < shard_hi ? hi : shard_hi, owner);
+  }
+}
+
+void lcache_insert(uint32_t start, uint32_t end, Node owner) {
+  uint32_t lo = start + 1;
+
+  if (owner.port == 0) {
+    return;
+  }
+  pthread_once(&once, init_shards);
+  if (lo <= end) {
+    insert_span(lo, end, owner);
+  } else { /* wraps past zero; start == end is the whole ring */
+    insert_span(lo, UINT32_MAX, owner);
+    insert_span(0, end, owner);
+  }
+}
+
+/* Drop every piece owned by owner */
+static void forget_owner(Node owner) {
+  shard *s;
+  int i, j;
+
+  for (i = 0; i < LCACHE_SHARDS; i++) {
+    s = &shards[i];
+    pthread_mutex_lock(&s->mutex);
+    for (j = 0; j < s->count; ) {
+      if (same_owner(s->pieces[j].owner, owner)) {
+        drop(s, j);
+      } else {
+        j++;
+      }
+    }
+    pthread_mutex_unlock(&s->mutex);
+  }
+}
+
+/* Owner of the piece holding key, if any */
+static bool owner_of(uint32_t key, Node *owner) {
+  shard *s = &shards[shard_of(key)];
+  int i;
+  bool found = false;
+
+  pthread_mutex_lock(&s->mutex);
+  if ((i = find(s, key)) >= 0 && key <= s->pieces[i].hi) {
+    *owner = s->pieces[i].owner;
+    found = true;
+  }
+  pthread_mutex_unlock(&s->mutex);
+  return found;
+}
+
+/* A range lives in one piece per shard, so the whole range goes with its owner */
+void lcache_forget(uint32_t key) {
+  Node owner;
+
+  pthread_once(&once, init_shards);
+  if (owner_of(key, &owner)) {
+    forget_owner(owner);
+  }
+}
+
+void lcache_invalidate(Node changed) {
+  pthread_once(&once, init_shards);
+  lcache_forget(changed.key);
+  forget_owner(changed);
+}
+
+void lcache_counters(unsigned long *hits, unsigned long *misses) {
+  int i;
+
+  pthread_once(&once, init_shards);
+  *hits = *misses = 0;
+  for (i = 0; i < LCACHE_SHARDS; i++) {
+    pthread_mutex_lock(&shards[i].mutex);
+    *hits += shards[i].hits;
+    *misses += shards[i].misses;
+    pthread_mutex_unlock(&shards[i].mutex);
+  }
+}
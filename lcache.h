@@ -0,0 +1,32 @@
+/*
+ * lcache.h - cache of recently resolved key ranges and their owners
+ *
+ */
+
+#ifndef __LCACHE_H__
+#define __LCACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "wire.h"
+
+#define   LCACHE_SHARD_BITS   4   // Shards split the key space by its top bits
+#define   LCACHE_SHARDS       (1 << LCACHE_SHARD_BITS)
+#define   LCACHE_SHARD_SIZE   256 // Ranges kept per shard
+#define   LCACHE_TTL          30  // In seconds
+
+/* Returns true and sets *owner if key falls in a cached range */
+bool lcache_lookup(uint32_t key, Node *owner);
+
+/* Records that owner is responsible for the keys in (start, end] */
+void lcache_insert(uint32_t start, uint32_t end, Node owner);
+
+/* Drops the range holding key, e.g. after its owner turned the key down */
+void lcache_forget(uint32_t key);
+
+/* Drops every range a node joining or leaving at changed may have moved */
+void lcache_invalidate(Node changed);
+
+void lcache_counters(unsigned long *hits, unsigned long *misses);
+
+#endif /* __LCACHE_H__ */
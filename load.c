@@ -0,0 +1,334 @@
+/*
+ * load.c - closed and open loop load generator for a Chord node
+ *
+ * Each connection gets a thread that keeps it open and sends one request
+ * at a time, picking the kind from the mix and the key from a uniform or
+ * zipfian distribution. In a closed loop a thread sends its next request
+ * as soon as the last is answered, so the node sets the pace. In an open
+ * loop requests arrive as a Poisson process at the given rate, spread
+ * over the threads, and latency is taken from when a request was due
+ * rather than when it went out, so a node that falls behind shows up in
+ * the latency instead of quietly lowering the offered rate. Threads keep
+ * histograms of their own, merged when the run is over.
+ */
+
+#include <math.h>
+#include <time.h>
+#include "csapp.h"
+#include "wire.h"
+#include "filter.h"
+#include "stats.h"
+#include "load.h"
+#include <arpa/inet.h>
+
+typedef struct load_result
+{
+  stats_histogram latency;  /* in nanoseconds */
+  unsigned long not_found, errors;
+} load_result;
+
+typedef struct load_worker
+{
+  pthread_t thread;
+  load_config *cfg;
+  char *ip_address;
+  int port;
+  int fd;                   /* -1 until (re)connected */
+  rio_t rio;
+  uint64_t seed;
+  double rate;              /* this thread's share, 0 for a closed loop */
+  uint64_t start, end;      /* in nanoseconds */
+  load_result results[LOAD_KINDS];
+} load_worker;
+
+static char *kind_names[] = { "get", "put", "lookup" };
+static double *zipf_cdf;    /* chance of picking one of the i + 1 most popular keys */
+static char *value;
+
+void load_defaults(load_config *cfg) {
+  cfg->connections = LOAD_CONNECTIONS;
+  cfg->duration = LOAD_DURATION;
+  cfg->rate = 0;
+  cfg->mix[LOAD_GET] = 90;
+  cfg->mix[LOAD_PUT] = 10;
+  cfg->mix[LOAD_LOOKUP] = 0;
+  cfg->keys = LOAD_KEYS;
+  cfg->zipf = 0;
+  cfg->value_size = LOAD_VALUE_SIZE;
+  cfg->recursive = false;
+}
+
+int load_parse_mix(char *s, int mix[]) {
+  int n = 0;
+
+  if (sscanf(s, "%d:%d:%d%n", &mix[LOAD_GET], &mix[LOAD_PUT], &mix[LOAD_LOOKUP], &n) != 3 || s[n] != '\0' ||
+      mix[LOAD_GET] < 0 || mix[LOAD_PUT] < 0 || mix[LOAD_LOOKUP] < 0 ||
+      mix[LOAD_GET] + mix[LOAD_PUT] + mix[LOAD_LOOKUP] == 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/* splitmix64; one state per thread */
+static uint64_t next_random(uint64_t *seed) {
+  uint64_t z = (*seed += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1) */
+static double next_uniform(uint64_t *seed) {
+  return (next_random(seed) >> 11) * 0x1.0p-53;
+}
+
+static void build_zipf(unsigned long keys, double skew) {
+  double sum = 0;
+  unsigned long i;
+
+  zipf_cdf = Malloc(keys * sizeof(double));
+  for (i = 0; i < keys; i++) {
+    sum += 1 / pow(i + 1, skew);
+    zipf_cdf[i] = sum;
+  }
+  for (i = 0; i < keys; i++) {
+    zipf_cdf[i] /= sum;
+  }
+}
+
+static unsigned long pick_key(load_worker *w) {
+  unsigned long lo = 0, hi = w->cfg->keys - 1;
+  double u;
+
+  if (zipf_cdf == NULL) {
+    return next_random(&w->seed) % w->cfg->keys;
+  }
+  u = next_uniform(&w->seed);
+  while (lo < hi) {
+    unsigned long mid = lo + (hi - lo) / 2;
+    if (zipf_cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static int pick_kind(load_worker *w) {
+  int *mix = w->cfg->mix, kind;
+  int r = next_random(&w->seed) % (mix[LOAD_GET] + mix[LOAD_PUT] + mix[LOAD_LOOKUP]);
+
+  for (kind = 0; r >= mix[kind]; kind++) {
+    r -= mix[kind];
+  }
+  return kind;
+}
+
+static int connect_to(char *ip_address, int port) {
+  struct sockaddr_in server_addr;
+  int sock;
+
+  if ((sock = socket(AF_INET, SOCK_STREAM/* use tcp */, 0)) < 0) {
+    return -1;
+  }
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_addr.s_addr = inet_addr(ip_address);
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(port);
+  if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/*
+ * send_one - Send one request of kind for key rank down w's connection and
+ * read the answer. Returns STATUS_OK, STATUS_NOT_FOUND or, if the
+ * request failed, STATUS_ERROR; a broken connection is dropped and
+ * opened again by the next request.
+ */
+static int send_one(load_worker *w, int kind, unsigned long rank) {
+  char key[32], length[WIRE_U32_MAX], request[WIRE_U32_MAX], response[MAXLINE];
+  int flags = wire_text ? FRAME_TEXT : 0, klen, rc;
+  frame_header hdr;
+  wire_reader r;
+  uint32_t status, id;
+  Node n;
+
+  if (w->fd < 0) {
+    if ((w->fd = connect_to(w->ip_address, w->port)) < 0) {
+      return STATUS_ERROR;
+    }
+    rio_readinitb(&w->rio, w->fd);
+  }
+  klen = snprintf(key, sizeof(key), "key%lu", rank);
+
+  if (kind == LOAD_LOOKUP) {
+    id = hash_key(key, klen);
+    rc = rio_writeframe(w->fd, OP_QUERY_SUC, flags | (w->cfg->recursive ? FRAME_RECURSIVE : 0),
+                        request, wire_put_u32(request, id, wire_text));
+  } else {
+    bool put = kind == LOAD_PUT;
+    struct iovec iov[4] = {
+      { length, wire_put_u32(length, klen, wire_text) },
+      { key, klen },
+      { "\n", wire_text ? 1 : 0 },
+      { value, put ? w->cfg->value_size : 0 }
+    };
+    rc = rio_writeframev(w->fd, put ? OP_PUT : OP_GET, flags, iov, 4);
+  }
+  if (rc < 0 || rio_readframeb(&w->rio, &hdr, response, MAXLINE) != 1) {
+    close(w->fd);
+    w->fd = -1;
+    return STATUS_ERROR;
+  }
+
+  wire_reader_init(&r, &hdr, response);
+  if (kind == LOAD_LOOKUP) {
+    return wire_get_node(&r, &n) < 0 || n.port == 0 ? STATUS_ERROR : STATUS_OK;
+  }
+  if (wire_get_u32(&r, &status) < 0) {
+    return STATUS_ERROR;
+  }
+  return status == STATUS_OK || status == STATUS_NOT_FOUND ? (int) status : STATUS_ERROR;
+}
+
+static void wait_until(uint64_t when) {
+  uint64_t now = stats_now();
+  struct timespec ts;
+
+  if (when > now) {
+    ts.tv_sec = (when - now) / 1000000000ULL;
+    ts.tv_nsec = (when - now) % 1000000000ULL;
+    nanosleep(&ts, NULL);
+  }
+}
+
+static void *run_worker(void *arg) {
+  load_worker *w = arg;
+  uint64_t due = w->start, sent;
+
+  while (1) {
+    if (w->rate > 0) {
+      /* Exponential gaps make Poisson arrivals */
+      due += -log(1 - next_uniform(&w->seed)) / w->rate * 1e9;
+      if (due >= w->end) {
+        break;
+      }
+      wait_until(due);
+      sent = due;
+    } else if ((sent = stats_now()) >= w->end) {
+      break;
+    }
+
+    int kind = pick_kind(w);
+    int status = send_one(w, kind, pick_key(w));
+    load_result *result = &w->results[kind];
+    stats_add(&result->latency, stats_now() - sent);
+    if (status == STATUS_NOT_FOUND) {
+      result->not_found++;
+    } else if (status != STATUS_OK) {
+      result->errors++;
+    }
+  }
+  if (w->fd >= 0) {
+    close(w->fd);
+  }
+  return NULL;
+}
+
+static void print_result(char *name, load_result *r) {
+  stats_histogram *h = &r->latency;
+
+  printf("%-7s %10llu %8lu %10lu %9.1f %9.1f %9.1f %9.1f\n", name, h->count, r->errors, r->not_found,
+         stats_quantile(h, 0.5) / 1000.0, stats_quantile(h, 0.99) / 1000.0,
+         stats_quantile(h, 0.999) / 1000.0, h->max / 1000.0);
+}
+
+int load_run(char *ip_address, int port, load_config *cfg) {
+  load_worker *workers;
+  static load_result totals[LOAD_KINDS], all;
+  uint64_t start, elapsed;
+  int i, kind, sock;
+
+  if (cfg->connections < 1 || cfg->duration < 1 || cfg->keys < 1 || cfg->rate < 0 ||
+      cfg->value_size < 0 || cfg->value_size > MAXLINE / 2) {
+    printf("Need at least one connection, second and key, and values of at most %d bytes\n", MAXLINE / 2);
+    return -1;
+  }
+  if ((sock = connect_to(ip_address, port)) < 0) {
+    printf("Cannot reach node %s, port %d\n", ip_address, port);
+    return -1;
+  }
+  close(sock);
+
+  if (cfg->zipf > 0) {
+    if (cfg->keys > LOAD_ZIPF_MAX_KEYS) {
+      printf("A zipfian load takes at most %d keys\n", LOAD_ZIPF_MAX_KEYS);
+      return -1;
+    }
+    build_zipf(cfg->keys, cfg->zipf);
+  }
+  memset(totals, 0, sizeof(totals));
+  memset(&all, 0, sizeof(all));
+  value = Malloc(cfg->value_size + 1);
+  memset(value, 'v', cfg->value_size);
+
+  printf("Load: %d connections, %s, %d s, mix %d:%d:%d get:put:lookup, %lu keys %s",
+         cfg->connections, cfg->rate > 0 ? "open loop" : "closed loop", cfg->duration,
+         cfg->mix[LOAD_GET], cfg->mix[LOAD_PUT], cfg->mix[LOAD_LOOKUP], cfg->keys,
+         cfg->zipf > 0 ? "zipfian" : "uniform");
+  if (cfg->zipf > 0) {
+    printf(" %.2f", cfg->zipf);
+  }
+  if (cfg->rate > 0) {
+    printf(", %.0f requests/s offered", cfg->rate);
+  }
+  printf("\n");
+
+  workers = Calloc(cfg->connections, sizeof(load_worker));
+  start = stats_now();
+  for (i = 0; i < cfg->connections; i++) {
+    load_worker *w = &workers[i];
+    w->cfg = cfg;
+    w->ip_address = ip_address;
+    w->port = port;
+    w->fd = -1;
+    w->seed = start + i;
+    w->rate = cfg->rate / cfg->connections;
+    w->start = start;
+    w->end = start + cfg->duration * 1000000000ULL;
+    Pthread_create(&w->thread, NULL, run_worker, w);
+  }
+  for (i = 0; i < cfg->connections; i++) {
+    Pthread_join(workers[i].thread, NULL);
+    for (kind = 0; kind < LOAD_KINDS; kind++) {
+      load_result *from = &workers[i].results[kind];
+      stats_merge(&totals[kind].latency, &from->latency);
+      totals[kind].not_found += from->not_found;
+      totals[kind].errors += from->errors;
+    }
+  }
+  elapsed = stats_now() - start;
+
+  printf("%-7s %10s %8s %10s %9s %9s %9s %9s\n", "kind", "requests", "errors", "not found",
+         "p50 us", "p99 us", "p999 us", "max us");
+  for (kind = 0; kind < LOAD_KINDS; kind++) {
+    if (totals[kind].latency.count > 0) {
+      print_result(kind_names[kind], &totals[kind]);
+    }
+    stats_merge(&all.latency, &totals[kind].latency);
+    all.not_found += totals[kind].not_found;
+    all.errors += totals[kind].errors;
+  }
+  print_result("all", &all);
+  printf("Throughput: %.0f requests/s over %.2f s\n", all.latency.count / (elapsed / 1e9), elapsed / 1e9);
+
+  Free(workers);
+  Free(value);
+  Free(zipf_cdf);
+  zipf_cdf = NULL;
+  return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * load.h - closed and open loop load generator for a Chord node
+ *
+ */
+
+#ifndef __LOAD_H__
+#define __LOAD_H__
+
+#include <stdbool.h>
+
+#define   LOAD_CONNECTIONS  8
+#define   LOAD_DURATION     10     // In seconds
+#define   LOAD_KEYS         100000
+#define   LOAD_VALUE_SIZE   100    // In bytes
+#define   LOAD_ZIPF_MAX_KEYS (1 << 24) // Most keys a zipfian table is built for
+
+/* Request kinds, in the order of a mix */
+#define   LOAD_GET     0
+#define   LOAD_PUT     1
+#define   LOAD_LOOKUP  2 // query_suc for the key's hash
+#define   LOAD_KINDS   3
+
+typedef struct load_config
+{
+  int connections;          /* each with a thread of its own */
+  int duration;             /* in seconds */
+  double rate;              /* requests per second over all connections, open loop; 0 runs closed loop */
+  int mix[LOAD_KINDS];      /* relative weights of the kinds */
+  unsigned long keys;       /* keys are key0 to key<keys - 1> */
+  double zipf;              /* skew of the key popularity; 0 picks keys uniformly */
+  int value_size;
+  bool recursive;           /* lookups resolved recursively */
+} load_config;
+
+void load_defaults(load_config *cfg);
+
+/* Parses a get:put:lookup mix such as 90:10:0; returns -1 if it is not one */
+int load_parse_mix(char *s, int mix[]);
+
+/*
+ * Drives the node at ip_address and port with cfg's load for its
+ * duration and prints throughput and latency per kind. Returns -1 if the
+ * config is unusable or the node cannot be reached.
+ */
+int load_run(char *ip_address, int port, load_config *cfg);
+
+#endif /* __LOAD_H__ */
@@ -0,0 +1,229 @@
+/*
+ * log.c - leveled logging through per-thread rings
+ *
+ * Every thread that logs gets a ring of its own, registered on its first
+ * record. The thread is the ring's only producer and the flusher its only
+ * consumer, so a record is queued with a copy and a release store of the
+ * head and no lock or syscall; a record that finds the ring full is
+ * dropped and counted rather than waiting. The flusher wakes every
+ * LOG_FLUSH_INTERVAL, drains the rings in turn into one buffer per file
+ * and writes each buffer with a single write. A ring outlives its thread
+ * until the flusher has drained it. Records of one thread stay in order;
+ * records of different threads may not, but each carries its time.
+ */
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include "csapp.h"
+#include "log.h"
+
+#define   LOG_OUT  (64 * 1024) // Bytes gathered per file before a write
+
+typedef struct log_ring
+{
+  atomic_size_t head;         /* bytes ever queued, written by the thread */
+  atomic_size_t tail;         /* bytes ever drained, written by the flusher */
+  atomic_ulong dropped;       /* records that did not fit */
+  atomic_int done;            /* the thread has exited */
+  struct log_ring *next;
+  char buf[LOG_RING];
+} log_ring;
+
+/* Each record is a header and len bytes of text ending in a newline */
+typedef struct record_header
+{
+  uint16_t len;
+  uint8_t level;
+} record_header;
+
+typedef struct log_out
+{
+  int fd;
+  size_t len;
+  char buf[LOG_OUT];
+} log_out;
+
+int log_level = LEVEL_INFO;
+
+static char *level_names[] = { "error", "info", "debug" };
+
+static log_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread log_ring *self_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+/* Held while draining, by the flusher or log_flush */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_out outs[2] = { { -1 }, { -1 } }; /* log file, debug file */
+
+int log_level_of(char *name) {
+  int i;
+
+  for (i = LEVEL_ERROR; i <= LEVEL_DEBUG; i++) {
+    if (strcmp(name, level_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void ring_exit(void *arg) {
+  atomic_store_explicit(&((log_ring *) arg)->done, 1, memory_order_release);
+}
+
+static void make_ring_key(void) {
+  pthread_key_create(&ring_key, ring_exit);
+}
+
+static log_ring *register_ring(void) {
+  log_ring *r = Calloc(1, sizeof(log_ring));
+
+  pthread_once(&ring_key_once, make_ring_key);
+  pthread_setspecific(ring_key, r);
+  pthread_mutex_lock(&rings_lock);
+  r->next = rings;
+  rings = r;
+  pthread_mutex_unlock(&rings_lock);
+  return self_ring = r;
+}
+
+/* Copy len bytes at data into r from position pos, wrapping around */
+static void ring_put(log_ring *r, size_t pos, void *data, size_t len) {
+  size_t at = pos & (LOG_RING - 1), first = LOG_RING - at < len ? LOG_RING - at : len;
+
+  memcpy(r->buf + at, data, first);
+  memcpy(r->buf, (char *) data + first, len - first);
+}
+
+/* Copy len bytes of r from position pos into data, wrapping around */
+static void ring_get(log_ring *r, size_t pos, void *data, size_t len) {
+  size_t at = pos & (LOG_RING - 1), first = LOG_RING - at < len ? LOG_RING - at : len;
+
+  memcpy(data, r->buf + at, first);
+  memcpy((char *) data + first, r->buf, len - first);
+}
+
+void log_write(int level, char *fmt, ...) {
+  log_ring *r = self_ring != NULL ? self_ring : register_ring();
+  char text[LOG_RECORD_MAX];
+  record_header h;
+  struct timespec now;
+  size_t head, tail;
+  va_list args;
+  int n, m;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  n = snprintf(text, sizeof(text), "%ld.%06ld %s ", (long) now.tv_sec, now.tv_nsec / 1000, level_names[level]);
+  va_start(args, fmt);
+  m = vsnprintf(text + n, sizeof(text) - n, fmt, args);
+  va_end(args);
+  n = m < 0 ? n : n + m < (int) sizeof(text) - 1 ? n + m : (int) sizeof(text) - 1;
+  text[n++] = '\n';
+  h.len = n;
+  h.level = level;
+
+  head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (LOG_RING - (head - tail) < sizeof(h) + n) {
+    atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  ring_put(r, head, &h, sizeof(h));
+  ring_put(r, head + sizeof(h), text, n);
+  atomic_store_explicit(&r->head, head + sizeof(h) + n, memory_order_release);
+}
+
+static void out_flush(log_out *o) {
+  if (o->fd >= 0 && o->len > 0) {
+    rio_writen(o->fd, o->buf, o->len);
+  }
+  o->len = 0;
+}
+
+static void out_append(log_out *o, char *text, size_t len) {
+  if (o->len + len > LOG_OUT) {
+    out_flush(o);
+  }
+  memcpy(o->buf + o->len, text, len);
+  o->len += len;
+}
+
+/* Move r's queued records to the output buffers */
+static void drain_ring(log_ring *r) {
+  size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  unsigned long dropped;
+  char text[LOG_RECORD_MAX + 64];
+  record_header h;
+
+  while (tail != head) {
+    ring_get(r, tail, &h, sizeof(h));
+    ring_get(r, tail + sizeof(h), text, h.len);
+    out_append(&outs[h.level == LEVEL_DEBUG], text, h.len);
+    tail += sizeof(h) + h.len;
+  }
+  atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+  if ((dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed)) > 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int n = snprintf(text, sizeof(text), "%ld.%06ld info dropped %lu records, the ring was full\n",
+                     (long) now.tv_sec, now.tv_nsec / 1000, dropped);
+    out_append(&outs[0], text, n);
+  }
+}
+
+/* Drain every ring, freeing those whose thread has gone */
+static void drain(void) {
+  log_ring *r, *next, **link;
+
+  pthread_mutex_lock(&drain_lock);
+  pthread_mutex_lock(&rings_lock);
+  r = rings;
+  pthread_mutex_unlock(&rings_lock);
+
+  /* Rings are only added at the front, so the list from r on stays put */
+  for (; r != NULL; r = next) {
+    int done = atomic_load_explicit(&r->done, memory_order_acquire);
+    next = r->next;
+    drain_ring(r);
+    if (done) {
+      pthread_mutex_lock(&rings_lock);
+      for (link = &rings; *link != r; link = &(*link)->next);
+      *link = r->next;
+      pthread_mutex_unlock(&rings_lock);
+      Free(r);
+    }
+  }
+  out_flush(&outs[0]);
+  out_flush(&outs[1]);
+  pthread_mutex_unlock(&drain_lock);
+}
+
+static void *flush_loop(void *args) {
+  struct timespec interval = { LOG_FLUSH_INTERVAL / 1000, (LOG_FLUSH_INTERVAL % 1000) * 1000000L };
+
+  while (1) {
+    nanosleep(&interval, NULL);
+    drain();
+  }
+  return NULL;
+}
+
+int log_open(char *log_path, char *debug_path, int level) {
+  pthread_t flusher;
+
+  log_level = level;
+  outs[0].fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  outs[1].fd = open(debug_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  Pthread_create(&flusher, NULL, flush_loop, NULL);
+  Pthread_detach(flusher);
+  return outs[0].fd < 0 || outs[1].fd < 0 ? -1 : 0;
+}
+
+void log_flush(void) {
+  drain();
+}
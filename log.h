@@ -0,0 +1,45 @@
+/*
+ * log.h - leveled logging through per-thread rings
+ *
+ */
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#define   LOG_RING            (256 * 1024) // Bytes of records a thread may have waiting; a power of two
+#define   LOG_RECORD_MAX      512          // Longest record; longer ones are cut short
+#define   LOG_FLUSH_INTERVAL  100          // In milliseconds between flusher passes
+
+/* Levels, most severe first; errors and info go to the log file, debug to the debug file */
+#define   LEVEL_ERROR  0
+#define   LEVEL_INFO   1
+#define   LEVEL_DEBUG  2
+
+/* Records above this level are skipped without being formatted */
+extern int log_level;
+
+#define log_at(level, ...) \
+  do { if ((level) <= log_level) log_write((level), __VA_ARGS__); } while (0)
+#define log_error(...) log_at(LEVEL_ERROR, __VA_ARGS__)
+#define log_info(...)  log_at(LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LEVEL_DEBUG, __VA_ARGS__)
+
+/* The level named error, info or debug, or -1 */
+int log_level_of(char *name);
+
+/*
+ * Sets the level, opens the files appending and starts the flusher.
+ * Returns -1 if a file cannot be opened; its records are then dropped.
+ */
+int log_open(char *log_path, char *debug_path, int level);
+
+/*
+ * Queues a record on the calling thread's ring; never blocks. A record
+ * that does not fit is dropped and counted, and the count is logged.
+ */
+void log_write(int level, char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* Writes out every record queued so far, e.g. before exiting */
+void log_flush(void);
+
+#endif /* __LOG_H__ */
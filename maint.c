@@ -0,0 +1,103 @@
+/*
+ * maint.c - periodic maintenance scheduler
+ *
+ * Tasks run one at a time on a single thread, each about once per its
+ * period. Every run is pushed off by a random jitter so nodes that
+ * started together do not probe each other in lockstep, and runs are
+ * drawn from a token bucket holding at most one second of the configured
+ * rate, so a node never spends more than rate task runs per second on
+ * maintenance however short the periods are. A run that finds the bucket
+ * empty waits for the next token.
+ */
+
+#include <time.h>
+#include "csapp.h"
+#include "maint.h"
+#include "log.h"
+
+typedef struct task
+{
+  char *name;
+  maint_task *run;
+  int period_ms;
+  long due;         /* ms on the monotonic clock */
+} task;
+
+static task tasks[MAINT_MAX_TASKS];
+static int task_count;
+static int jitter_percent = MAINT_JITTER;
+static int rate = MAINT_RATE;
+static unsigned int seed;
+
+static long now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* period_ms, moved by up to jitter_percent of it either way */
+static long jittered(int period_ms) {
+  long spread = (long) period_ms * jitter_percent / 100;
+
+  if (spread == 0) {
+    return period_ms;
+  }
+  return period_ms - spread + rand_r(&seed) % (2 * spread + 1);
+}
+
+void maint_add(char *name, maint_task *run, int period_ms) {
+  if (task_count == MAINT_MAX_TASKS) {
+    log_error("maint_add: too many tasks, dropping %s", name);
+    return;
+  }
+  tasks[task_count].name = name;
+  tasks[task_count].run = run;
+  tasks[task_count].period_ms = period_ms;
+  task_count++;
+}
+
+void maint_configure(int jitter, int runs_per_second) {
+  jitter_percent = jitter;
+  rate = runs_per_second;
+}
+
+void *maint_run(void *args) {
+  double tokens = rate;
+  long now = now_ms(), last = now, wait;
+  task *next;
+  int i;
+
+  seed = (unsigned int) (now ^ getpid());
+  for (i = 0; i < task_count; i++) {
+    tasks[i].due = now + rand_r(&seed) % (tasks[i].period_ms + 1);
+  }
+
+  while (1) {
+    next = &tasks[0];
+    for (i = 1; i < task_count; i++) {
+      if (tasks[i].due < next->due) {
+        next = &tasks[i];
+      }
+    }
+    if ((wait = next->due - now_ms()) > 0) {
+      usleep(wait * 1000);
+    }
+
+    now = now_ms();
+    tokens += (double) (now - last) * rate / 1000;
+    if (tokens > rate) {
+      tokens = rate;
+    }
+    last = now;
+    if (tokens < 1) {
+      next->due = now + (long) ((1 - tokens) * 1000 / rate) + 1;
+      continue;
+    }
+    tokens -= 1;
+
+    next->run();
+    next->due = now_ms() + jittered(next->period_ms);
+  }
+  return NULL;
+}
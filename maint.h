@@ -0,0 +1,24 @@
+/*
+ * maint.h - periodic maintenance scheduler
+ *
+ */
+
+#ifndef __MAINT_H__
+#define __MAINT_H__
+
+#define   MAINT_MAX_TASKS      8
+#define   MAINT_JITTER         25 // Percent of a period, either way
+#define   MAINT_RATE           20 // Task runs per second, across all tasks
+
+typedef void maint_task(void);
+
+/* Run task about every period_ms, first within one period of maint_run starting */
+void maint_add(char *name, maint_task *task, int period_ms);
+
+/* jitter in percent of a period; rate in task runs per second */
+void maint_configure(int jitter, int rate);
+
+/* Runs the tasks on the calling thread; never returns */
+void *maint_run(void *args);
+
+#endif /* __MAINT_H__ */
@@ -0,0 +1,176 @@
+/*
+ * pool.c - keep-alive connection pool for inter-node RPCs
+ *
+ * Idle connections are kept per peer (ip/port) and handed out to one
+ * caller at a time. A connection is health checked before reuse: an idle
+ * socket that has become readable means the peer closed it (or sent
+ * something we never asked for), so it is dropped. Sends and receives
+ * time out after POOL_RPC_TIMEOUT, so a peer that stops answering fails
+ * the exchange rather than holding the caller forever.
+ */
+
+#include <poll.h>
+#include <netinet/tcp.h>
+#include "pool.h"
+
+static pool_conn *idle[POOL_BUCKETS];
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int bucket_of(char *ip_address, int port) {
+  unsigned int h = (unsigned int) port;
+  char *c;
+  for (c = ip_address; *c; c++) {
+    h = h * 31 + (unsigned char) *c;
+  }
+  return h % POOL_BUCKETS;
+}
+
+static bool same_peer(pool_conn *conn, char *ip_address, int port) {
+  return conn->port == port && strcmp(conn->ip_address, ip_address) == 0;
+}
+
+/* An idle connection must have nothing to read; EOF or stray bytes mean it is dead */
+static bool is_healthy(pool_conn *conn) {
+  struct pollfd pfd;
+
+  if (conn->rio.rio_cnt > 0) {
+    return false;
+  }
+  pfd.fd = conn->fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if (poll(&pfd, 1, 0) != 0) {
+    return false;
+  }
+  return true;
+}
+
+static pool_conn *open_conn(char *ip_address, int port) {
+  int sock, optval = 1;
+  struct sockaddr_in server_addr;
+  pool_conn *conn;
+
+  if ((sock = socket(AF_INET, SOCK_STREAM/* use tcp */, 0)) < 0) {
+    perror("Create socket error:");
+    return NULL;
+  }
+
+  server_addr.sin_addr.s_addr = inet_addr(ip_address);
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(port);
+
+  if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    close(sock);
+    return NULL;
+  }
+  /* Requests are small and latency bound */
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const void*)&optval, sizeof(int));
+
+  conn = malloc(sizeof(pool_conn));
+  conn->fd = sock;
+  pool_set_timeout(conn, POOL_RPC_TIMEOUT);
+  strncpy(conn->ip_address, ip_address, sizeof(conn->ip_address) - 1);
+  conn->ip_address[sizeof(conn->ip_address) - 1] = 0;
+  conn->port = port;
+  conn->reused = false;
+  conn->next = NULL;
+  rio_readinitb(&conn->rio, sock);
+  return conn;
+}
+
+/*
+ * pool_acquire - Return a connection to ip_address:port for exclusive use,
+ * reusing a healthy idle one when possible. Returns NULL if the peer
+ * cannot be reached.
+ */
+pool_conn *pool_acquire(char *ip_address, int port) {
+  unsigned int b = bucket_of(ip_address, port);
+  pool_conn *conn, **prev;
+
+  while (1) {
+    pthread_mutex_lock(&pool_mutex);
+    for (prev = &idle[b], conn = idle[b]; conn != NULL; prev = &conn->next, conn = conn->next) {
+      if (same_peer(conn, ip_address, port)) {
+        *prev = conn->next;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (conn == NULL) {
+      return open_conn(ip_address, port);
+    }
+    if (is_healthy(conn)) {
+      conn->reused = true;
+      conn->next = NULL;
+      return conn;
+    }
+    pool_discard(conn);
+  }
+}
+
+/* pool_release - Hand a connection back after a complete request/response */
+void pool_release(pool_conn *conn) {
+  unsigned int b = bucket_of(conn->ip_address, conn->port);
+  pool_conn *c;
+  int count = 0;
+
+  conn->last_used = time(NULL);
+
+  pthread_mutex_lock(&pool_mutex);
+  for (c = idle[b]; c != NULL; c = c->next) {
+    if (same_peer(c, conn->ip_address, conn->port)) {
+      count++;
+    }
+  }
+  if (count < POOL_MAX_IDLE) {
+    conn->next = idle[b];
+    idle[b] = conn;
+    conn = NULL;
+  }
+  pthread_mutex_unlock(&pool_mutex);
+
+  if (conn != NULL) {
+    pool_discard(conn);
+  }
+}
+
+/* pool_discard - Close a connection that failed or is no longer wanted */
+void pool_discard(pool_conn *conn) {
+  close(conn->fd);
+  free(conn);
+}
+
+/* pool_reap - Close connections that have been idle for idle_seconds or more */
+void pool_reap(int idle_seconds) {
+  time_t now = time(NULL);
+  pool_conn *conn, **prev, *expired = NULL;
+  int i;
+
+  pthread_mutex_lock(&pool_mutex);
+  for (i = 0; i < POOL_BUCKETS; i++) {
+    prev = &idle[i];
+    while ((conn = *prev) != NULL) {
+      if (now - conn->last_used >= idle_seconds) {
+        *prev = conn->next;
+        conn->next = expired;
+        expired = conn;
+      } else {
+        prev = &conn->next;
+      }
+    }
+  }
+  pthread_mutex_unlock(&pool_mutex);
+
+  while ((conn = expired) != NULL) {
+    expired = conn->next;
+    pool_discard(conn);
+  }
+}
+
+void pool_set_timeout(pool_conn *conn, int seconds) {
+  struct timeval tv = { seconds, 0 };
+
+  setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
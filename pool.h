@@ -0,0 +1,37 @@
+/*
+ * pool.h - keep-alive connection pool for inter-node RPCs
+ *
+ */
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdbool.h>
+#include <time.h>
+#include "csapp.h"
+
+#define   POOL_BUCKETS       64
+#define   POOL_MAX_IDLE      4  // Idle connections kept per peer
+#define   POOL_IDLE_TIMEOUT  30 // In seconds
+#define   POOL_RPC_TIMEOUT   10 // In seconds a send or receive may block before the exchange fails
+
+typedef struct pool_conn
+{
+  int fd;
+  char ip_address[16];
+  int port;
+  bool reused;       /* came from the idle list rather than a fresh connect */
+  time_t last_used;
+  rio_t rio;
+  struct pool_conn *next;
+} pool_conn;
+
+pool_conn *pool_acquire(char *ip_address, int port);
+void pool_release(pool_conn *conn);
+void pool_discard(pool_conn *conn);
+void pool_reap(int idle_seconds);
+
+/* Sets how long a send or receive on conn may block; 0 waits forever */
+void pool_set_timeout(pool_conn *conn, int seconds);
+
+#endif /* __POOL_H__ */
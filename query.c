@@ -7,6 +7,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "csapp.h"
+#include "wire.h"
+#include "filter.h"
+#include "load.h"
 #include <pthread.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -22,13 +25,8 @@
 #define   KEY_SIZE      32
 #define   KEY_SPACE     4294967296
 #define   LOCAL_IP_ADDRESS "127.0.0.1" 
-
-typedef struct Node 
-{
-  uint32_t key;
-  char ip_address[12];
-  int port;
-} Node;
+#define   FILTER_MAX    (1 << 24) // Largest filter accepted, in bytes
+#define   STATS_MAX     (1 << 20) // Largest stats table accepted, in bytes
 
 /*============================================================
  * function declarations
@@ -36,10 +34,14 @@ typedef struct Node
 
 void initialize_query(char *ip_address, int port);
 void send_query(char search_key[], char *ip_address, int port);
-void handle_options(char *ip_address, int port, char *option);
+void handle_options(char *ip_address, int port, char *option, char *argument, char *value);
+void send_data(Node n, int opcode, char *key, char *value);
+void save_filter(Node n);
+void check_filter(char *key);
+void print_stats(Node n);
 
-Node fetch_query(Node n, char message[]);
-void send_request(Node n, char message[]);
+Node fetch_query(Node n, int opcode, int flags, char payload[], size_t len);
+void send_request(Node n, int opcode, char payload[], size_t len);
 
 /* Remote functions */
 Node fetch_successor(Node n);
@@ -50,7 +52,6 @@ Node query_closest_preceding_finger(uint32_t key, Node n);
 void request_update_successor(Node successor, Node n);
 void request_update_predecessor(Node predecessor, Node n);
 void request_update_finger_table(Node s, int i, Node n);
-Node parse_incoming_node(rio_t *client);
 
 /* Utility functions */
 uint32_t hash_address(char *ip_address, int port);
@@ -58,19 +59,65 @@ uint32_t hash_address(char *ip_address, int port);
 void print_node(Node n);
 void println();
 
+bool lookup_recursive = false; // Ask for recursive query_suc lookups
+load_config load; // For the load option
+
 int main(int argc, char *argv[])
 { 
-  int listen_port, node_port;
+  int listen_port, node_port, opt;
+  char *prog = argv[0];
+
+  load_defaults(&load);
+  while ((opt = getopt(argc, argv, "tRc:d:r:m:k:z:v:")) != -1) {
+    switch (opt) {
+    case 't': /* text debug encoding for routing messages */
+      wire_text = true;
+      break;
+    case 'R': /* have the node resolve query_suc recursively */
+      lookup_recursive = true;
+      load.recursive = true;
+      break;
+    case 'c': /* load: connections, a thread each */
+      load.connections = atoi(optarg);
+      break;
+    case 'd': /* load: seconds to run */
+      load.duration = atoi(optarg);
+      break;
+    case 'r': /* load: requests per second, open loop; closed loop without */
+      load.rate = atof(optarg);
+      break;
+    case 'm': /* load: get:put:lookup weights */
+      if (load_parse_mix(optarg, load.mix) < 0) {
+        printf("Mix must be get:put:lookup weights, such as 90:10:0\n");
+        exit(1);
+      }
+      break;
+    case 'k': /* load: keys */
+      load.keys = strtoul(optarg, NULL, 10);
+      break;
+    case 'z': /* load: zipfian skew; uniform without */
+      load.zipf = atof(optarg);
+      break;
+    case 'v': /* load: value size in bytes */
+      load.value_size = atoi(optarg);
+      break;
+    default:
+      printf("Usage: %s [-t] [-R] [-c connections] [-d seconds] [-r rate] [-m get:put:lookup] [-k keys] [-z skew] [-v bytes] ip_address port [options]\n", prog);
+      exit(1);
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
 
   if (argc == 3) {
     listen_port = atoi(argv[2]);
     initialize_query(argv[1], listen_port);
-  } else if (argc == 4) {
+  } else if (argc >= 4 && argc <= 6) {
     listen_port = atoi(argv[2]);
-    handle_options(argv[1], listen_port, argv[3]);
+    handle_options(argv[1], listen_port, argv[3], argc >= 5 ? argv[4] : "0", argc == 6 ? argv[5] : "");
   }
   else {
-    printf("Usage: %s ip_address port [options]\n", argv[0]);
+    printf("Usage: %s [-t] [-R] [-c connections] [-d seconds] [-r rate] [-m get:put:lookup] [-k keys] [-z skew] [-v bytes] ip_address port [options]\n", prog);
     exit(1);
   }
 }
@@ -78,17 +125,30 @@ int main(int argc, char *argv[])
 void initialize_query(char *ip_address, int port) {
   Node return_node;
   uint32_t key, hash_value;
-  char search_key[MAXLINE];
+  char search_key[MAXLINE], *line;
+  ssize_t len;
+  rio_t input;
 
   key = hash_address(ip_address, port);
   printf("Connected to node %s, port %d, position %x\n", ip_address, port, key);
+  rio_readinitb(&input, STDIN_FILENO);
 
   while (1) {
     printf("Please enter your search key (or type \"quit\" to leave): \n");
-    fflush(stdin);
+    fflush(stdout);
 
-    search_key[0] = 0;
-    gets(search_key);
+    /* The line is a view into input's buffer; keep it without the newline */
+    if ((len = rio_readlineb_view(&input, &line)) <= 0) {
+      break;
+    }
+    if (line[len - 1] == '\n') {
+      len--;
+    }
+    if (len > MAXLINE - 1) {
+      len = MAXLINE - 1;
+    }
+    memcpy(search_key, line, len);
+    search_key[len] = 0;
     if (strncmp(search_key, "quit", 4) == 0) {
       break;
     }
@@ -97,7 +157,7 @@ void initialize_query(char *ip_address, int port) {
   }
 }
 
-void handle_options(char *ip_address, int port, char *option) {
+void handle_options(char *ip_address, int port, char *option, char *argument, char *value) {
   Node return_node;
   uint32_t key, hash_value;
   char search_key[MAXLINE];
@@ -116,98 +176,259 @@ void handle_options(char *ip_address, int port, char *option) {
     return_node = fetch_predecessor(n);
     print_node(return_node);
   }
+  if (strncmp(option, "query_suc", 9) == 0) {
+    return_node = query_successor((uint32_t) strtoul(argument, NULL, 10), n);
+    print_node(return_node);
+  }
   if (strncmp(option, "print_table", 11) == 0) {
-    char request[MAXLINE];
-    strcpy(request, option);
-    send_request(n, request);
+    send_request(n, OP_PRINT_TABLE, "", 0);
+  }
+  /* put key value, get key, delete key: the node routes them to the key's owner */
+  if (strcmp(option, "put") == 0) {
+    send_data(n, OP_PUT, argument, value);
+  }
+  if (strcmp(option, "get") == 0) {
+    send_data(n, OP_GET, argument, "");
+  }
+  if (strcmp(option, "delete") == 0) {
+    send_data(n, OP_DELETE, argument, "");
+  }
+  /* filter saves the node's filter of its keys; check key tests a key against the saved one */
+  if (strcmp(option, "filter") == 0) {
+    save_filter(n);
+  }
+  if (strcmp(option, "check") == 0) {
+    check_filter(argument);
+  }
+  /* stats prints the node's RPC latencies and lookup hop counts */
+  if (strcmp(option, "stats") == 0) {
+    print_stats(n);
+  }
+  /* load drives the node with requests as the load flags say, then prints throughput and latency */
+  if (strcmp(option, "load") == 0) {
+    if (load_run(ip_address, port, &load) < 0) {
+      exit(1);
+    }
   }
 }
 
-void send_query(char search_key[], char *ip_address, int port) {
+void send_data(Node n, int opcode, char *key, char *value) {
   int sock;
-  uint32_t key, hash_value;
   struct sockaddr_in server_addr;
   rio_t server;
+  char length[WIRE_U32_MAX], response[MAXLINE];
+  frame_header hdr;
+  wire_reader r;
+  uint32_t status;
+  struct iovec iov[4] = {
+    { length, wire_put_u32(length, strlen(key), wire_text) },
+    { key, strlen(key) },
+    { "\n", wire_text ? 1 : 0 },
+    { value, strlen(value) }
+  };
+
+  if (strlen(key) + strlen(value) + 2 * WIRE_U32_MAX > MAXLINE) {
+    printf("Key and value too long\n");
+    return;
+  }
 
   if ((sock = socket(AF_INET, SOCK_STREAM/* use tcp */, 0)) < 0) {
     perror("Create socket error:");
   }
 
-  server_addr.sin_addr.s_addr = inet_addr(ip_address);
+  server_addr.sin_addr.s_addr = inet_addr(n.ip_address);
   server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(port);
+  server_addr.sin_port = htons(n.port);
 
   if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
     perror("Connect error:");
   }
 
-  char request[MAXLINE] = "search_query";
-  strcat(request, search_key);
+  if (rio_writeframev(sock, opcode, wire_text ? FRAME_TEXT : 0, iov, 4) < 0) {
+    perror("Send error:");
+  }
+  shutdown(sock, SHUT_WR);
+
+  Rio_readinitb(&server, sock);
+  if (rio_readframeb(&server, &hdr, response, MAXLINE) != 1) {
+    printf("No response received\n");
+    Close(sock);
+    return;
+  }
+  Close(sock);
 
-  unsigned char hash[SHA_DIGEST_LENGTH];
-  SHA1(search_key, strlen(search_key), hash);
-  memcpy(&hash_value, hash + 16, sizeof(hash_value));
-  printf("Hash value is %x\n", hash_value);
+  wire_reader_init(&r, &hdr, response);
+  if (wire_get_u32(&r, &status) < 0) {
+    printf("No response received\n");
+    return;
+  }
+  if (status == STATUS_OK) {
+    printf("OK\n");
+    if (opcode == OP_GET) {
+      printf("%.*s\n", (int) (r.end - r.pos), r.pos);
+    }
+  } else if (status == STATUS_NOT_FOUND) {
+    printf("Not found.\n");
+  } else {
+    printf("Error %u\n", status);
+  }
+}
+
+void print_stats(Node n) {
+  int sock;
+  struct sockaddr_in server_addr;
+  rio_t server;
+  frame_header hdr;
+  char *buf = NULL;
+  size_t cap = 0;
 
-  if (send(sock, request, MAXLINE,0) < 0) {
+  if ((sock = socket(AF_INET, SOCK_STREAM/* use tcp */, 0)) < 0) {
+    perror("Create socket error:");
+  }
+
+  server_addr.sin_addr.s_addr = inet_addr(n.ip_address);
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(n.port);
+
+  if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    perror("Connect error:");
+  }
+
+  if (rio_writeframe(sock, OP_STATS, 0, "", 0) < 0) {
     perror("Send error:");
   }
+  shutdown(sock, SHUT_WR);
 
-  key = hash_address(ip_address, port);
-  printf("Response from node %s, port %d, position %x\n", ip_address, port, key);
   Rio_readinitb(&server, sock);
-  while (Rio_readlineb(&server, request, MAXLINE) > 0) {
-    if (request[0] != '\0') {
-      printf("%s\n", request);
-    }
+  if (rio_readframe_grow(&server, &hdr, &buf, &cap, STATS_MAX) != 1) {
+    printf("No response received\n");
+  } else {
+    printf("%.*s", (int) hdr.length, buf);
   }
   Close(sock);
+  Free(buf);
 }
 
-Node parse_incoming_node(rio_t *client) {
-  int numBytes;
-  char request[MAXLINE];
-  Node n;
+void save_filter(Node n) {
+  int sock, fd = -1;
+  struct sockaddr_in server_addr;
+  rio_t server;
+  frame_header hdr;
+  char *buf = NULL;
+  size_t cap = 0;
+  filter *f;
 
-  numBytes = Rio_readlineb(client, request, MAXLINE);
-  if (numBytes <= 0) {
-    printf("No request received\n");
-  } else {
-    n.key = (uint32_t) atoi(request);
+  if ((sock = socket(AF_INET, SOCK_STREAM/* use tcp */, 0)) < 0) {
+    perror("Create socket error:");
   }
-  request[0] = 0;
-  numBytes = Rio_readlineb(client, request, MAXLINE);
-  if (numBytes <= 0) {
-    printf("No request received\n");
-  } else {
-    int len = strlen(request);
-    if (len > 0 && request[len-1] == '\n') request[len-1] = '\0';
-    strcpy(n.ip_address, request);
-  }
-  request[0] = 0;
-  numBytes = Rio_readlineb(client, request, MAXLINE);
-  if (numBytes <= 0) {
-    printf("No request received\n");
+
+  server_addr.sin_addr.s_addr = inet_addr(n.ip_address);
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(n.port);
+
+  if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    perror("Connect error:");
+  }
+
+  if (rio_writeframe(sock, OP_FILTER, 0, "", 0) < 0) {
+    perror("Send error:");
+  }
+  shutdown(sock, SHUT_WR);
+
+  Rio_readinitb(&server, sock);
+  if (rio_readframe_grow(&server, &hdr, &buf, &cap, FILTER_MAX) != 1) {
+    printf("No response received\n");
+    Close(sock);
+    return;
+  }
+  Close(sock);
+
+  if ((f = filter_decode(buf, hdr.length)) == NULL) {
+    printf("The node has no filter to give right now\n");
+  } else if ((fd = open(FILTER_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+             rio_writen(fd, buf, hdr.length) != hdr.length) {
+    perror("Filter file error:");
   } else {
-    n.port = atoi(request);
+    printf("Saved a filter of %zu keys (%u bytes) to %s\n", filter_count(f), hdr.length, FILTER_FILE);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  filter_free(f);
+  Free(buf);
+}
+
+void check_filter(char *key) {
+  struct stat st;
+  uint32_t id;
+  filter *f = NULL;
+  char *buf;
+  int fd;
+
+  if ((fd = open(FILTER_FILE, O_RDONLY)) >= 0 && fstat(fd, &st) == 0) {
+    buf = Malloc(st.st_size);
+    if (rio_readn(fd, buf, st.st_size) == st.st_size) {
+      f = filter_decode(buf, st.st_size);
+    }
+    Free(buf);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (f == NULL) {
+    printf("No filter saved; fetch one with the filter option\n");
+    return;
+  }
+
+  id = hash_key(key, strlen(key));
+  printf("%s\n", filter_contains(f, id, filter_tag(key, strlen(key))) ? "May be present." : "Not present.");
+  filter_free(f);
+}
+
+void send_query(char search_key[], char *ip_address, int port) {
+  int sock;
+  uint32_t key, hash_value;
+  struct sockaddr_in server_addr;
+  rio_t server;
+
+  if ((sock = socket(AF_INET, SOCK_STREAM/* use tcp */, 0)) < 0) {
+    perror("Create socket error:");
+  }
+
+  server_addr.sin_addr.s_addr = inet_addr(ip_address);
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(port);
+
+  if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    perror("Connect error:");
+  }
+
+  char request[MAXLINE];
+  frame_header hdr;
+
+  hash_value = hash_key(search_key, strlen(search_key));
+  printf("Hash value is %x\n", hash_value);
+
+  if (rio_writeframe(sock, OP_SEARCH_QUERY, 0, search_key, strlen(search_key)) < 0) {
+    perror("Send error:");
   }
+  shutdown(sock, SHUT_WR);
 
-  return n;
+  key = hash_address(ip_address, port);
+  printf("Response from node %s, port %d, position %x\n", ip_address, port, key);
+  Rio_readinitb(&server, sock);
+  if (rio_readframeb(&server, &hdr, request, MAXLINE) == 1) {
+    printf("%s\n", request);
+  }
+  Close(sock);
 }
 
 uint32_t hash_address(char *ip_address, int port) {
-  char port_str[5];
   unsigned char hash[SHA_DIGEST_LENGTH];
-  hash[0] = 0;
   uint32_t key;
-  port_str[0] = 0;
-  sprintf(port_str, "%d", port);
-  char data[strlen(ip_address) + strlen(port_str) + sizeof(char)];
-  data[0] = 0;
-  strcat(data, ip_address);
-  strcat(data, ":");
-  strcat(data, port_str);
-  SHA1(data, sizeof(data), hash);
+  char data[strlen(ip_address) + 16];
+  int len = snprintf(data, sizeof(data), "%s:%d", ip_address, port);
+  SHA1((unsigned char *) data, len, hash);
   memcpy(&key, hash + 16, sizeof(key));
   return key;
 }
@@ -230,89 +451,57 @@ bool is_between(uint32_t key, uint32_t a, uint32_t b) {
 }
 
 Node fetch_successor(Node n) {
-  char request_string[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "fetch_suc");
-  return fetch_query(n, request_string);
+  return fetch_query(n, OP_FETCH_SUC, 0, "", 0);
 }
 
 Node fetch_predecessor(Node n) {
-  char request_string[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "fetch_pre");
-  return fetch_query(n, request_string);
+  return fetch_query(n, OP_FETCH_PRE, 0, "", 0);
 }
 
 Node query_predecessor(uint32_t key, Node n) {
-  char request_string[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "query_pre");
-  sprintf(request_string+9, "%u", key);
-  return fetch_query(n, request_string);
+  char request_string[WIRE_U32_MAX];
+  size_t len = wire_put_u32(request_string, key, wire_text);
+  return fetch_query(n, OP_QUERY_PRE, 0, request_string, len);
 }
 
 Node query_successor(uint32_t key, Node n) {
-  char request_string[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "query_suc");
-  sprintf(request_string+9, "%u", key);
-  return fetch_query(n, request_string);
+  char request_string[WIRE_U32_MAX];
+  size_t len = wire_put_u32(request_string, key, wire_text);
+  int flags = lookup_recursive ? FRAME_RECURSIVE : 0;
+  return fetch_query(n, OP_QUERY_SUC, flags, request_string, len);
 }
 
 Node query_closest_preceding_finger(uint32_t key, Node n) {
-  char request_string[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "query_cpf");
-  sprintf(request_string+9, "%u", key);
-  return fetch_query(n, request_string);
+  char request_string[WIRE_U32_MAX];
+  size_t len = wire_put_u32(request_string, key, wire_text);
+  return fetch_query(n, OP_QUERY_CPF, 0, request_string, len);
 }
 
 void request_update_successor(Node successor, Node n) {
-  char request_string[MAXLINE], buf1[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "update_suc\n");
-  sprintf(buf1, "%u\n", successor.key);
-  strcat(request_string, buf1);
-  strcat(request_string, successor.ip_address);
-  strcat(request_string, "\n");
-  sprintf(buf1, "%d\n", successor.port);
-  strcat(request_string, buf1);
-
-  send_request(n, request_string);
+  char request_string[WIRE_NODE_MAX];
+  size_t len = wire_put_node(request_string, successor, wire_text);
+
+  send_request(n, OP_UPDATE_SUC, request_string, len);
 }
 
 void request_update_predecessor(Node predecessor, Node n) {
-  char request_string[MAXLINE], buf1[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "update_pre\n");
-  sprintf(buf1, "%u\n", predecessor.key);
-  strcat(request_string, buf1);
-  strcat(request_string, predecessor.ip_address);
-  strcat(request_string, "\n");
-  sprintf(buf1, "%d\n", predecessor.port);
-  strcat(request_string, buf1);
-
-  send_request(n, request_string);
+  char request_string[WIRE_NODE_MAX];
+  size_t len = wire_put_node(request_string, predecessor, wire_text);
+
+  send_request(n, OP_UPDATE_PRE, request_string, len);
 }
 
 void request_update_finger_table(Node s, int i, Node n) {
-  char request_string[MAXLINE], buf1[MAXLINE];
-  request_string[0] = 0;
-  strcat(request_string, "update_fin\n");
-  sprintf(buf1, "%u\n", s.key);
-  strcat(request_string, buf1);
-  strcat(request_string, s.ip_address);
-  strcat(request_string, "\n");
-  sprintf(buf1, "%d\n", s.port);
-  strcat(request_string, buf1);
-  sprintf(buf1, "%d\n", i);
-  strcat(request_string, buf1);
-
-  send_request(n, request_string);
+  char request_string[WIRE_NODE_MAX + WIRE_U32_MAX];
+  size_t len = wire_put_node(request_string, s, wire_text);
+  len += wire_put_u32(request_string + len, i, wire_text);
+
+  send_request(n, OP_UPDATE_FIN, request_string, len);
 }
 
-Node fetch_query(Node n, char message[]) {
+Node fetch_query(Node n, int opcode, int flags, char payload[], size_t len) {
   Node return_node;
+  memset(&return_node, 0, sizeof(Node));
   int sock;
   struct sockaddr_in server_addr;
   rio_t server;
@@ -330,46 +519,36 @@ Node fetch_query(Node n, char message[]) {
   }
   printf("Connected to server %s:%d\n", n.ip_address, n.port);
 
-  int numBytes;
   char response[MAXLINE];
-  printf("Message: %s\n", message);
+  frame_header hdr;
+  wire_reader r;
+  printf("Message: %s (%zu bytes)\n", opcode_name(opcode), len);
 
-  if (send(sock, message, MAXLINE,0) < 0) {
+  if (wire_text) {
+    flags |= FRAME_TEXT;
+  }
+  if (rio_writeframe(sock, opcode, flags, payload, len) < 0) {
     perror("Send error:");
   }
   shutdown(sock, SHUT_WR);
 
   Rio_readinitb(&server, sock);
-  numBytes = Rio_readlineb(&server, response, MAXLINE);
-  if (numBytes <= 0) {
+  if (rio_readframeb(&server, &hdr, response, MAXLINE) != 1) {
     printf("No response received\n");
-  } else {
-    return_node.key = (uint32_t) atoi(response);
-  }
-
-  response[0] = 0;
-  numBytes = Rio_readlineb(&server, response, MAXLINE);
-  if (numBytes <= 0) {
-    printf("No response received\n");
-  } else {
-    int len = strlen(response);
-    if (len > 0 && response[len-1] == '\n') response[len-1] = '\0';
-    strcpy(return_node.ip_address, response);
+    Close(sock);
+    return return_node;
   }
+  Close(sock);
 
-  response[0] = 0;
-  numBytes = Rio_readlineb(&server, response, MAXLINE);
-  if (numBytes <= 0) {
+  wire_reader_init(&r, &hdr, response);
+  if (wire_get_node(&r, &return_node) < 0) {
     printf("No response received\n");
-  } else {
-    return_node.port = atoi(response);
   }
-  Close(sock);
 
   return return_node;
 }
 
-void send_request(Node n, char message[]) {
+void send_request(Node n, int opcode, char payload[], size_t len) {
   Node return_node;
   int sock;
   struct sockaddr_in server_addr;
@@ -388,14 +567,12 @@ void send_request(Node n, char message[]) {
   }
   printf("Connected to server %s:%d\n", n.ip_address, n.port);
 
-  int numBytes;
-  char response[MAXLINE];
-  printf("Message: %s\n", message);
+  printf("Message: %s (%zu bytes)\n", opcode_name(opcode), len);
 
-  if (send(sock, message, MAXLINE,0) < 0) {
+  if (rio_writeframe(sock, opcode, wire_text ? FRAME_TEXT : 0, payload, len) < 0) {
     perror("Send error:");
   }
-  shutdown(sock, SHUT_WR);
+  Close(sock);
 }
 
 void print_node(Node n) {
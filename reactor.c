@@ -0,0 +1,495 @@
+/*
+ * reactor.c - epoll event loop serving framed requests
+ *
+ * There is one I/O thread per core, each with its own epoll instance.
+ * Every I/O thread waits on the listening socket (EPOLLEXCLUSIVE) and a
+ * connection stays on the thread that accepted it, so connection buffers
+ * are never shared between I/O threads. Sockets are non-blocking; input
+ * is parsed into frames in place and replies are queued on the connection
+ * and written as the socket allows.
+ *
+ * A request whose handler may block on a remote node is handed to a
+ * pool of worker threads. The connection is removed from epoll while the
+ * worker owns it and handed back to its I/O thread through an eventfd
+ * afterwards, so replies still leave in request order. Such handlers make
+ * requests of their own to nodes that may be waiting on us in turn, so
+ * the pool grows past REACTOR_WORKERS whenever every worker is taken,
+ * rather than leave a request queued behind workers that wait on it;
+ * the extra workers exit once idle for REACTOR_WORKER_IDLE.
+ */
+
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include "reactor.h"
+#include "log.h"
+
+#define   REACTOR_EVENTS  256
+#define   CONN_BUFSIZE    2048
+
+typedef struct io_thread io_thread;
+
+struct reactor_conn
+{
+  int fd;
+  io_thread *owner;
+  char *in;             /* received bytes not yet handled */
+  size_t in_off, in_len, in_cap;
+  char *out;            /* reply bytes not yet written */
+  size_t out_off, out_len, out_cap;
+  unsigned long long queued; /* reply bytes ever queued */
+  bool busy;            /* a worker owns the connection */
+  bool peer_closed;
+  uint32_t events;      /* epoll interest last registered */
+  frame_header job_hdr; /* request handed to the worker */
+  char *job_payload;
+  reactor_conn *next;   /* work or completion queue */
+};
+
+struct io_thread
+{
+  int epfd;
+  int wakefd;
+  pthread_mutex_t lock;
+  reactor_conn *done;   /* connections handed back by workers */
+  pthread_t tid;
+};
+
+static int listen_fd;
+static int listen_tag;  /* epoll data for the listening socket */
+static reactor_handler *handle;
+static reactor_blocking *blocking;
+
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static reactor_conn *work_head, *work_tail;
+static int workers, idle_workers, work_count; /* under work_lock */
+
+static void *worker_loop(void *args);
+
+/* Start a worker; work_lock held */
+static void add_worker(void) {
+  pthread_t tid;
+
+  if (pthread_create(&tid, NULL, worker_loop, NULL) != 0) {
+    log_error("Worker thread error");
+    return;
+  }
+  pthread_detach(tid);
+  workers++;
+}
+
+static void conn_process(reactor_conn *c);
+
+static void set_nonblocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+/* Make room for at least need more bytes after len in a growable buffer */
+static void reserve(char **buf, size_t *cap, size_t len, size_t need) {
+  size_t size = *cap;
+  while (size - len < need) {
+    size *= 2;
+  }
+  if (size != *cap) {
+    *buf = realloc(*buf, size);
+    *cap = size;
+  }
+}
+
+static void conn_free(reactor_conn *c) {
+  close(c->fd);
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+/* Interest for c: input until the peer closes, output while replies are queued */
+static uint32_t conn_events(reactor_conn *c) {
+  return (c->peer_closed ? 0 : EPOLLIN) | (c->out_len > c->out_off ? EPOLLOUT : 0);
+}
+
+static void conn_arm(reactor_conn *c, int op) {
+  struct epoll_event ev;
+
+  c->events = conn_events(c);
+  ev.events = c->events;
+  ev.data.ptr = c;
+  epoll_ctl(c->owner->epfd, op, c->fd, &ev);
+}
+
+/*
+ * conn_reply - Queue a reply frame on c. Called by handlers, either on
+ * the connection's I/O thread or on the worker that owns it.
+ */
+void conn_reply(reactor_conn *c, int opcode, int flags, void *payload, size_t len) {
+  struct iovec iov = { payload, len };
+  conn_replyv(c, opcode, flags, &iov, 1);
+}
+
+/* conn_replyv - Like conn_reply, with the payload in parts copied straight into c's output */
+void conn_replyv(reactor_conn *c, int opcode, int flags, struct iovec *iov, int iovcnt) {
+  size_t len = 0, pos;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+  reserve(&c->out, &c->out_cap, c->out_len, FRAME_HEADER_SIZE + len);
+  wire_put_header((unsigned char *) c->out + c->out_len, opcode, flags, len);
+  pos = c->out_len + FRAME_HEADER_SIZE;
+  for (i = 0; i < iovcnt; i++) {
+    memcpy(c->out + pos, iov[i].iov_base, iov[i].iov_len);
+    pos += iov[i].iov_len;
+  }
+  c->out_len = pos;
+  c->queued += FRAME_HEADER_SIZE + len;
+}
+
+unsigned long long conn_queued(reactor_conn *c) {
+  return c->queued;
+}
+
+/* Write queued replies until done or the socket is full; -1 on error */
+static int conn_flush(reactor_conn *c) {
+  ssize_t n;
+
+  while (c->out_off < c->out_len) {
+    n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      return -1;
+    }
+    c->out_off += n;
+  }
+  c->out_off = c->out_len = 0;
+  return 0;
+}
+
+/*
+ * conn_stream - Queue a frame and write everything queued, waiting while
+ * the socket is full. Only a worker may call this, since it owns the
+ * connection outright; a long reply can then go out frame by frame
+ * instead of being queued whole. Returns -1 if the peer is gone.
+ */
+int conn_stream(reactor_conn *c, int opcode, int flags, void *payload, size_t len) {
+  struct pollfd pfd;
+
+  conn_reply(c, opcode, flags, payload, len);
+  while (c->out_len > 0) {
+    if (conn_flush(c) < 0) {
+      return -1;
+    }
+    if (c->out_len == 0) {
+      break;
+    }
+    pfd.fd = c->fd;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Read everything the socket has; -1 on error */
+static int conn_read(reactor_conn *c) {
+  ssize_t n;
+
+  while (!c->peer_closed) {
+    reserve(&c->in, &c->in_cap, c->in_len, CONN_BUFSIZE / 2);
+    n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      c->peer_closed = true;
+    }
+    c->in_len += n;
+  }
+  return 0;
+}
+
+/*
+ * conn_settle - Flush and re-arm c after its input was processed, or
+ * close it once the peer is gone and nothing is left to send.
+ */
+static void conn_settle(reactor_conn *c) {
+  if (c->busy) {
+    return; /* owned by a worker until it is handed back */
+  }
+  if (conn_flush(c) < 0) {
+    epoll_ctl(c->owner->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    conn_free(c);
+    return;
+  }
+  if (c->peer_closed && c->out_len == 0) {
+    epoll_ctl(c->owner->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    conn_free(c);
+    return;
+  }
+  if (c->events != conn_events(c)) {
+    conn_arm(c, EPOLL_CTL_MOD);
+  }
+}
+
+/* Hand the request at the head of the input to a worker */
+static void conn_offload(reactor_conn *c, frame_header *hdr, char *payload) {
+  c->job_hdr = *hdr;
+  c->job_payload = malloc(hdr->length + 1);
+  memcpy(c->job_payload, payload, hdr->length);
+  c->job_payload[hdr->length] = 0;
+
+  conn_flush(c);
+  epoll_ctl(c->owner->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  c->busy = true;
+  c->next = NULL;
+
+  pthread_mutex_lock(&work_lock);
+  if (work_tail == NULL) {
+    work_head = c;
+  } else {
+    work_tail->next = c;
+  }
+  work_tail = c;
+  if (++work_count > idle_workers && workers < REACTOR_MAX_WORKERS) {
+    add_worker();
+  }
+  pthread_cond_signal(&work_cond);
+  pthread_mutex_unlock(&work_lock);
+}
+
+/* Handle every complete frame in the input buffer, in order */
+static void conn_process(reactor_conn *c) {
+  frame_header hdr;
+  char *frame, saved;
+
+  while (!c->busy && c->in_len - c->in_off >= FRAME_HEADER_SIZE) {
+    frame = c->in + c->in_off;
+    wire_get_header((unsigned char *) frame, &hdr);
+    if (hdr.length > REACTOR_MAX_FRAME) {
+      log_error("Oversized request, closing fd %d", c->fd);
+      c->peer_closed = true;
+      c->in_off = c->in_len = 0;
+      c->out_off = c->out_len = 0;
+      return;
+    }
+    if (c->in_len - c->in_off < FRAME_HEADER_SIZE + hdr.length) {
+      break;
+    }
+    c->in_off += FRAME_HEADER_SIZE + hdr.length;
+
+    if (blocking(hdr.opcode)) {
+      conn_offload(c, &hdr, frame + FRAME_HEADER_SIZE);
+      break;
+    }
+    /* Terminate the payload in place; the byte belongs to the next frame */
+    reserve(&c->in, &c->in_cap, c->in_len, 1);
+    frame = c->in + c->in_off - hdr.length - FRAME_HEADER_SIZE;
+    saved = frame[FRAME_HEADER_SIZE + hdr.length];
+    frame[FRAME_HEADER_SIZE + hdr.length] = 0;
+    handle(c, &hdr, frame + FRAME_HEADER_SIZE);
+    frame[FRAME_HEADER_SIZE + hdr.length] = saved;
+  }
+
+  /* Move a partial frame to the front of the buffer */
+  if (c->in_off > 0) {
+    memmove(c->in, c->in + c->in_off, c->in_len - c->in_off);
+    c->in_len -= c->in_off;
+    c->in_off = 0;
+  }
+}
+
+static void accept_clients(io_thread *t) {
+  struct sockaddr_in clientaddr;
+  socklen_t clientlen;
+  reactor_conn *c;
+  int connfd, optval = 1;
+
+  while (1) {
+    clientlen = sizeof(clientaddr);
+    connfd = accept4(listen_fd, (SA *)&clientaddr, &clientlen, SOCK_NONBLOCK);
+    if (connfd < 0) {
+      if (errno == EMFILE || errno == ENFILE) {
+        perror("Accept error:");
+      }
+      return;
+    }
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, (const void*)&optval, sizeof(int));
+
+    c = calloc(1, sizeof(reactor_conn));
+    c->fd = connfd;
+    c->owner = t;
+    c->in_cap = c->out_cap = CONN_BUFSIZE;
+    c->in = malloc(c->in_cap);
+    c->out = malloc(c->out_cap);
+    conn_arm(c, EPOLL_CTL_ADD);
+  }
+}
+
+/* Take back connections whose blocking request a worker has finished */
+static void collect_done(io_thread *t) {
+  reactor_conn *c, *next;
+  uint64_t count;
+
+  if (read(t->wakefd, &count, sizeof(count)) < 0) {
+    /* nothing pending */
+  }
+  pthread_mutex_lock(&t->lock);
+  c = t->done;
+  t->done = NULL;
+  pthread_mutex_unlock(&t->lock);
+
+  for (; c != NULL; c = next) {
+    next = c->next;
+    c->busy = false;
+    conn_arm(c, EPOLL_CTL_ADD);
+    conn_process(c);
+    conn_settle(c);
+  }
+}
+
+static void *io_loop(void *args) {
+  io_thread *t = args;
+  struct epoll_event events[REACTOR_EVENTS];
+  reactor_conn *c;
+  int i, n;
+
+  while (1) {
+    n = epoll_wait(t->epfd, events, REACTOR_EVENTS, -1);
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == &listen_tag) {
+        accept_clients(t);
+        continue;
+      }
+      if (events[i].data.ptr == t) {
+        collect_done(t);
+        continue;
+      }
+      c = events[i].data.ptr;
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        if (conn_read(c) < 0) {
+          epoll_ctl(t->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+          conn_free(c);
+          continue;
+        }
+        conn_process(c);
+      }
+      conn_settle(c);
+    }
+  }
+  return NULL;
+}
+
+static void *worker_loop(void *args) {
+  reactor_conn *c;
+  io_thread *t;
+  uint64_t one = 1;
+  struct timespec deadline;
+
+  while (1) {
+    pthread_mutex_lock(&work_lock);
+    idle_workers++;
+    while (work_head == NULL) {
+      if (workers <= REACTOR_WORKERS) {
+        pthread_cond_wait(&work_cond, &work_lock);
+        continue;
+      }
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += REACTOR_WORKER_IDLE;
+      if (pthread_cond_timedwait(&work_cond, &work_lock, &deadline) == ETIMEDOUT &&
+          work_head == NULL && workers > REACTOR_WORKERS) {
+        idle_workers--;
+        workers--;
+        pthread_mutex_unlock(&work_lock);
+        return NULL;
+      }
+    }
+    idle_workers--;
+    work_count--;
+    c = work_head;
+    work_head = c->next;
+    if (work_head == NULL) {
+      work_tail = NULL;
+    }
+    pthread_mutex_unlock(&work_lock);
+
+    handle(c, &c->job_hdr, c->job_payload);
+    free(c->job_payload);
+    c->job_payload = NULL;
+
+    t = c->owner;
+    pthread_mutex_lock(&t->lock);
+    c->next = t->done;
+    t->done = c;
+    pthread_mutex_unlock(&t->lock);
+    if (write(t->wakefd, &one, sizeof(one)) < 0) {
+      perror("Wake error:");
+    }
+  }
+  return NULL;
+}
+
+/*
+ * reactor_run - Serve framed requests on listenfd forever with one I/O
+ * thread per core and REACTOR_WORKERS threads for blocking handlers.
+ */
+void reactor_run(int listenfd, reactor_handler *handler, reactor_blocking *may_block) {
+  struct epoll_event ev;
+  struct rlimit rl;
+  io_thread *threads;
+  int nthreads, i;
+
+  handle = handler;
+  blocking = may_block;
+  listen_fd = listenfd;
+  set_nonblocking(listenfd);
+
+  /* One descriptor per client; allow as many as the hard limit permits */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  pthread_mutex_lock(&work_lock);
+  for (i = 0; i < REACTOR_WORKERS; i++) {
+    add_worker();
+  }
+  pthread_mutex_unlock(&work_lock);
+
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  threads = calloc(nthreads, sizeof(io_thread));
+  for (i = 0; i < nthreads; i++) {
+    threads[i].epfd = epoll_create1(0);
+    threads[i].wakefd = eventfd(0, EFD_NONBLOCK);
+    pthread_mutex_init(&threads[i].lock, NULL);
+
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &listen_tag;
+    epoll_ctl(threads[i].epfd, EPOLL_CTL_ADD, listenfd, &ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &threads[i];
+    epoll_ctl(threads[i].epfd, EPOLL_CTL_ADD, threads[i].wakefd, &ev);
+  }
+  for (i = 1; i < nthreads; i++) {
+    Pthread_create(&threads[i].tid, NULL, io_loop, &threads[i]);
+  }
+  io_loop(&threads[0]);
+}
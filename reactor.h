@@ -0,0 +1,37 @@
+/*
+ * reactor.h - epoll event loop serving framed requests
+ *
+ */
+
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include <stdbool.h>
+#include "wire.h"
+
+#define   REACTOR_WORKERS      16        // Threads kept for handlers that may block
+#define   REACTOR_MAX_WORKERS  1024      // More are started while all are busy, up to this many
+#define   REACTOR_WORKER_IDLE  10        // In seconds an extra worker waits for work before it exits
+#define   REACTOR_MAX_FRAME    (1 << 24) // Largest request payload accepted
+
+typedef struct reactor_conn reactor_conn;
+
+/* Handles one request; the payload is NUL terminated and only valid during the call */
+typedef void reactor_handler(reactor_conn *c, frame_header *hdr, char *payload);
+
+/* Returns true if the handler for opcode may wait on a remote node */
+typedef bool reactor_blocking(int opcode);
+
+void reactor_run(int listenfd, reactor_handler *handler, reactor_blocking *may_block);
+void conn_reply(reactor_conn *c, int opcode, int flags, void *payload, size_t len);
+
+/* Queues a reply frame whose payload is the iovcnt parts at iov, back to back */
+void conn_replyv(reactor_conn *c, int opcode, int flags, struct iovec *iov, int iovcnt);
+
+/* Sends a frame right away; only for handlers on a worker, for replies sent in pieces */
+int conn_stream(reactor_conn *c, int opcode, int flags, void *payload, size_t len);
+
+/* Bytes of reply frames ever queued on c */
+unsigned long long conn_queued(reactor_conn *c);
+
+#endif /* __REACTOR_H__ */
@@ -0,0 +1,482 @@
+/*
+ * replica.c - copies of a node's keys on its successors
+ *
+ * The owner of a key sends every put and delete to its first k
+ * successors. Each of them has a link: a queue of encoded updates, a
+ * connection of its own, a sender thread and an ack reader thread. The
+ * sender takes whatever has queued up, up to REPLICA_BATCH bytes, as one
+ * replicate frame, and keeps up to REPLICA_WINDOW frames in flight; the
+ * replica applies frames in order and answers each, so the reader can
+ * advance the link's acked sequence number one frame at a time. A write
+ * queues its update on every link and then waits, according to the ack
+ * policy, until enough links have acked past it; writes to one key are
+ * queued under a striped lock held since the owner changed its store, so
+ * every replica applies them in the owner's order. A link that fails is
+ * closed at the next retarget and replaced by a fresh one, which gets a
+ * full copy of our keys first.
+ */
+
+#include <sys/socket.h>
+#include <time.h>
+#include "pool.h"
+#include "ring.h"
+#include "replica.h"
+#include "stats.h"
+
+typedef struct update
+{
+  struct update *next;
+  uint64_t seq;
+  size_t len;
+  char data[];
+} update;
+
+typedef struct replica_link
+{
+  Node node;
+  pool_conn *conn;
+  update *head, *tail;            /* queued, not yet sent */
+  uint64_t next_seq;              /* given to the next update queued */
+  uint64_t acked;                 /* updates up to here are applied */
+  uint64_t inflight[REPLICA_WINDOW]; /* last update of each frame sent */
+  uint64_t sent_at[REPLICA_WINDOW];  /* and when, for its stats */
+  size_t sent_len[REPLICA_WINDOW];
+  int inflight_head, inflight_count;
+  bool broken, closing;
+  int refs;                       /* writes waiting on this link */
+  pthread_t sender, reader;
+  struct replica_link *next;
+} replica_link;
+
+static replica_link *links;
+static pthread_mutex_t links_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t links_cond = PTHREAD_COND_INITIALIZER;
+
+static int factor = REPLICA_FACTOR;
+static int policy = ACK_OWNER;
+
+static pthread_mutex_t key_locks[REPLICA_LOCKS];
+static pthread_once_t key_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_key_locks(void) {
+  int i;
+
+  for (i = 0; i < REPLICA_LOCKS; i++) {
+    pthread_mutex_init(&key_locks[i], NULL);
+  }
+}
+
+void replica_lock(uint32_t id) {
+  pthread_once(&key_locks_once, init_key_locks);
+  pthread_mutex_lock(&key_locks[id % REPLICA_LOCKS]);
+}
+
+void replica_unlock(uint32_t id) {
+  pthread_mutex_unlock(&key_locks[id % REPLICA_LOCKS]);
+}
+
+void replica_configure(int k, int ack_policy) {
+  factor = k;
+  policy = ack_policy;
+}
+
+int replica_factor(void) {
+  return factor;
+}
+
+/* ACK_* for "owner", "quorum" or "all", or -1 */
+int ack_policy_of(char *name) {
+  if (strcmp(name, "owner") == 0) {
+    return ACK_OWNER;
+  }
+  if (strcmp(name, "quorum") == 0) {
+    return ACK_QUORUM;
+  }
+  if (strcmp(name, "all") == 0) {
+    return ACK_ALL;
+  }
+  return -1;
+}
+
+static size_t encode_update(char *buf, int kind, uint32_t id, char *key, size_t klen, char *value, size_t vlen) {
+  size_t len = wire_put_u32(buf, kind, wire_text);
+  len += wire_put_u32(buf + len, id, wire_text);
+  len += wire_put_bytes(buf + len, key, klen, wire_text);
+  len += wire_put_bytes(buf + len, value, vlen, wire_text);
+  return len;
+}
+
+static size_t update_size(size_t klen, size_t vlen) {
+  return 4 * WIRE_U32_MAX + klen + vlen + 2;
+}
+
+/* Queue an encoded update on l; links_mutex held. Returns its sequence number */
+static uint64_t enqueue(replica_link *l, char *data, size_t len) {
+  update *u = Malloc(sizeof(update) + len);
+
+  u->next = NULL;
+  u->seq = ++l->next_seq;
+  u->len = len;
+  memcpy(u->data, data, len);
+  if (l->tail == NULL) {
+    l->head = u;
+  } else {
+    l->tail->next = u;
+  }
+  l->tail = u;
+  pthread_cond_broadcast(&links_cond);
+  return u->seq;
+}
+
+/* Mark l failed and wake its threads; links_mutex held */
+static void fail_link(replica_link *l) {
+  if (!l->broken) {
+    l->broken = true;
+    shutdown(l->conn->fd, SHUT_RDWR);
+    pthread_cond_broadcast(&links_cond);
+  }
+}
+
+/* Send queued updates in batches while fewer than REPLICA_WINDOW frames are unacked */
+static void *send_updates(void *arg) {
+  replica_link *l = arg;
+  int flags = wire_text ? FRAME_TEXT : 0;
+  char *batch = Malloc(REPLICA_BATCH);
+  size_t cap = REPLICA_BATCH;
+
+  pthread_mutex_lock(&links_mutex);
+  while (!l->broken && !l->closing) {
+    if (l->head == NULL || l->inflight_count == REPLICA_WINDOW) {
+      pthread_cond_wait(&links_cond, &links_mutex);
+      continue;
+    }
+    size_t len = 0;
+    uint64_t last = 0;
+    while (l->head != NULL && (len == 0 || len + l->head->len <= REPLICA_BATCH)) {
+      update *u = l->head;
+      if (len + u->len > cap) {
+        cap = len + u->len;
+        batch = Realloc(batch, cap);
+      }
+      memcpy(batch + len, u->data, u->len);
+      len += u->len;
+      last = u->seq;
+      if ((l->head = u->next) == NULL) {
+        l->tail = NULL;
+      }
+      Free(u);
+    }
+    int slot = (l->inflight_head + l->inflight_count) % REPLICA_WINDOW;
+    l->inflight[slot] = last;
+    l->sent_at[slot] = stats_now();
+    l->sent_len[slot] = FRAME_HEADER_SIZE + len;
+    l->inflight_count++;
+
+    pthread_mutex_unlock(&links_mutex);
+    ssize_t rc = rio_writeframe(l->conn->fd, OP_REPLICATE, flags, batch, len);
+    pthread_mutex_lock(&links_mutex);
+    if (rc < 0) {
+      stats_record(STATS_CLIENT, OP_REPLICATE, stats_now() - l->sent_at[slot], 0, l->sent_len[slot], true);
+      fail_link(l);
+    }
+  }
+  pthread_mutex_unlock(&links_mutex);
+  Free(batch);
+  return NULL;
+}
+
+/* Each reply acks the oldest frame in flight */
+static void *read_acks(void *arg) {
+  replica_link *l = arg;
+  char response[MAXLINE];
+  frame_header hdr;
+
+  while (rio_readframeb(&l->conn->rio, &hdr, response, MAXLINE) == 1) {
+    pthread_mutex_lock(&links_mutex);
+    if (l->inflight_count > 0) {
+      stats_record(STATS_CLIENT, OP_REPLICATE, stats_now() - l->sent_at[l->inflight_head],
+                   FRAME_HEADER_SIZE + hdr.length, l->sent_len[l->inflight_head], false);
+      l->acked = l->inflight[l->inflight_head];
+      l->inflight_head = (l->inflight_head + 1) % REPLICA_WINDOW;
+      l->inflight_count--;
+      pthread_cond_broadcast(&links_cond);
+    }
+    pthread_mutex_unlock(&links_mutex);
+  }
+  pthread_mutex_lock(&links_mutex);
+  fail_link(l);
+  pthread_mutex_unlock(&links_mutex);
+  return NULL;
+}
+
+static replica_link *open_link(Node n) {
+  replica_link *l;
+  pool_conn *conn;
+
+  if ((conn = pool_acquire(n.ip_address, n.port)) == NULL) {
+    return NULL;
+  }
+  /* Acks are waited for with REPLICA_TIMEOUT; an idle link must not time out */
+  pool_set_timeout(conn, 0);
+  l = Calloc(1, sizeof(replica_link));
+  l->node = n;
+  l->conn = conn;
+  if (pthread_create(&l->sender, NULL, send_updates, l) != 0) {
+    pool_discard(conn);
+    Free(l);
+    return NULL;
+  }
+  pthread_create(&l->reader, NULL, read_acks, l);
+  return l;
+}
+
+/* Stop l's threads and free it; l is already off the list, links_mutex held */
+static void close_link(replica_link *l) {
+  update *u, *next;
+
+  l->closing = true;
+  fail_link(l);
+  while (l->refs > 0) {
+    pthread_cond_wait(&links_cond, &links_mutex);
+  }
+  pthread_mutex_unlock(&links_mutex);
+  pthread_join(l->sender, NULL);
+  pthread_join(l->reader, NULL);
+  pthread_mutex_lock(&links_mutex);
+
+  for (u = l->head; u != NULL; u = next) {
+    next = u->next;
+    Free(u);
+  }
+  pool_discard(l->conn);
+  Free(l);
+}
+
+static bool same_node(Node a, Node b) {
+  return a.port == b.port && strcmp(a.ip_address, b.ip_address) == 0;
+}
+
+/* The live link to n, or NULL; links_mutex held */
+static replica_link *find_link(Node n) {
+  replica_link *l;
+
+  for (l = links; l != NULL; l = l->next) {
+    if (same_node(l->node, n) && !l->broken) {
+      return l;
+    }
+  }
+  return NULL;
+}
+
+int replica_retarget(Node targets[], int count, Node fresh[]) {
+  replica_link *opened[SUCCESSOR_LIST_MAX] = { NULL }, *l, **prev, *kept = NULL, **tail = &kept, *old;
+  bool missing[SUCCESSOR_LIST_MAX];
+  int i, fresh_count = 0;
+
+  if (count > factor) {
+    count = factor;
+  }
+
+  /* Connect outside the lock, so writes do not wait on a slow peer */
+  pthread_mutex_lock(&links_mutex);
+  for (i = 0; i < count; i++) {
+    missing[i] = find_link(targets[i]) == NULL;
+  }
+  pthread_mutex_unlock(&links_mutex);
+  for (i = 0; i < count; i++) {
+    if (missing[i]) {
+      opened[i] = open_link(targets[i]);
+    }
+  }
+
+  pthread_mutex_lock(&links_mutex);
+  for (i = 0; i < count; i++) {
+    if ((l = opened[i]) != NULL) {
+      fresh[fresh_count++] = targets[i];
+    } else if ((l = find_link(targets[i])) != NULL) {
+      for (prev = &links; *prev != l; prev = &(*prev)->next);
+      *prev = l->next;
+    } else {
+      continue;
+    }
+    l->next = NULL;
+    *tail = l;
+    tail = &l->next;
+  }
+  /* close_link lets go of the lock, so writes must find the kept links by then */
+  old = links;
+  links = kept;
+  while ((l = old) != NULL) {
+    old = l->next;
+    close_link(l);
+  }
+  pthread_mutex_unlock(&links_mutex);
+  return fresh_count;
+}
+
+typedef struct sync_target
+{
+  Node *node;
+  char *buf;
+  size_t cap;
+} sync_target;
+
+/* Queue one key as a copy for the sync target; a store_visit run under the store's lock */
+static void queue_copy(uint32_t id, char *key, size_t klen, char *value, size_t vlen, void *arg) {
+  sync_target *t = arg;
+  replica_link *l;
+  size_t len;
+
+  if (update_size(klen, vlen) > t->cap) {
+    t->cap = update_size(klen, vlen);
+    t->buf = Realloc(t->buf, t->cap);
+  }
+  len = encode_update(t->buf, REPLICA_COPY, id, key, klen, value, vlen);
+  for (l = links; l != NULL; l = l->next) {
+    if (t->node == NULL || same_node(l->node, *t->node)) {
+      enqueue(l, t->buf, len);
+    }
+  }
+}
+
+/*
+ * replica_sync - The copies are queued while the store is read locked,
+ * so a write that races with the sync is queued after the value it
+ * replaces, never before.
+ */
+void replica_sync(Node *n, store *s, uint32_t a, uint32_t b) {
+  sync_target t = { n, Malloc(MAXLINE), MAXLINE };
+  char drop[5 * WIRE_U32_MAX + 2];
+  size_t len = encode_update(drop, REPLICA_DROP, a, "", 0, "", 0);
+  replica_link *l;
+
+  len += wire_put_u32(drop + len, b, wire_text);
+  pthread_mutex_lock(&links_mutex);
+  for (l = links; l != NULL; l = l->next) {
+    if (n == NULL || same_node(l->node, *n)) {
+      enqueue(l, drop, len);
+    }
+  }
+  store_foreach_range(s, a, b, queue_copy, &t);
+  pthread_mutex_unlock(&links_mutex);
+  Free(t.buf);
+}
+
+void replica_queue(replica_ticket *t, int kind, uint32_t id, char *key, size_t klen, char *value, size_t vlen) {
+  char *buf = Malloc(update_size(klen, vlen));
+  size_t len = encode_update(buf, kind, id, key, klen, value, vlen);
+  replica_link *l;
+
+  t->count = 0;
+  pthread_mutex_lock(&links_mutex);
+  for (l = links; l != NULL && t->count < SUCCESSOR_LIST_MAX; l = l->next) {
+    if (!l->broken) {
+      t->seqs[t->count] = enqueue(l, buf, len);
+      t->links[t->count++] = l;
+      l->refs++;
+    }
+  }
+  pthread_mutex_unlock(&links_mutex);
+  Free(buf);
+}
+
+int replica_wait(replica_ticket *t) {
+  struct timespec deadline = { time(NULL) + REPLICA_TIMEOUT, 0 };
+  int acks = 0, failed, need, i;
+
+  pthread_mutex_lock(&links_mutex);
+  /* Copies besides the owner's; a ring with fewer than k other nodes holds fewer */
+  need = policy == ACK_ALL ? factor : policy == ACK_QUORUM ? (factor + 1) / 2 : 0;
+  if (need > t->count) {
+    need = t->count;
+  }
+  for (;;) {
+    acks = failed = 0;
+    for (i = 0; i < t->count; i++) {
+      if (t->links[i]->acked >= t->seqs[i]) {
+        acks++;
+      } else if (t->links[i]->broken) {
+        failed++;
+      }
+    }
+    if (acks >= need || t->count - failed < need ||
+        pthread_cond_timedwait(&links_cond, &links_mutex, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  for (i = 0; i < t->count; i++) {
+    t->links[i]->refs--;
+  }
+  pthread_cond_broadcast(&links_cond);
+  pthread_mutex_unlock(&links_mutex);
+  return acks >= need ? 0 : -1;
+}
+
+typedef struct stale_keys
+{
+  char *buf;
+  size_t len, cap;
+} stale_keys;
+
+/* Note a key to drop as its id, length and bytes; a store_visit run under the store's lock */
+static void note_stale(uint32_t id, char *key, size_t klen, char *value, size_t vlen, void *arg) {
+  stale_keys *k = arg;
+
+  while (k->len + sizeof(uint32_t) + sizeof(size_t) + klen > k->cap) {
+    k->cap *= 2;
+    k->buf = Realloc(k->buf, k->cap);
+  }
+  memcpy(k->buf + k->len, &id, sizeof(uint32_t));
+  memcpy(k->buf + k->len + sizeof(uint32_t), &klen, sizeof(size_t));
+  memcpy(k->buf + k->len + sizeof(uint32_t) + sizeof(size_t), key, klen);
+  k->len += sizeof(uint32_t) + sizeof(size_t) + klen;
+}
+
+/* Delete every key of s in [a, b]; they are gathered first, as deleting needs the write lock */
+static void drop_range(store *s, uint32_t a, uint32_t b) {
+  stale_keys k = { Malloc(MAXLINE), 0, MAXLINE };
+  size_t pos, klen;
+  uint32_t id;
+
+  store_foreach_range(s, a, b, note_stale, &k);
+  for (pos = 0; pos < k.len; pos += sizeof(uint32_t) + sizeof(size_t) + klen) {
+    memcpy(&id, k.buf + pos, sizeof(uint32_t));
+    memcpy(&klen, k.buf + pos + sizeof(uint32_t), sizeof(size_t));
+    store_delete(s, id, k.buf + pos + sizeof(uint32_t) + sizeof(size_t), klen);
+  }
+  Free(k.buf);
+}
+
+int replica_apply(store *s, wire_reader *r) {
+  uint32_t kind, id, end;
+  char *key, *value;
+  size_t klen, vlen;
+  int count = 0;
+
+  while (r->pos < r->end) {
+    if (wire_get_u32(r, &kind) < 0 || wire_get_u32(r, &id) < 0 ||
+        wire_get_bytes(r, &key, &klen) < 0 || wire_get_bytes(r, &value, &vlen) < 0) {
+      return -1;
+    }
+    switch (kind) {
+    case REPLICA_PUT:
+      store_put(s, id, key, klen, value, vlen);
+      break;
+    case REPLICA_DELETE:
+      store_delete(s, id, key, klen);
+      break;
+    case REPLICA_COPY:
+      /* Updates queued after the copy come after it, so it may overwrite */
+      store_put(s, id, key, klen, value, vlen);
+      break;
+    case REPLICA_DROP:
+      if (wire_get_u32(r, &end) < 0) {
+        return -1;
+      }
+      drop_range(s, id, end);
+      break;
+    }
+    count++;
+  }
+  return count;
+}
@@ -0,0 +1,73 @@
+/*
+ * replica.h - copies of a node's keys on its successors
+ *
+ */
+
+#ifndef __REPLICA_H__
+#define __REPLICA_H__
+
+#include "wire.h"
+#include "ring.h"
+#include "store.h"
+
+#define   REPLICA_FACTOR   3           // Default k, successors holding a copy of each key
+#define   REPLICA_BATCH    (64 * 1024) // Bytes of updates per replicate frame
+#define   REPLICA_WINDOW   8           // Replicate frames in flight per successor
+#define   REPLICA_TIMEOUT  5           // In seconds a write waits for its acks
+#define   REPLICA_LOCKS    256         // Stripes of the locks that order writes to a key
+
+/* Ack policies: copies a write waits for before it is confirmed */
+#define   ACK_OWNER   0 // Just the owner's
+#define   ACK_QUORUM  1 // A majority of the owner and its k replicas
+#define   ACK_ALL     2 // Every replica's
+
+/* Updates carried in a replicate frame */
+#define   REPLICA_PUT     0
+#define   REPLICA_DELETE  1
+#define   REPLICA_COPY    2 // Put, part of a full copy
+#define   REPLICA_DROP    3 // Delete every key in [id, end], ahead of a full copy of the range; end follows the value
+
+void replica_configure(int factor, int policy);
+int replica_factor(void);
+int ack_policy_of(char *name);
+
+/*
+ * Makes targets the successors that receive our updates, closing links
+ * to nodes no longer among them or that failed. Copies the nodes linked
+ * anew into fresh and returns their number; they need a full copy.
+ */
+int replica_retarget(Node targets[], int count, Node fresh[]);
+
+/*
+ * Queues a copy of our keys in [a, b] (is_between) for n, or every target
+ * if n is NULL, after telling it to drop what it holds there, so keys
+ * deleted while it was not linked go too.
+ */
+void replica_sync(Node *n, store *s, uint32_t a, uint32_t b);
+
+/* A write's place on each link it was queued on, to wait for its acks */
+typedef struct replica_ticket
+{
+  struct replica_link *links[SUCCESSOR_LIST_MAX];
+  uint64_t seqs[SUCCESSOR_LIST_MAX];
+  int count;
+} replica_ticket;
+
+/*
+ * Lock id's stripe for a write. Hold it across the change to the store
+ * and replica_queue, so the replicas get a key's updates in the order
+ * the owner made them; wait for the acks after unlocking.
+ */
+void replica_lock(uint32_t id);
+void replica_unlock(uint32_t id);
+
+/* Queues a put or delete for every target, with id's stripe locked */
+void replica_queue(replica_ticket *t, int update, uint32_t id, char *key, size_t klen, char *value, size_t vlen);
+
+/* Waits for t's acks as the ack policy says; 0 or -1 */
+int replica_wait(replica_ticket *t);
+
+/* Applies the updates of one replicate frame to s; returns their number or -1 */
+int replica_apply(store *s, wire_reader *r);
+
+#endif /* __REPLICA_H__ */
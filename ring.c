@@ -0,0 +1,147 @@
+/*
+ * ring.c - routing state published as immutable snapshots
+ *
+ * The current ring_state is reached through one atomic pointer. Readers
+ * announce the global epoch they started in and load the pointer; they
+ * never take a lock. A writer copies the current state under the writer
+ * mutex, edits the copy and swaps it in, then bumps the epoch and retires
+ * the old copy. A retired copy is freed once every reader still inside a
+ * read section started in a later epoch, since such readers can only have
+ * loaded a newer pointer. A thread's reader record is unlinked and freed
+ * when the thread exits, so threads that come and go do not leave records
+ * behind for every reclaim to scan.
+ */
+
+#include <limits.h>
+#include <stdatomic.h>
+#include "ring.h"
+
+typedef struct snapshot
+{
+  ring_state state;       /* first, so a ring_state * is a snapshot * */
+  unsigned long epoch;    /* epoch in which it was replaced */
+  struct snapshot *next;
+} snapshot;
+
+typedef struct reader
+{
+  atomic_ulong epoch;     /* epoch of the open read section, 0 if none */
+  int depth;
+  struct reader *next;
+} reader;
+
+static _Atomic(snapshot *) current;
+static atomic_ulong global_epoch = 1;
+
+static reader *readers;
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread reader *self_reader;
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static snapshot *retired;
+
+void ring_init(Node self) {
+  snapshot *s = calloc(1, sizeof(snapshot));
+  int i;
+
+  s->state.predecessor = self;
+  s->state.successor = self;
+  for (i = 0; i < KEY_SIZE; i++) {
+    s->state.finger_table[i] = self;
+  }
+  atomic_store(&current, s);
+}
+
+/* Thread exit: the thread is outside any read section, so its record can go */
+static void reader_exit(void *arg) {
+  reader *r = arg, **prev;
+
+  pthread_mutex_lock(&readers_lock);
+  for (prev = &readers; *prev != r; prev = &(*prev)->next);
+  *prev = r->next;
+  pthread_mutex_unlock(&readers_lock);
+  free(r);
+}
+
+static void make_reader_key(void) {
+  pthread_key_create(&reader_key, reader_exit);
+}
+
+static reader *register_reader(void) {
+  reader *r = calloc(1, sizeof(reader));
+
+  pthread_once(&reader_key_once, make_reader_key);
+  pthread_setspecific(reader_key, r);
+  pthread_mutex_lock(&readers_lock);
+  r->next = readers;
+  readers = r;
+  pthread_mutex_unlock(&readers_lock);
+  return r;
+}
+
+const ring_state *ring_read_lock(void) {
+  if (self_reader == NULL) {
+    self_reader = register_reader();
+  }
+  if (self_reader->depth++ == 0) {
+    atomic_store(&self_reader->epoch, atomic_load(&global_epoch));
+  }
+  return &atomic_load(&current)->state;
+}
+
+void ring_read_unlock(void) {
+  if (--self_reader->depth == 0) {
+    atomic_store(&self_reader->epoch, 0);
+  }
+}
+
+/* Free retired snapshots no open read section can still see */
+static void reclaim(void) {
+  unsigned long oldest = ULONG_MAX, e;
+  snapshot *s, **prev;
+  reader *r;
+
+  pthread_mutex_lock(&readers_lock);
+  for (r = readers; r != NULL; r = r->next) {
+    e = atomic_load(&r->epoch);
+    if (e != 0 && e < oldest) {
+      oldest = e;
+    }
+  }
+  pthread_mutex_unlock(&readers_lock);
+
+  prev = &retired;
+  while ((s = *prev) != NULL) {
+    if (s->epoch < oldest) {
+      *prev = s->next;
+      free(s);
+    } else {
+      prev = &s->next;
+    }
+  }
+}
+
+ring_state *ring_write_begin(void) {
+  snapshot *s = malloc(sizeof(snapshot));
+
+  pthread_mutex_lock(&writer_lock);
+  s->state = atomic_load(&current)->state;
+  return &s->state;
+}
+
+void ring_write_commit(ring_state *state) {
+  snapshot *old = atomic_exchange(&current, (snapshot *) state);
+
+  old->epoch = atomic_fetch_add(&global_epoch, 1);
+  old->next = retired;
+  retired = old;
+  reclaim();
+  pthread_mutex_unlock(&writer_lock);
+}
+
+void ring_write_abort(ring_state *state) {
+  pthread_mutex_unlock(&writer_lock);
+  free(state);
+}
@@ -0,0 +1,34 @@
+/*
+ * ring.h - routing state published as immutable snapshots
+ *
+ */
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#include "wire.h"
+
+#define   KEY_SIZE      32
+#define   SUCCESSOR_LIST_MAX 32 // Upper bound for the configurable list length
+
+typedef struct ring_state
+{
+  Node predecessor;
+  Node successor;
+  Node successor_list[SUCCESSOR_LIST_MAX]; // Nodes following us, successor first; never self
+  int successor_count;
+  Node finger_table[KEY_SIZE];
+} ring_state;
+
+void ring_init(Node self);
+
+/* Readers: never block, may nest, must not keep the pointer after unlock */
+const ring_state *ring_read_lock(void);
+void ring_read_unlock(void);
+
+/* Writers: edit a private copy, then publish it; never hold across network I/O */
+ring_state *ring_write_begin(void);
+void ring_write_commit(ring_state *state);
+void ring_write_abort(ring_state *state);
+
+#endif /* __RING_H__ */
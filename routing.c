@@ -0,0 +1,460 @@
+/*
+ * routing.c - Chord routing and ring maintenance over an explicit node
+ *
+ * The protocol half of a Chord node: finding the node before a key and
+ * keeping successors, the predecessor and fingers right as nodes come
+ * and go. Everything is relative to a routing_node, and its state and
+ * messages go through its ops, so the same code runs a real node over
+ * the network (chord.c) and many nodes in one process (sim.c). Ops are
+ * only ever called for other nodes; requests to ourselves are answered
+ * here.
+ */
+
+#include "csapp.h"
+#include "routing.h"
+
+static void replace_dead_successor(routing_node *r, Node dead);
+static Node rejoin(routing_node *r, Node gone[], int dead_count);
+static void adopt_successor_list(routing_node *r, Node successor, Node list[], int count);
+
+void routing_init(routing_node *r, Node self, int successor_list_length, routing_ops *ops, void *arg) {
+  memset(r, 0, sizeof(routing_node));
+  r->self = self;
+  r->successor_list_length = successor_list_length;
+  r->next_finger = 1;
+  r->ops = ops;
+  r->arg = arg;
+}
+
+/* inclusive! */
+bool is_between(uint32_t key, uint32_t a, uint32_t b) {
+  if (key == a || key == b || a == b) {
+    return true;
+  }
+  if (a < key) {
+    if (b < a) { // wrap around
+      return true;
+    } else {
+      if (key < b) {
+        return true;
+      }
+    }
+  } else {
+    if (key < b && b < a) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool is_equal(Node a, Node b) {
+  if (strcmp(a.ip_address, b.ip_address) == 0 && a.port == b.port) {
+    return true;
+  }
+  return false;
+}
+
+static bool is_listed(Node n, Node list[], int count) {
+  int i;
+  for (i = 0; i < count; i++) {
+    if (is_equal(n, list[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void changed(routing_node *r, Node n) {
+  if (r->ops->changed != NULL) {
+    r->ops->changed(r, n);
+  }
+}
+
+Node routing_successor(routing_node *r) {
+  const ring_state *ring = r->ops->read_lock(r);
+  Node successor = ring->successor;
+  r->ops->read_unlock(r);
+  return successor;
+}
+
+Node routing_predecessor(routing_node *r) {
+  const ring_state *ring = r->ops->read_lock(r);
+  Node predecessor = ring->predecessor;
+  r->ops->read_unlock(r);
+  return predecessor;
+}
+
+/* Successor of n, from our successor list if it is there, else from the ops */
+static Node successor_of(routing_node *r, Node n) {
+  if (is_equal(n, r->self)) {
+    return routing_successor(r);
+  }
+  const ring_state *ring = r->ops->read_lock(r);
+  int i;
+  for (i = 0; i + 1 < ring->successor_count; i++) {
+    if (is_equal(ring->successor_list[i], n)) {
+      Node next = ring->successor_list[i + 1];
+      r->ops->read_unlock(r);
+      return next;
+    }
+  }
+  r->ops->read_unlock(r);
+
+  if (r->ops->successor_of != NULL) {
+    return r->ops->successor_of(r, n);
+  }
+  return r->ops->fetch_successor(r, n);
+}
+
+Node routing_closest_preceding_finger(routing_node *r, uint32_t key) {
+  const ring_state *ring = r->ops->read_lock(r);
+  Node self = r->self, cpf = self;
+  int i;
+  for (i = KEY_SIZE - 1; i >= 0; i--) {
+    if (is_between(ring->finger_table[i].key, self.key + 1, key - 1)) {
+      cpf = ring->finger_table[i];
+      break;
+    }
+  }
+  /* A successor list entry may sit closer to key than any finger */
+  for (i = 0; i < ring->successor_count; i++) {
+    Node s = ring->successor_list[i];
+    if (is_between(s.key, self.key + 1, key - 1) &&
+        (is_equal(cpf, self) || is_between(s.key, cpf.key + 1, key - 1))) {
+      cpf = s;
+    }
+  }
+  r->ops->read_unlock(r);
+  return cpf;
+}
+
+Node routing_closest_preceding_hop(routing_node *r, uint32_t key, Node *successor) {
+  Node cpf = routing_closest_preceding_finger(r, key);
+
+  while (1) {
+    *successor = successor_of(r, cpf);
+    if (successor->port != 0 || is_equal(cpf, r->self)) {
+      return cpf;
+    }
+    cpf = routing_closest_preceding_finger(r, cpf.key);
+  }
+}
+
+Node routing_find_predecessor(routing_node *r, uint32_t key, int *hops) {
+  Node suc = routing_successor(r);
+  if (r->self.key == suc.key) {
+    return r->self;
+  }
+  Node n = r->self;
+
+  while (!is_between(key, n.key + 1, suc.key) && key != suc.key) {
+    /* One round trip per hop: the finger comes back with its successor */
+    Node n_prime = is_equal(n, r->self) ? routing_closest_preceding_hop(r, key, &suc)
+                                        : r->ops->query_hop(r, n, key, &suc);
+    if (hops != NULL) {
+      (*hops)++;
+    }
+    if (is_equal(n, n_prime) || n_prime.port == 0) {
+      break; /* no closer node answers; settle for what we have */
+    }
+    n = n_prime;
+  }
+  return n;
+}
+
+/* Ask our way to key's predecessor, then ask it for its successor */
+Node routing_find_successor(routing_node *r, uint32_t key, uint32_t *start, int *hops) {
+  Node n = routing_find_predecessor(r, key, hops);
+
+  *start = n.key;
+  if (is_equal(n, r->self)) {
+    return routing_successor(r);
+  }
+  if (hops != NULL) {
+    (*hops)++;
+  }
+  return r->ops->fetch_successor(r, n);
+}
+
+void routing_set_successor(routing_node *r, ring_state *ring, Node successor, Node tail[], int tail_count) {
+  Node list[SUCCESSOR_LIST_MAX], self = r->self;
+  int count = 0, i;
+
+  if (!is_equal(successor, self)) {
+    list[count++] = successor;
+  }
+  for (i = 0; i < tail_count && count < r->successor_list_length; i++) {
+    if (is_equal(tail[i], successor) || is_equal(tail[i], self) ||
+        !is_between(tail[i].key, successor.key + 1, self.key - 1)) {
+      continue;
+    }
+    list[count++] = tail[i];
+  }
+  ring->successor = successor;
+  ring->finger_table[0] = successor;
+  memcpy(ring->successor_list, list, count * sizeof(Node));
+  ring->successor_count = count;
+}
+
+void routing_update_successor(routing_node *r, Node successor) {
+  ring_state *ring = r->ops->write_begin(r);
+  routing_set_successor(r, ring, successor, ring->successor_list, ring->successor_count);
+  r->ops->write_commit(r, ring);
+}
+
+void routing_update_predecessor(routing_node *r, Node predecessor) {
+  ring_state *ring = r->ops->write_begin(r);
+  ring->predecessor = predecessor;
+  r->ops->write_commit(r, ring);
+}
+
+/* Extend our successor list with the one successor sent back, if still ours */
+static void adopt_successor_list(routing_node *r, Node successor, Node list[], int count) {
+  ring_state *ring = r->ops->write_begin(r);
+  if (!is_equal(ring->successor, successor)) {
+    r->ops->write_abort(r, ring);
+    return;
+  }
+  routing_set_successor(r, ring, successor, list, count);
+  r->ops->write_commit(r, ring);
+}
+
+/*
+ * routing_stabilize - Ask our successor for its predecessor and successor
+ * list. A node that has joined between us becomes our successor; either
+ * way the successor is told about us, so it can adopt us as predecessor.
+ */
+void routing_stabilize(routing_node *r) {
+  Node successor = routing_successor(r), self = r->self;
+  Node x, list[SUCCESSOR_LIST_MAX];
+  int count = 0;
+
+  if (is_equal(successor, self)) {
+    x = routing_predecessor(r);
+    if ((x.port == 0 || is_equal(x, self)) && r->bootstrap.port != 0) {
+      /* Cut off from the ring: look ourselves up again */
+      x = rejoin(r, NULL, 0);
+    }
+  } else if ((count = r->ops->fetch_neighbours(r, successor, &x, list, SUCCESSOR_LIST_MAX)) < 0) {
+    log_info("Successor has left. Updating...");
+    replace_dead_successor(r, successor);
+    return;
+  }
+
+  if (x.port != 0 && !is_equal(x, self) && !is_equal(x, successor) &&
+      (is_equal(successor, self) || is_between(x.key, self.key + 1, successor.key - 1))) {
+    log_node(LEVEL_INFO, "New successor", x);
+    changed(r, x);
+    routing_update_successor(r, x);
+    successor = x;
+  } else {
+    adopt_successor_list(r, successor, list, count);
+  }
+  if (!is_equal(successor, self)) {
+    r->ops->notify(r, successor);
+  }
+}
+
+void routing_notify(routing_node *r, Node n) {
+  Node self = r->self;
+
+  if (is_equal(n, self)) {
+    return;
+  }
+  ring_state *ring = r->ops->write_begin(r);
+  Node p = ring->predecessor;
+  if (is_equal(p, n) || (p.port != 0 && !is_equal(p, self) &&
+                         !is_between(n.key, p.key + 1, self.key - 1))) {
+    r->ops->write_abort(r, ring);
+    return;
+  }
+  ring->predecessor = n;
+  r->ops->write_commit(r, ring);
+  changed(r, n);
+  log_node(LEVEL_INFO, "New predecessor", n);
+}
+
+/*
+ * routing_fix_fingers - Refresh the next finger. Fingers whose start
+ * still falls before the previous finger are copied from it, so each run
+ * costs at most one lookup.
+ */
+void routing_fix_fingers(routing_node *r) {
+  Node self = r->self;
+  int steps;
+
+  if (is_equal(routing_successor(r), self)) {
+    return;
+  }
+  for (steps = 1; steps < KEY_SIZE; steps++) {
+    int i = r->next_finger;
+    uint32_t start = self.key + ((uint32_t) 1 << i);
+    r->next_finger = r->next_finger % (KEY_SIZE - 1) + 1;
+
+    const ring_state *ring = r->ops->read_lock(r);
+    Node previous = ring->finger_table[i - 1];
+    Node current = ring->finger_table[i];
+    r->ops->read_unlock(r);
+
+    Node finger = previous;
+    bool looked_up = false;
+    if (is_equal(previous, self) || !is_between(start, self.key + 1, previous.key)) {
+      uint32_t range_start;
+      if (r->ops->lookup != NULL) {
+        finger = r->ops->lookup(r, start, &range_start);
+      } else {
+        finger = routing_find_successor(r, start, &range_start, NULL);
+      }
+      looked_up = true;
+    }
+    if (finger.port != 0 && !is_equal(finger, current)) {
+      ring_state *update = r->ops->write_begin(r);
+      update->finger_table[i] = finger;
+      r->ops->write_commit(r, update);
+    }
+    if (looked_up) {
+      return;
+    }
+  }
+}
+
+/* Forget a predecessor that no longer answers; notify will bring a new one */
+void routing_check_predecessor(routing_node *r) {
+  Node p = routing_predecessor(r);
+
+  if (p.port == 0 || is_equal(p, r->self) || r->ops->ping(r, p)) {
+    return;
+  }
+  log_info("Predecessor has left.");
+  ring_state *ring = r->ops->write_begin(r);
+  if (!is_equal(ring->predecessor, p)) {
+    r->ops->write_abort(r, ring);
+    return;
+  }
+  memset(&ring->predecessor, 0, sizeof(Node));
+  r->ops->write_commit(r, ring);
+  changed(r, p);
+}
+
+/*
+ * replace_dead_successor - Fall back to the first live node in the
+ * successor list, so up to r-1 adjacent failures are skipped without a
+ * lookup. Fingers pointing at the dead nodes are moved to it until
+ * fix_fingers gets to them. If the whole list is gone, the successor is
+ * looked up again through any other node we know.
+ */
+static void replace_dead_successor(routing_node *r, Node dead) {
+  Node list[SUCCESSOR_LIST_MAX], gone[SUCCESSOR_LIST_MAX + 1];
+  Node self = r->self, next = self;
+  int count, dead_count = 0, i, d;
+
+  const ring_state *ring = r->ops->read_lock(r);
+  count = ring->successor_count;
+  memcpy(list, ring->successor_list, count * sizeof(Node));
+  r->ops->read_unlock(r);
+
+  gone[dead_count++] = dead;
+  for (i = 0; i < count; i++) {
+    if (is_equal(list[i], dead)) {
+      continue;
+    }
+    if (r->ops->ping(r, list[i])) {
+      next = list[i];
+      break;
+    }
+    gone[dead_count++] = list[i];
+  }
+  if (is_equal(next, self)) {
+    next = rejoin(r, gone, dead_count);
+  }
+  for (d = 0; d < dead_count; d++) {
+    changed(r, gone[d]);
+  }
+
+  ring_state *update = r->ops->write_begin(r);
+  if (is_equal(next, self)) {
+    /* Nobody left: set self to predecessor */
+    update->predecessor = self;
+  }
+  routing_set_successor(r, update, next, update->successor_list, update->successor_count);
+  for (i = 1; i < KEY_SIZE; i++) {
+    for (d = 0; d < dead_count; d++) {
+      if (is_equal(update->finger_table[i], gone[d])) {
+        update->finger_table[i] = next;
+      }
+    }
+  }
+  r->ops->write_commit(r, update);
+
+  if (!is_equal(next, self)) {
+    r->ops->notify(r, next);
+  }
+}
+
+/* Look up our successor through the predecessor, a finger or the bootstrap node */
+static Node rejoin(routing_node *r, Node gone[], int dead_count) {
+  Node known[KEY_SIZE + 2], self = r->self;
+  int count = 0, i;
+
+  const ring_state *ring = r->ops->read_lock(r);
+  known[count++] = ring->predecessor;
+  for (i = 0; i < KEY_SIZE; i++) {
+    known[count++] = ring->finger_table[i];
+  }
+  r->ops->read_unlock(r);
+  known[count++] = r->bootstrap;
+
+  for (i = 0; i < count; i++) {
+    if (known[i].port == 0 || is_equal(known[i], self) || is_listed(known[i], gone, dead_count)) {
+      continue;
+    }
+    Node successor = r->ops->query_successor(r, known[i], self.key + 1);
+    if (successor.port != 0 && !is_listed(successor, gone, dead_count)) {
+      return successor;
+    }
+  }
+  return self;
+}
+
+void routing_update_finger_table(routing_node *r, Node s, int i) {
+  if (s.key == r->self.key) {
+    return;
+  }
+  changed(r, s);
+  ring_state *ring = r->ops->write_begin(r);
+  if (!is_between(s.key, r->self.key + 1, ring->finger_table[i].key)) {
+    r->ops->write_abort(r, ring);
+    return;
+  }
+  ring->finger_table[i] = s;
+  if (i == 0) {
+    routing_set_successor(r, ring, s, ring->successor_list, ring->successor_count);
+  }
+  Node p = ring->predecessor;
+  r->ops->write_commit(r, ring);
+
+  log_debug("Finger for index %d is now node %s, port %d, position %u", i, s.ip_address, s.port, s.key);
+  if (p.port != 0 && s.key != p.key && !is_equal(p, r->self)) {
+    r->ops->update_finger_table(r, p, s, i);
+  }
+}
+
+void routing_remove_node(routing_node *r, Node old, int i, Node replace) {
+  changed(r, old);
+
+  ring_state *ring = r->ops->write_begin(r);
+  if (!is_equal(ring->finger_table[i], old)) {
+    r->ops->write_abort(r, ring);
+    return;
+  }
+  ring->finger_table[i] = replace;
+  if (i == 0) {
+    routing_set_successor(r, ring, replace, ring->successor_list, ring->successor_count);
+  }
+  Node p = ring->predecessor;
+  r->ops->write_commit(r, ring);
+
+  if (p.port != 0 && !is_equal(p, r->self)) {
+    r->ops->remove_node(r, p, old, i, replace);
+  }
+}
@@ -0,0 +1,109 @@
+/*
+ * routing.h - Chord routing and ring maintenance over an explicit node
+ *
+ */
+
+#ifndef __ROUTING_H__
+#define __ROUTING_H__
+
+#include <stdbool.h>
+#include "ring.h"
+#include "log.h"
+
+typedef struct routing_node routing_node;
+
+/*
+ * What routing needs from a node besides the protocol itself: access to
+ * its ring state, with the same rules as ring.h, and its messages to
+ * other nodes, never to itself. A message that gets no answer returns a
+ * node with port 0, -1 for fetch_neighbours. successor_of, lookup and
+ * changed may be NULL.
+ */
+typedef struct routing_ops
+{
+  const ring_state *(*read_lock)(routing_node *r);
+  void (*read_unlock)(routing_node *r);
+  ring_state *(*write_begin)(routing_node *r);
+  void (*write_commit)(routing_node *r, ring_state *state);
+  void (*write_abort)(routing_node *r, ring_state *state);
+
+  /* n's closest preceding finger of key, with that finger's successor (query_hop) */
+  Node (*query_hop)(routing_node *r, Node n, uint32_t key, Node *successor);
+  /* key's successor, looked up by n (query_suc) */
+  Node (*query_successor)(routing_node *r, Node n, uint32_t key);
+  /* n's successor (fetch_suc) */
+  Node (*fetch_successor)(routing_node *r, Node n);
+  /* n's predecessor and up to max of its successor list (fetch_pre); the list's length */
+  int (*fetch_neighbours)(routing_node *r, Node n, Node *predecessor, Node list[], int max);
+  /* n's successor, from a cache if there is one; NULL fetches it */
+  Node (*successor_of)(routing_node *r, Node n);
+  /* key's successor and the start of its range, for fix_fingers; NULL uses routing_find_successor */
+  Node (*lookup)(routing_node *r, uint32_t key, uint32_t *start);
+  bool (*ping)(routing_node *r, Node n);
+  void (*notify)(routing_node *r, Node n);
+  void (*update_finger_table)(routing_node *r, Node n, Node s, int i);
+  void (*remove_node)(routing_node *r, Node n, Node old, int i, Node replace);
+  /* Something about n changed, so whatever is cached about it is stale */
+  void (*changed)(routing_node *r, Node n);
+} routing_ops;
+
+struct routing_node
+{
+  Node self;
+  Node bootstrap;             /* node we joined through, port 0 if we created the ring */
+  int successor_list_length;  /* r */
+  int next_finger;            /* finger fix_fingers refreshes next */
+  routing_ops *ops;
+  void *arg;                  /* for the ops */
+};
+
+/* Log n as what, at level */
+#define log_node(level, what, n) \
+  log_at(level, "%s: node %s, port %d, position %u", what, (n).ip_address, (n).port, (n).key)
+
+/* Sets r up as self; its ring state is the ops' to set up, as ring_init does */
+void routing_init(routing_node *r, Node self, int successor_list_length, routing_ops *ops, void *arg);
+
+/* key in [a, b] on the ring, wrapping; inclusive! */
+bool is_between(uint32_t key, uint32_t a, uint32_t b);
+bool is_equal(Node a, Node b);
+
+Node routing_successor(routing_node *r);
+Node routing_predecessor(routing_node *r);
+
+/* The closest node before key in r's fingers and successor list, or r itself */
+Node routing_closest_preceding_finger(routing_node *r, uint32_t key);
+
+/* routing_closest_preceding_finger, plus its successor; fingers that do not answer are skipped */
+Node routing_closest_preceding_hop(routing_node *r, uint32_t key, Node *successor);
+
+/* The node before key, asking one node per hop; hops, unless NULL, counts them */
+Node routing_find_predecessor(routing_node *r, uint32_t key, int *hops);
+
+/* key's successor, which owns (*start, successor], asking our way there; hops as above */
+Node routing_find_successor(routing_node *r, uint32_t key, uint32_t *start, int *hops);
+
+/*
+ * Makes successor r's in ring and rebuilds the successor list from it
+ * and the nodes of tail that still lie between it and r, in order. tail
+ * may be the list being replaced.
+ */
+void routing_set_successor(routing_node *r, ring_state *ring, Node successor, Node tail[], int tail_count);
+void routing_update_successor(routing_node *r, Node successor);
+void routing_update_predecessor(routing_node *r, Node predecessor);
+
+/* Maintenance, run periodically */
+void routing_stabilize(routing_node *r);
+void routing_fix_fingers(routing_node *r);
+void routing_check_predecessor(routing_node *r);
+
+/* n thinks it might be r's predecessor */
+void routing_notify(routing_node *r, Node n);
+
+/* s may be r's finger i; passed on to the predecessor if it was */
+void routing_update_finger_table(routing_node *r, Node s, int i);
+
+/* old, r's finger i, has left for replace; passed on to the predecessor if it was */
+void routing_remove_node(routing_node *r, Node old, int i, Node replace);
+
+#endif /* __ROUTING_H__ */
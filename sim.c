@@ -0,0 +1,563 @@
+/*
+ * sim.c - many Chord nodes in one process, for scaling measurements
+ *
+ * Every node runs routing.c as chord does, but keeps its ring state in a
+ * plain struct and reaches other nodes through a virtual transport: a
+ * message is a call into the target node, counted once, that fails if
+ * the target is gone. Nodes take turns, so a round runs every node's
+ * maintenance once, in the proportions of chord's default periods. There
+ * is no successor cache, so message counts are what chord sends with a
+ * cold one; keys and their handoff are not simulated.
+ *
+ * The ring starts out correct. We measure hops per lookup, then add and
+ * remove nodes one at a time, counting the messages each join or leave
+ * sends and the rounds until successors and predecessors, then fingers,
+ * are right again everywhere; an event that has not settled after
+ * SIM_MAX_ROUNDS is counted as taking that many.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "csapp.h"
+#include "routing.h"
+#include "stats.h"
+#include <string.h>
+#include <unistd.h>
+
+
+#define   SIM_NODES     10000
+#define   SIM_LOOKUPS   100000
+#define   SIM_JOINS     20
+#define   SIM_LEAVES    20
+#define   SIM_PORT      4000
+#define   SIM_MAX_ROUNDS 64 // Rounds an event gets to converge before we give up on it
+#define   SUCCESSOR_LIST_LENGTH 8
+#define   STABILIZE_PERIOD         1000 // In milliseconds, as chord's defaults; one round
+#define   FIX_FINGERS_PERIOD       500
+#define   CHECK_PREDECESSOR_PERIOD 2000
+
+typedef struct sim_node
+{
+  routing_node route;
+  ring_state state;
+  bool alive;
+} sim_node;
+
+/* Rounds and messages until an event's effects were repaired */
+typedef struct convergence
+{
+  int pointers;       /* rounds until successors, successor lists and predecessors were right */
+  int fingers;        /* rounds until the fingers were too */
+  int unsettled;      /* events still not right after SIM_MAX_ROUNDS */
+  unsigned long messages;
+} convergence;
+
+/*============================================================
+ * function declarations
+ *============================================================*/
+
+void build_ring(int count);
+sim_node *add_node();
+void order_insert(int index);
+void order_remove(int index);
+sim_node *find_node(uint32_t key);
+sim_node *reach(Node n);
+int oracle_position(uint32_t key);
+Node oracle_successor(uint32_t key);
+bool pointers_right(sim_node *n);
+bool fingers_right(sim_node *n);
+int count_wrong(bool (*right)(sim_node *n));
+void run_round(int round);
+convergence converge();
+void run_lookups(int count, char *label);
+unsigned long join_one();
+unsigned long leave_one(bool fail);
+sim_node *random_alive();
+uint64_t next_random();
+void print_events(char *label, int count, unsigned long messages, convergence *c);
+
+sim_node *nodes;
+int node_count, node_cap;
+int *by_key, key_mask;        /* open addressing, index + 1 per slot */
+int *order, order_count;      /* live nodes by key, our oracle */
+int successor_list_length = SUCCESSOR_LIST_LENGTH;
+unsigned long messages;
+uint64_t seed = 1;
+
+int main(int argc, char *argv[])
+{
+  int count = SIM_NODES, lookups = SIM_LOOKUPS, joins = SIM_JOINS, leaves = SIM_LEAVES, opt, i;
+  bool fail = false;
+  char *prog = argv[0];
+  unsigned long sent = 0;
+  convergence total, c;
+
+  while ((opt = getopt(argc, argv, "n:l:j:x:fr:s:")) != -1) {
+    switch (opt) {
+    case 'n': /* nodes in the starting ring */
+      count = atoi(optarg);
+      break;
+    case 'l': /* lookups before and after the churn */
+      lookups = atoi(optarg);
+      break;
+    case 'j': /* nodes to add, one at a time */
+      joins = atoi(optarg);
+      break;
+    case 'x': /* nodes to remove, one at a time */
+      leaves = atoi(optarg);
+      break;
+    case 'f': /* removed nodes fail instead of leaving */
+      fail = true;
+      break;
+    case 'r': /* successor list length */
+      successor_list_length = atoi(optarg);
+      break;
+    case 's': /* random seed */
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      printf("Usage: %s [-n nodes] [-l lookups] [-j joins] [-x leaves] [-f] [-r length] [-s seed]\n", prog);
+      exit(1);
+    }
+  }
+  if (count < 1 || joins < 0 || leaves < 0 || leaves >= count + joins ||
+      successor_list_length < 1 || successor_list_length > SUCCESSOR_LIST_MAX) {
+    printf("Need at least one node left, and a successor list length between 1 and %d\n", SUCCESSOR_LIST_MAX);
+    exit(1);
+  }
+  log_level = LEVEL_ERROR;
+
+  node_cap = count + joins;
+  nodes = Calloc(node_cap, sizeof(sim_node));
+  order = Malloc(node_cap * sizeof(int));
+  for (key_mask = 1; key_mask < 2 * node_cap; key_mask <<= 1);
+  by_key = Calloc(key_mask--, sizeof(int));
+
+  build_ring(count);
+  printf("Ring of %d nodes, successor lists of %d\n", count, successor_list_length);
+
+  messages = 0;
+  for (i = 0; i < 4; i++) {
+    run_round(i);
+  }
+  printf("Maintenance: %.1f messages per node per round, converged\n", (double) messages / 4 / order_count);
+
+  run_lookups(lookups, "Lookups");
+
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < joins; i++) {
+    sent += join_one();
+    c = converge();
+    total.pointers += c.pointers;
+    total.fingers += c.fingers;
+    total.unsettled += c.unsettled;
+    total.messages += c.messages;
+  }
+  print_events("Joins", joins, sent, &total);
+
+  memset(&total, 0, sizeof(total));
+  sent = 0;
+  for (i = 0; i < leaves; i++) {
+    sent += leave_one(fail);
+    c = converge();
+    total.pointers += c.pointers;
+    total.fingers += c.fingers;
+    total.unsettled += c.unsettled;
+    total.messages += c.messages;
+  }
+  print_events(fail ? "Failures" : "Leaves", leaves, sent, &total);
+
+  if (joins > 0 || leaves > 0) {
+    run_lookups(lookups, "Lookups after churn");
+  }
+  exit(0);
+}
+
+/*============================================================
+ * virtual transport
+ *============================================================*/
+
+static const ring_state *sim_read_lock(routing_node *r) {
+  return &((sim_node *) r->arg)->state;
+}
+
+static void sim_read_unlock(routing_node *r) {
+}
+
+/* One thread and no readers in between, so a copy is only needed for aborts */
+static ring_state *sim_write_begin(routing_node *r) {
+  ring_state *copy = Malloc(sizeof(ring_state));
+  *copy = ((sim_node *) r->arg)->state;
+  return copy;
+}
+
+static void sim_write_commit(routing_node *r, ring_state *state) {
+  ((sim_node *) r->arg)->state = *state;
+  Free(state);
+}
+
+static void sim_write_abort(routing_node *r, ring_state *state) {
+  Free(state);
+}
+
+static Node sim_query_hop(routing_node *r, Node n, uint32_t key, Node *successor) {
+  sim_node *t = reach(n);
+  Node none;
+
+  if (t == NULL) {
+    memset(&none, 0, sizeof(Node));
+    *successor = none;
+    return none;
+  }
+  return routing_closest_preceding_hop(&t->route, key, successor);
+}
+
+static Node sim_query_successor(routing_node *r, Node n, uint32_t key) {
+  sim_node *t = reach(n);
+  Node none;
+  uint32_t start;
+
+  if (t == NULL) {
+    memset(&none, 0, sizeof(Node));
+    return none;
+  }
+  return routing_find_successor(&t->route, key, &start, NULL);
+}
+
+static Node sim_fetch_successor(routing_node *r, Node n) {
+  sim_node *t = reach(n);
+  Node none;
+
+  if (t == NULL) {
+    memset(&none, 0, sizeof(Node));
+    return none;
+  }
+  return t->state.successor;
+}
+
+static int sim_fetch_neighbours(routing_node *r, Node n, Node *predecessor, Node list[], int max) {
+  sim_node *t = reach(n);
+  int count;
+
+  if (t == NULL) {
+    memset(predecessor, 0, sizeof(Node));
+    return -1;
+  }
+  *predecessor = t->state.predecessor;
+  count = t->state.successor_count < max ? t->state.successor_count : max;
+  memcpy(list, t->state.successor_list, count * sizeof(Node));
+  return count;
+}
+
+static bool sim_ping(routing_node *r, Node n) {
+  return reach(n) != NULL;
+}
+
+static void sim_notify(routing_node *r, Node n) {
+  sim_node *t = reach(n);
+
+  if (t != NULL) {
+    routing_notify(&t->route, r->self);
+  }
+}
+
+static void sim_update_finger_table(routing_node *r, Node n, Node s, int i) {
+  sim_node *t = reach(n);
+
+  if (t != NULL) {
+    routing_update_finger_table(&t->route, s, i);
+  }
+}
+
+static void sim_remove_node(routing_node *r, Node n, Node old, int i, Node replace) {
+  sim_node *t = reach(n);
+
+  if (t != NULL) {
+    routing_remove_node(&t->route, old, i, replace);
+  }
+}
+
+routing_ops sim_routing = {
+  sim_read_lock, sim_read_unlock, sim_write_begin, sim_write_commit, sim_write_abort,
+  sim_query_hop, sim_query_successor, sim_fetch_successor, sim_fetch_neighbours,
+  NULL, NULL, sim_ping, sim_notify, sim_update_finger_table, sim_remove_node, NULL
+};
+
+/* Count a message to n; the node it reaches, or NULL if n is gone */
+sim_node *reach(Node n) {
+  sim_node *t = find_node(n.key);
+
+  messages++;
+  return t != NULL && t->alive ? t : NULL;
+}
+
+/*============================================================
+ * nodes and the oracle
+ *============================================================*/
+
+/* splitmix64, so a seed gives the same run anywhere */
+uint64_t next_random() {
+  uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+sim_node *find_node(uint32_t key) {
+  int slot;
+
+  for (slot = key & key_mask; by_key[slot] != 0; slot = (slot + 1) & key_mask) {
+    if (nodes[by_key[slot] - 1].route.self.key == key) {
+      return &nodes[by_key[slot] - 1];
+    }
+  }
+  return NULL;
+}
+
+/* A node with a fresh key and address, alone in its own ring */
+sim_node *add_node() {
+  sim_node *n = &nodes[node_count];
+  Node self;
+  int slot, i;
+
+  memset(&self, 0, sizeof(Node));
+  do {
+    self.key = next_random();
+  } while (find_node(self.key) != NULL);
+  snprintf(self.ip_address, sizeof(self.ip_address), "10.%d.%d.%d",
+           (node_count >> 16) & 255, (node_count >> 8) & 255, node_count & 255);
+  self.port = SIM_PORT;
+
+  routing_init(&n->route, self, successor_list_length, &sim_routing, n);
+  n->state.predecessor = self;
+  n->state.successor = self;
+  for (i = 0; i < KEY_SIZE; i++) {
+    n->state.finger_table[i] = self;
+  }
+  n->alive = true;
+
+  for (slot = self.key & key_mask; by_key[slot] != 0; slot = (slot + 1) & key_mask);
+  by_key[slot] = ++node_count;
+  return n;
+}
+
+/* Position in order of key's successor */
+int oracle_position(uint32_t key) {
+  int lo = 0, hi = order_count;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (nodes[order[mid]].route.self.key < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo == order_count ? 0 : lo;
+}
+
+Node oracle_successor(uint32_t key) {
+  return nodes[order[oracle_position(key)]].route.self;
+}
+
+void order_insert(int index) {
+  int pos = order_count == 0 ? 0 : oracle_position(nodes[index].route.self.key);
+
+  if (pos == 0 && order_count > 0 && nodes[order[0]].route.self.key < nodes[index].route.self.key) {
+    pos = order_count; /* past the largest key */
+  }
+  memmove(&order[pos + 1], &order[pos], (order_count - pos) * sizeof(int));
+  order[pos] = index;
+  order_count++;
+}
+
+void order_remove(int index) {
+  int pos = oracle_position(nodes[index].route.self.key);
+
+  memmove(&order[pos], &order[pos + 1], (order_count - pos - 1) * sizeof(int));
+  order_count--;
+}
+
+/* A ring of count nodes, every pointer, successor list and finger already right */
+void build_ring(int count) {
+  int i, j, pos;
+
+  for (i = 0; i < count; i++) {
+    add_node();
+    order_insert(i);
+  }
+  for (pos = 0; pos < order_count; pos++) {
+    sim_node *n = &nodes[order[pos]];
+    Node self = n->route.self;
+    n->state.predecessor = nodes[order[(pos + order_count - 1) % order_count]].route.self;
+    n->state.successor = nodes[order[(pos + 1) % order_count]].route.self;
+    for (j = 0; j < successor_list_length && j < order_count - 1; j++) {
+      n->state.successor_list[j] = nodes[order[(pos + 1 + j) % order_count]].route.self;
+    }
+    n->state.successor_count = j;
+    for (j = 0; j < KEY_SIZE; j++) {
+      n->state.finger_table[j] = oracle_successor(self.key + ((uint32_t) 1 << j));
+    }
+  }
+}
+
+bool pointers_right(sim_node *n) {
+  int pos = oracle_position(n->route.self.key), j;
+
+  if (!is_equal(n->state.successor, nodes[order[(pos + 1) % order_count]].route.self) ||
+      !is_equal(n->state.predecessor, nodes[order[(pos + order_count - 1) % order_count]].route.self)) {
+    return false;
+  }
+  for (j = 0; j < successor_list_length && j < order_count - 1; j++) {
+    if (j >= n->state.successor_count ||
+        !is_equal(n->state.successor_list[j], nodes[order[(pos + 1 + j) % order_count]].route.self)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool fingers_right(sim_node *n) {
+  int i;
+
+  for (i = 0; i < KEY_SIZE; i++) {
+    if (!is_equal(n->state.finger_table[i], oracle_successor(n->route.self.key + ((uint32_t) 1 << i)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int count_wrong(bool (*right)(sim_node *n)) {
+  int pos, wrong = 0;
+
+  for (pos = 0; pos < order_count; pos++) {
+    wrong += !right(&nodes[order[pos]]);
+  }
+  return wrong;
+}
+
+sim_node *random_alive() {
+  return &nodes[order[next_random() % order_count]];
+}
+
+/*============================================================
+ * rounds and events
+ *============================================================*/
+
+/* Every live node runs its maintenance once, as often as chord's periods have it */
+void run_round(int round) {
+  int i, j;
+
+  for (i = 0; i < node_count; i++) {
+    sim_node *n = &nodes[i];
+    if (!n->alive) {
+      continue;
+    }
+    routing_stabilize(&n->route);
+    for (j = 0; j < STABILIZE_PERIOD / FIX_FINGERS_PERIOD; j++) {
+      routing_fix_fingers(&n->route);
+    }
+    if (round % (CHECK_PREDECESSOR_PERIOD / STABILIZE_PERIOD) == 0) {
+      routing_check_predecessor(&n->route);
+    }
+  }
+}
+
+/* Run rounds until the ring is right again, or SIM_MAX_ROUNDS have gone by */
+convergence converge() {
+  convergence c = { SIM_MAX_ROUNDS, SIM_MAX_ROUNDS, 1, 0 };
+  unsigned long before = messages;
+  bool pointers = false;
+  int round;
+
+  for (round = 0; round <= SIM_MAX_ROUNDS; round++) {
+    if (!pointers && count_wrong(pointers_right) == 0) {
+      c.pointers = round;
+      pointers = true;
+    }
+    if (pointers && count_wrong(fingers_right) == 0) {
+      c.fingers = round;
+      c.unsettled = 0;
+      break;
+    }
+    if (round < SIM_MAX_ROUNDS) {
+      run_round(round);
+    }
+  }
+  c.messages = messages - before;
+  return c;
+}
+
+/* Add a node as chord's join_node does; returns the messages it sent */
+unsigned long join_one() {
+  sim_node *bootstrap = random_alive(), *n = add_node();
+  unsigned long before = messages;
+  Node none;
+
+  n->route.bootstrap = bootstrap->route.self;
+  routing_update_successor(&n->route, sim_query_successor(&n->route, bootstrap->route.self, n->route.self.key));
+  memset(&none, 0, sizeof(Node));
+  routing_update_predecessor(&n->route, none);
+  routing_stabilize(&n->route);
+  order_insert(n - nodes);
+  return messages - before;
+}
+
+/* Remove a node, linking its neighbours as chord's leave_ring does unless it fails */
+unsigned long leave_one(bool fail) {
+  sim_node *n = random_alive();
+  unsigned long before = messages;
+  Node successor = n->state.successor, predecessor = n->state.predecessor;
+  sim_node *t;
+
+  if (!fail && !is_equal(successor, n->route.self)) {
+    if ((t = reach(successor)) != NULL) {
+      routing_update_predecessor(&t->route, predecessor);
+    }
+    if (predecessor.port != 0 && !is_equal(predecessor, n->route.self) && (t = reach(predecessor)) != NULL) {
+      routing_update_successor(&t->route, successor);
+    }
+  }
+  n->alive = false;
+  order_remove(n - nodes);
+  return messages - before;
+}
+
+/* Look up random keys from random nodes, checking every answer against the oracle */
+void run_lookups(int count, char *label) {
+  static stats_histogram hops;
+  unsigned long before = messages;
+  int i, wrong = 0, b;
+
+  if (count == 0) {
+    return;
+  }
+  memset(&hops, 0, sizeof(hops));
+  for (i = 0; i < count; i++) {
+    uint32_t key = next_random(), start;
+    int h = 0;
+    Node owner = routing_find_successor(&random_alive()->route, key, &start, &h);
+    wrong += !is_equal(owner, oracle_successor(key));
+    stats_add(&hops, h);
+  }
+  printf("%s: %d, %.2f hops mean, %llu p50, %llu p99, %llu max, %.2f messages each, %d wrong\n",
+         label, count, (double) hops.sum / hops.count, (unsigned long long) stats_quantile(&hops, 0.5),
+         (unsigned long long) stats_quantile(&hops, 0.99), hops.max, (double) (messages - before) / count, wrong);
+  /* Hop counts are small, so their buckets are exact */
+  for (b = 0; b < STATS_SUB && b <= (int) hops.max; b++) {
+    printf("  %2d hops %10llu\n", b, hops.counts[b]);
+  }
+}
+
+void print_events(char *label, int count, unsigned long sent, convergence *total) {
+  if (count == 0) {
+    return;
+  }
+  printf("%s: %d, %.1f messages each, then %.1f rounds to fix pointers (%.1f s) and %.1f to fix fingers (%.1f s), "
+         "%.0f maintenance messages, %d unsettled\n", label, count, (double) sent / count,
+         (double) total->pointers / count, (double) total->pointers / count * STABILIZE_PERIOD / 1000,
+         (double) total->fingers / count, (double) total->fingers / count * STABILIZE_PERIOD / 1000,
+         (double) total->messages / count, total->unsettled);
+}
@@ -0,0 +1,187 @@
+/*
+ * stats.c - per-RPC latency histograms and counters
+ *
+ * Every opcode has an entry for the requests we handled and one for the
+ * requests we sent, each with counters and a latency histogram. Requests
+ * are recorded from the reactor's threads, its workers and our own client
+ * threads at once, so every update is an atomic add into a fixed slot and
+ * no lock is taken; a report reads the counters as they stand, so its
+ * figures may be a few requests apart from each other.
+ */
+
+#include <stdarg.h>
+#include <time.h>
+#include "csapp.h"
+#include "wire.h"
+#include "stats.h"
+
+static stats_rpc rpcs[2][OP_COUNT];
+static unsigned long unknown; /* requests with no handler */
+static stats_histogram hops;
+
+uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t v) {
+  int shift;
+
+  if (v < STATS_SUB) {
+    return v;
+  }
+  shift = 63 - __builtin_clzll(v) - STATS_SUB_BITS;
+  return (shift + 1) * STATS_SUB + (int) (v >> shift) - STATS_SUB;
+}
+
+/* Highest value that falls in bucket b */
+static uint64_t bucket_top(int b) {
+  int shift;
+
+  if (b < STATS_SUB) {
+    return b;
+  }
+  shift = b / STATS_SUB - 1;
+  return (((uint64_t) (STATS_SUB + b % STATS_SUB) + 1) << shift) - 1;
+}
+
+void stats_add(stats_histogram *h, uint64_t v) {
+  unsigned long long max;
+
+  __sync_fetch_and_add(&h->counts[bucket_of(v)], 1);
+  __sync_fetch_and_add(&h->count, 1);
+  __sync_fetch_and_add(&h->sum, v);
+  while ((max = h->max) < v && !__sync_bool_compare_and_swap(&h->max, max, v));
+}
+
+void stats_merge(stats_histogram *into, stats_histogram *from) {
+  int b;
+
+  for (b = 0; b < STATS_BUCKETS; b++) {
+    into->counts[b] += from->counts[b];
+  }
+  into->count += from->count;
+  into->sum += from->sum;
+  if (from->max > into->max) {
+    into->max = from->max;
+  }
+}
+
+uint64_t stats_quantile(stats_histogram *h, double q) {
+  unsigned long long count = h->count, seen = 0, rank;
+  int b;
+
+  if (count == 0) {
+    return 0;
+  }
+  /* The rank-th smallest value, rounding the rank up */
+  rank = q * count;
+  if (rank < q * count || rank == 0) {
+    rank++;
+  }
+  for (b = 0; b < STATS_BUCKETS; b++) {
+    if ((seen += h->counts[b]) >= rank) {
+      return bucket_top(b) < h->max ? bucket_top(b) : h->max;
+    }
+  }
+  return h->max;
+}
+
+void stats_record(int side, int opcode, uint64_t ns, size_t in, size_t out, bool failed) {
+  stats_rpc *s;
+
+  if (opcode < 0 || opcode >= OP_COUNT) {
+    __sync_fetch_and_add(&unknown, 1);
+    return;
+  }
+  s = &rpcs[side][opcode];
+  __sync_fetch_and_add(&s->calls, 1);
+  if (failed) {
+    __sync_fetch_and_add(&s->errors, 1);
+  }
+  __sync_fetch_and_add(&s->bytes_in, in);
+  __sync_fetch_and_add(&s->bytes_out, out);
+  stats_add(&s->latency, ns);
+}
+
+void stats_hops(int n) {
+  stats_add(&hops, n);
+}
+
+unsigned long stats_of(int side, int opcode, stats_rpc *out) {
+  if (opcode < 0 || opcode >= OP_COUNT) {
+    return unknown;
+  }
+  *out = rpcs[side][opcode];
+  return out->calls;
+}
+
+typedef struct report
+{
+  char *buf;
+  size_t len, cap;
+} report;
+
+static void append(report *r, char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(report *r, char *fmt, ...) {
+  va_list args;
+  int n;
+
+  while (1) {
+    va_start(args, fmt);
+    n = vsnprintf(r->buf + r->len, r->cap - r->len, fmt, args);
+    va_end(args);
+    if (r->len + n < r->cap) {
+      r->len += n;
+      return;
+    }
+    r->cap *= 2;
+    r->buf = Realloc(r->buf, r->cap);
+  }
+}
+
+char *stats_report(size_t *len) {
+  static char *sides[] = { "server", "client" };
+  report r = { Malloc(MAXLINE), 0, MAXLINE };
+  int side, op, b;
+
+  append(&r, "%-13s %-6s %9s %7s %11s %11s %9s %9s %9s %9s\n", "rpc", "side", "calls", "errors",
+         "bytes in", "bytes out", "p50 us", "p99 us", "p999 us", "max us");
+  for (op = 0; op < OP_COUNT; op++) {
+    for (side = STATS_SERVER; side <= STATS_CLIENT; side++) {
+      stats_rpc *s = &rpcs[side][op];
+      if (s->calls == 0) {
+        continue;
+      }
+      append(&r, "%-13s %-6s %9lu %7lu %11llu %11llu %9.1f %9.1f %9.1f %9.1f\n", opcode_name(op),
+             sides[side], s->calls, s->errors, s->bytes_in, s->bytes_out,
+             stats_quantile(&s->latency, 0.5) / 1000.0, stats_quantile(&s->latency, 0.99) / 1000.0,
+             stats_quantile(&s->latency, 0.999) / 1000.0, s->latency.max / 1000.0);
+    }
+  }
+  if (unknown > 0) {
+    append(&r, "%-13s %-6s %9lu\n", "unknown", sides[STATS_SERVER], unknown);
+  }
+
+  unsigned long long rest = hops.count;
+  append(&r, "Lookups: %llu", hops.count);
+  if (hops.count > 0) {
+    append(&r, ", %.2f hops mean, %llu p50, %llu p99, %llu max\n", (double) hops.sum / hops.count,
+           (unsigned long long) stats_quantile(&hops, 0.5),
+           (unsigned long long) stats_quantile(&hops, 0.99), hops.max);
+    /* Hop counts are small, so their buckets are exact */
+    for (b = 0; b < STATS_SUB && b <= (int) hops.max; b++) {
+      append(&r, "  %2d hops %10llu\n", b, hops.counts[b]);
+      rest -= hops.counts[b];
+    }
+    if (hops.max >= STATS_SUB) {
+      append(&r, "  %2d+ hops %9llu\n", STATS_SUB, rest);
+    }
+  } else {
+    append(&r, "\n");
+  }
+  *len = r.len;
+  return r.buf;
+}
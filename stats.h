@@ -0,0 +1,63 @@
+/*
+ * stats.h - per-RPC latency histograms and counters
+ *
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define   STATS_SUB_BITS  4 // Buckets per power of two, as a power of two: values within 1/16th
+#define   STATS_SUB       (1 << STATS_SUB_BITS)
+#define   STATS_BUCKETS   ((64 - STATS_SUB_BITS + 1) * STATS_SUB) // Enough for any uint64_t
+
+/* Sides of an RPC */
+#define   STATS_SERVER  0 // Requests we handled
+#define   STATS_CLIENT  1 // Requests we sent
+
+/*
+ * HDR-style histogram: values below STATS_SUB get a bucket each, and
+ * every power of two above is split into STATS_SUB equal buckets, so a
+ * value is known to within a sixteenth at any magnitude.
+ */
+typedef struct stats_histogram
+{
+  unsigned long long counts[STATS_BUCKETS];
+  unsigned long long count, sum, max;
+} stats_histogram;
+
+typedef struct stats_rpc
+{
+  unsigned long calls, errors;
+  unsigned long long bytes_in, bytes_out;
+  stats_histogram latency;    /* in nanoseconds */
+} stats_rpc;
+
+/* Nanoseconds on the monotonic clock */
+uint64_t stats_now(void);
+
+/* Adds v to h; safe from any number of threads at once */
+void stats_add(stats_histogram *h, uint64_t v);
+
+/* Adds every value counted in from to into; neither may be changing */
+void stats_merge(stats_histogram *into, stats_histogram *from);
+
+/* Highest value h places at quantile q in [0, 1], or 0 if h is empty */
+uint64_t stats_quantile(stats_histogram *h, double q);
+
+/* Counts one RPC with opcode on side that took ns, with the bytes it read and wrote */
+void stats_record(int side, int opcode, uint64_t ns, size_t in, size_t out, bool failed);
+
+/* Counts one lookup of ours that took hops remote nodes to resolve */
+void stats_hops(int hops);
+
+/* Copies the stats of opcode on side; returns requests with no handler for any other opcode */
+unsigned long stats_of(int side, int opcode, stats_rpc *out);
+
+/* A table of every RPC seen and the hop counts, as text; Malloc'd, *len bytes */
+char *stats_report(size_t *len);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,604 @@
+/*
+ * store.c - key-value store for the keys a node owns
+ *
+ * An open addressing table of fixed size slots, probed linearly from a
+ * position that depends only on the key's Chord ID, so every key with a
+ * given ID sits in one probe run. A slot holds the ID, a hash of the key
+ * bytes to skip most comparisons, and a pointer to the entry. Entries
+ * (key and value bytes) are bump allocated from an arena of large
+ * chunks. Replaced and deleted entries are left in the arena as dead
+ * bytes; once they outweigh the live ones the live entries are copied
+ * into a fresh arena, so memory stays proportional to what is stored.
+ * The table doubles past 70% occupancy (tombstones included) and halves
+ * below 1/8, and is protected by a readers-writer lock. Next to the
+ * table, an idindex keeps the IDs in ring order, so the keys of a range
+ * can be visited without scanning the whole table, and a cuckoo filter
+ * answers most lookups of absent keys from two small buckets; it is
+ * rebuilt from the slots whenever the table is resized.
+ *
+ * A snapshot is the same table written out position independent: a
+ * header, the slots with file offsets in place of entry pointers, the
+ * IDs in ring order, then the entries as a heap laid out exactly as in
+ * the arena. Entries are never changed in place, so a snapshot copies
+ * the slots under the lock and writes the entries without it, while
+ * compaction is held off. Loading one maps the file and points the
+ * slots into the mapping; values are paged in as they are read, and a
+ * replaced entry simply stops being referenced.
+ */
+
+#include "store.h"
+#include "idindex.h"
+#include "filter.h"
+
+typedef struct entry
+{
+  uint32_t klen;
+  uint32_t vlen;
+  char data[];            /* key bytes, then value bytes */
+} entry;
+
+typedef struct slot
+{
+  uint32_t id;
+  uint32_t tag;           /* hash of the key bytes */
+  entry *e;               /* NULL if empty, TOMBSTONE if deleted */
+} slot;
+
+typedef struct chunk
+{
+  struct chunk *next;
+  size_t used, size;
+  char data[];
+} chunk;
+
+struct store
+{
+  pthread_rwlock_t lock;
+  slot *slots;
+  size_t capacity;        /* power of two */
+  size_t count;           /* live entries */
+  size_t tombstones;
+  chunk *arena;
+  size_t live_bytes, dead_bytes;
+  idindex *index;         /* IDs present, in order */
+  filter *filter;         /* keys present, approximately */
+  store_log *log;         /* told about every change, if set */
+  void *log_arg;
+  char *map;              /* snapshot holding some of the entries, or NULL */
+  size_t map_len;
+  int pins;               /* snapshots being written; no compaction meanwhile */
+};
+
+#define SNAPSHOT_MAGIC "CHORDKV1"
+
+typedef struct snapshot_header
+{
+  char magic[8];
+  uint64_t stamp;
+  uint64_t count;         /* entries */
+  uint64_t capacity;      /* slots, a power of two */
+  uint64_t slots;         /* offsets in the file of each part */
+  uint64_t ids;
+  uint64_t heap;
+  uint64_t size;          /* of the whole file */
+} snapshot_header;
+
+typedef struct snapshot_slot
+{
+  uint32_t id;
+  uint32_t tag;
+  uint64_t entry;         /* offset in the file, 0 if empty */
+} snapshot_slot;
+
+static entry tombstone;
+#define TOMBSTONE (&tombstone)
+
+static uint32_t mix(uint32_t id) {
+  id ^= id >> 16;
+  id *= 0x7feb352d;
+  id ^= id >> 15;
+  id *= 0x846ca68b;
+  id ^= id >> 16;
+  return id;
+}
+
+static size_t entry_size(size_t klen, size_t vlen) {
+  return (sizeof(entry) + klen + vlen + 7) & ~(size_t) 7;
+}
+
+static entry *arena_alloc(store *s, size_t size) {
+  chunk *c = s->arena;
+
+  if (c == NULL || c->size - c->used < size) {
+    size_t chunk_size = size > STORE_CHUNK ? size : STORE_CHUNK;
+    c = Malloc(sizeof(chunk) + chunk_size);
+    c->size = chunk_size;
+    c->used = 0;
+    c->next = s->arena;
+    s->arena = c;
+  }
+  entry *e = (entry *) (c->data + c->used);
+  c->used += size;
+  return e;
+}
+
+static void arena_free(chunk *c) {
+  chunk *next;
+  for (; c != NULL; c = next) {
+    next = c->next;
+    Free(c);
+  }
+}
+
+static entry *new_entry(store *s, char *key, size_t klen, char *value, size_t vlen) {
+  size_t size = entry_size(klen, vlen);
+  entry *e = arena_alloc(s, size);
+
+  e->klen = klen;
+  e->vlen = vlen;
+  memcpy(e->data, key, klen);
+  memcpy(e->data + klen, value, vlen);
+  s->live_bytes += size;
+  return e;
+}
+
+/* Whether e lives in the snapshot mapping rather than the arena */
+static bool mapped(store *s, entry *e) {
+  return (char *) e >= s->map && (char *) e < s->map + s->map_len;
+}
+
+static void retire_entry(store *s, entry *e) {
+  if (mapped(s, e)) {
+    return;
+  }
+  size_t size = entry_size(e->klen, e->vlen);
+  s->live_bytes -= size;
+  s->dead_bytes += size;
+}
+
+/* Copy the live entries into a fresh arena and drop the old one */
+static void compact(store *s) {
+  chunk *old = s->arena;
+  size_t i;
+
+  s->arena = NULL;
+  s->live_bytes = s->dead_bytes = 0;
+  for (i = 0; i < s->capacity; i++) {
+    entry *e = s->slots[i].e;
+    if (e != NULL && e != TOMBSTONE && !mapped(s, e)) {
+      s->slots[i].e = new_entry(s, e->data, e->klen, e->data + e->klen, e->vlen);
+    }
+  }
+  arena_free(old);
+}
+
+static void maybe_compact(store *s) {
+  if (s->pins == 0 && s->dead_bytes > STORE_CHUNK && s->dead_bytes > s->live_bytes) {
+    compact(s);
+  }
+}
+
+/* Refill the filter from the slots, with room for keys keys */
+static void rebuild_filter(store *s, size_t keys) {
+  size_t i;
+
+  filter_free(s->filter);
+  s->filter = filter_create(keys);
+  for (i = 0; i < s->capacity; i++) {
+    if (s->slots[i].e != NULL && s->slots[i].e != TOMBSTONE &&
+        filter_add(s->filter, s->slots[i].id, s->slots[i].tag) < 0) {
+      rebuild_filter(s, keys * 2);
+      return;
+    }
+  }
+}
+
+/* Rehash the live slots into a table of the given capacity */
+static void resize(store *s, size_t capacity) {
+  slot *old = s->slots;
+  size_t old_capacity = s->capacity, i, j;
+
+  s->slots = Calloc(capacity, sizeof(slot));
+  s->capacity = capacity;
+  s->tombstones = 0;
+  for (i = 0; i < old_capacity; i++) {
+    if (old[i].e == NULL || old[i].e == TOMBSTONE) {
+      continue;
+    }
+    for (j = mix(old[i].id) & (capacity - 1); s->slots[j].e != NULL; j = (j + 1) & (capacity - 1));
+    s->slots[j] = old[i];
+  }
+  Free(old);
+  rebuild_filter(s, capacity);
+}
+
+/* Slot holding key, or -1 */
+static ssize_t find(store *s, uint32_t id, uint32_t tag, char *key, size_t klen) {
+  size_t i;
+
+  if (!filter_contains(s->filter, id, tag)) {
+    return -1;
+  }
+  for (i = mix(id) & (s->capacity - 1); s->slots[i].e != NULL; i = (i + 1) & (s->capacity - 1)) {
+    slot *sl = &s->slots[i];
+    if (sl->e != TOMBSTONE && sl->id == id && sl->tag == tag &&
+        sl->e->klen == klen && memcmp(sl->e->data, key, klen) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+store *store_create(void) {
+  store *s = Calloc(1, sizeof(store));
+
+  pthread_rwlock_init(&s->lock, NULL);
+  s->capacity = STORE_MIN_SLOTS;
+  s->slots = Calloc(s->capacity, sizeof(slot));
+  s->index = idindex_create();
+  s->filter = filter_create(s->capacity);
+  return s;
+}
+
+void store_free(store *s) {
+  pthread_rwlock_destroy(&s->lock);
+  arena_free(s->arena);
+  if (s->map != NULL) {
+    munmap(s->map, s->map_len);
+  }
+  idindex_free(s->index);
+  filter_free(s->filter);
+  Free(s->slots);
+  Free(s);
+}
+
+void store_set_log(store *s, store_log *log, void *arg) {
+  pthread_rwlock_wrlock(&s->lock);
+  s->log = log;
+  s->log_arg = arg;
+  pthread_rwlock_unlock(&s->lock);
+}
+
+static int put(store *s, uint32_t id, char *key, size_t klen, char *value, size_t vlen, bool replace) {
+  uint32_t tag = filter_tag(key, klen);
+  ssize_t found;
+  size_t i;
+
+  pthread_rwlock_wrlock(&s->lock);
+  if ((found = find(s, id, tag, key, klen)) >= 0) {
+    if (!replace) {
+      pthread_rwlock_unlock(&s->lock);
+      return 1;
+    }
+    retire_entry(s, s->slots[found].e);
+    s->slots[found].e = new_entry(s, key, klen, value, vlen);
+    if (s->log != NULL) {
+      s->log(s->log_arg, STORE_PUT, id, key, klen, value, vlen);
+    }
+    maybe_compact(s);
+    pthread_rwlock_unlock(&s->lock);
+    return 0;
+  }
+
+  if ((s->count + s->tombstones + 1) * 10 > s->capacity * 7) {
+    resize(s, s->count * 2 + 2 > s->capacity ? s->capacity * 2 : s->capacity);
+  }
+  for (i = mix(id) & (s->capacity - 1); s->slots[i].e != NULL && s->slots[i].e != TOMBSTONE;
+       i = (i + 1) & (s->capacity - 1));
+  if (s->slots[i].e == TOMBSTONE) {
+    s->tombstones--;
+  }
+  s->slots[i].id = id;
+  s->slots[i].tag = tag;
+  s->slots[i].e = new_entry(s, key, klen, value, vlen);
+  s->count++;
+  idindex_add(s->index, id);
+  if (filter_add(s->filter, id, tag) < 0) {
+    rebuild_filter(s, s->capacity * 2);
+  }
+  if (s->log != NULL) {
+    s->log(s->log_arg, STORE_PUT, id, key, klen, value, vlen);
+  }
+  pthread_rwlock_unlock(&s->lock);
+  return 0;
+}
+
+int store_put(store *s, uint32_t id, char *key, size_t klen, char *value, size_t vlen) {
+  return put(s, id, key, klen, value, vlen, true);
+}
+
+int store_put_new(store *s, uint32_t id, char *key, size_t klen, char *value, size_t vlen) {
+  return put(s, id, key, klen, value, vlen, false);
+}
+
+ssize_t store_get(store *s, uint32_t id, char *key, size_t klen, char *value, size_t maxlen) {
+  ssize_t found, vlen = -1;
+
+  pthread_rwlock_rdlock(&s->lock);
+  if ((found = find(s, id, filter_tag(key, klen), key, klen)) >= 0) {
+    entry *e = s->slots[found].e;
+    vlen = e->vlen;
+    memcpy(value, e->data + e->klen, e->vlen < maxlen ? e->vlen : maxlen);
+  }
+  pthread_rwlock_unlock(&s->lock);
+  return vlen;
+}
+
+int store_delete(store *s, uint32_t id, char *key, size_t klen) {
+  ssize_t found;
+
+  pthread_rwlock_wrlock(&s->lock);
+  if ((found = find(s, id, filter_tag(key, klen), key, klen)) < 0) {
+    pthread_rwlock_unlock(&s->lock);
+    return -1;
+  }
+  retire_entry(s, s->slots[found].e);
+  s->slots[found].e = TOMBSTONE;
+  s->count--;
+  idindex_remove(s->index, id);
+  filter_remove(s->filter, id, s->slots[found].tag);
+  if (s->log != NULL) {
+    s->log(s->log_arg, STORE_DELETE, id, key, klen, NULL, 0);
+  }
+  s->tombstones++;
+  if (s->capacity > STORE_MIN_SLOTS && s->count * 8 < s->capacity) {
+    resize(s, s->capacity / 2);
+  }
+  maybe_compact(s);
+  pthread_rwlock_unlock(&s->lock);
+  return 0;
+}
+
+size_t store_count(store *s) {
+  size_t count;
+
+  pthread_rwlock_rdlock(&s->lock);
+  count = s->count;
+  pthread_rwlock_unlock(&s->lock);
+  return count;
+}
+
+/* Bytes held for entries and slots */
+size_t store_bytes(store *s) {
+  size_t bytes;
+
+  pthread_rwlock_rdlock(&s->lock);
+  bytes = s->live_bytes + s->dead_bytes + s->capacity * sizeof(slot) + idindex_bytes(s->index) +
+          filter_bytes(s->filter);
+  pthread_rwlock_unlock(&s->lock);
+  return bytes;
+}
+
+void store_foreach(store *s, store_visit *visit, void *arg) {
+  size_t i;
+
+  pthread_rwlock_rdlock(&s->lock);
+  for (i = 0; i < s->capacity; i++) {
+    entry *e = s->slots[i].e;
+    if (e != NULL && e != TOMBSTONE) {
+      visit(s->slots[i].id, e->data, e->klen, e->data + e->klen, e->vlen, arg);
+    }
+  }
+  pthread_rwlock_unlock(&s->lock);
+}
+
+/* Visit the keys with this ID; they all sit in the probe run starting at mix(id) */
+static void visit_id(store *s, uint32_t id, store_visit *visit, void *arg) {
+  size_t i;
+
+  for (i = mix(id) & (s->capacity - 1); s->slots[i].e != NULL; i = (i + 1) & (s->capacity - 1)) {
+    entry *e = s->slots[i].e;
+    if (e != TOMBSTONE && s->slots[i].id == id) {
+      visit(id, e->data, e->klen, e->data + e->klen, e->vlen, arg);
+    }
+  }
+}
+
+void store_foreach_id(store *s, uint32_t id, store_visit *visit, void *arg) {
+  pthread_rwlock_rdlock(&s->lock);
+  visit_id(s, id, visit, arg);
+  pthread_rwlock_unlock(&s->lock);
+}
+
+typedef struct range_scan
+{
+  store *s;
+  store_visit *visit;
+  void *arg;
+} range_scan;
+
+static int visit_range_id(uint32_t id, void *arg) {
+  range_scan *scan = arg;
+
+  visit_id(scan->s, id, scan->visit, scan->arg);
+  return 0;
+}
+
+/* Visit the keys whose ID is_between a and b, in ring order from a */
+void store_foreach_range(store *s, uint32_t a, uint32_t b, store_visit *visit, void *arg) {
+  range_scan scan = { s, visit, arg };
+
+  pthread_rwlock_rdlock(&s->lock);
+  idindex_range(s->index, a, b, visit_range_id, &scan);
+  pthread_rwlock_unlock(&s->lock);
+}
+
+char *store_filter(store *s, size_t *len) {
+  char *buf;
+
+  pthread_rwlock_rdlock(&s->lock);
+  buf = filter_encode(s->filter, len);
+  pthread_rwlock_unlock(&s->lock);
+  return buf;
+}
+
+/* Snapshots */
+
+typedef struct snapshot_out
+{
+  int fd;
+  char *buf;
+  size_t len;
+  bool failed;
+} snapshot_out;
+
+static void out_flush(snapshot_out *o) {
+  if (!o->failed && rio_writen(o->fd, o->buf, o->len) != o->len) {
+    o->failed = true;
+  }
+  o->len = 0;
+}
+
+/* Buffered write of len bytes; p NULL writes zeros */
+static void out_write(snapshot_out *o, void *p, size_t len) {
+  while (len > 0) {
+    size_t n = STORE_CHUNK - o->len < len ? STORE_CHUNK - o->len : len;
+    if (p != NULL) {
+      memcpy(o->buf + o->len, p, n);
+      p = (char *) p + n;
+    } else {
+      memset(o->buf + o->len, 0, n);
+    }
+    o->len += n;
+    len -= n;
+    if (o->len == STORE_CHUNK) {
+      out_flush(o);
+    }
+  }
+}
+
+static int by_id(const void *a, const void *b) {
+  uint32_t x = ((slot *) a)->id, y = ((slot *) b)->id;
+  return x < y ? -1 : x > y;
+}
+
+int store_snapshot(store *s, int fd, store_stamp *stamp, void *arg) {
+  snapshot_header h;
+  snapshot_slot *table;
+  snapshot_out out = { fd, NULL, 0, false };
+  slot *live;
+  size_t n = 0, i, j;
+  uint64_t offset;
+
+  pthread_rwlock_rdlock(&s->lock);
+  live = Malloc((s->count + 1) * sizeof(slot));
+  for (i = 0; i < s->capacity; i++) {
+    if (s->slots[i].e != NULL && s->slots[i].e != TOMBSTONE) {
+      live[n++] = s->slots[i];
+    }
+  }
+  h.stamp = stamp != NULL ? stamp(arg) : 0;
+  __sync_fetch_and_add(&s->pins, 1);
+  pthread_rwlock_unlock(&s->lock);
+
+  /* Entries in ID order, so the IDs can be indexed in one pass on loading */
+  qsort(live, n, sizeof(slot), by_id);
+  memset(h.magic, 0, sizeof(h.magic));
+  memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+  h.count = n;
+  for (h.capacity = STORE_MIN_SLOTS; h.capacity < 2 * n; h.capacity *= 2);
+  h.slots = sizeof(h);
+  h.ids = h.slots + h.capacity * sizeof(snapshot_slot);
+  h.heap = (h.ids + n * sizeof(uint32_t) + 7) & ~(uint64_t) 7;
+
+  table = Calloc(h.capacity, sizeof(snapshot_slot));
+  for (i = 0, offset = h.heap; i < n; i++) {
+    for (j = mix(live[i].id) & (h.capacity - 1); table[j].entry != 0; j = (j + 1) & (h.capacity - 1));
+    table[j].id = live[i].id;
+    table[j].tag = live[i].tag;
+    table[j].entry = offset;
+    offset += entry_size(live[i].e->klen, live[i].e->vlen);
+  }
+  h.size = offset;
+
+  out.buf = Malloc(STORE_CHUNK);
+  out_write(&out, &h, sizeof(h));
+  out_write(&out, table, h.capacity * sizeof(snapshot_slot));
+  for (i = 0; i < n; i++) {
+    out_write(&out, &live[i].id, sizeof(uint32_t));
+  }
+  out_write(&out, NULL, h.heap - h.ids - n * sizeof(uint32_t));
+  for (i = 0; i < n; i++) {
+    entry *e = live[i].e;
+    size_t len = sizeof(entry) + e->klen + e->vlen;
+    out_write(&out, e, len);
+    out_write(&out, NULL, entry_size(e->klen, e->vlen) - len);
+  }
+  out_flush(&out);
+
+  __sync_fetch_and_sub(&s->pins, 1);
+  Free(out.buf);
+  Free(table);
+  Free(live);
+  return out.failed ? -1 : 0;
+}
+
+/* Whether the parts h describes fit together in a file of size bytes */
+static bool snapshot_valid(snapshot_header *h, size_t size) {
+  return memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) == 0 && h->size == size &&
+         h->capacity >= STORE_MIN_SLOTS && (h->capacity & (h->capacity - 1)) == 0 &&
+         h->capacity <= size / sizeof(snapshot_slot) &&
+         h->count <= h->capacity / 2 && h->slots == sizeof(*h) &&
+         h->ids == h->slots + h->capacity * sizeof(snapshot_slot) &&
+         h->heap >= h->ids + h->count * sizeof(uint32_t) && h->heap <= h->size;
+}
+
+uint64_t store_map(store *s, int fd) {
+  struct stat st;
+  snapshot_header h;
+  snapshot_slot *table;
+  uint32_t *ids;
+  entry *e;
+  char *map;
+  size_t i, n = 0;
+
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(h) ||
+      (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    return 0;
+  }
+  memcpy(&h, map, sizeof(h));
+  if (!snapshot_valid(&h, st.st_size)) {
+    munmap(map, st.st_size);
+    return 0;
+  }
+  table = (snapshot_slot *) (map + h.slots);
+  for (i = 0; i < h.capacity; i++) {
+    if (table[i].entry != 0) {
+      if (table[i].entry < h.heap || table[i].entry > h.size - sizeof(entry) || table[i].entry % 8 != 0) {
+        break;
+      }
+      /* A corrupt length must not point the key or value past the file */
+      e = (entry *) (map + table[i].entry);
+      if ((uint64_t) e->klen + e->vlen > h.size - table[i].entry - sizeof(entry)) {
+        break;
+      }
+      n++;
+    }
+  }
+  if (i < h.capacity || n != h.count) {
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  pthread_rwlock_wrlock(&s->lock);
+  Free(s->slots);
+  s->slots = Calloc(h.capacity, sizeof(slot));
+  s->capacity = h.capacity;
+  for (i = 0; i < h.capacity; i++) {
+    if (table[i].entry != 0) {
+      s->slots[i].id = table[i].id;
+      s->slots[i].tag = table[i].tag;
+      s->slots[i].e = (entry *) (map + table[i].entry);
+    }
+  }
+  ids = (uint32_t *) (map + h.ids);
+  for (i = 0; i < h.count; i++) {
+    idindex_add(s->index, ids[i]);
+  }
+  rebuild_filter(s, h.capacity);
+  s->count = h.count;
+  s->map = map;
+  s->map_len = st.st_size;
+  pthread_rwlock_unlock(&s->lock);
+  return h.stamp;
+}
@@ -0,0 +1,72 @@
+/*
+ * store.h - key-value store for the keys a node owns
+ *
+ */
+
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "csapp.h"
+
+#define   STORE_MIN_SLOTS   64
+#define   STORE_CHUNK       (1 << 20) // Arena chunk size in bytes
+
+typedef struct store store;
+
+/* Changes passed to a store_log */
+#define   STORE_PUT     0
+#define   STORE_DELETE  1
+
+/* Called for each key; key and value are only valid during the call */
+typedef void store_visit(uint32_t id, char *key, size_t klen, char *value, size_t vlen, void *arg);
+
+/* Called for each change under the store's write lock, so in the order applied */
+typedef void store_log(void *arg, int op, uint32_t id, char *key, size_t klen, char *value, size_t vlen);
+
+/* Called under the store's lock as a snapshot is taken; the result is saved with it */
+typedef uint64_t store_stamp(void *arg);
+
+store *store_create(void);
+void store_free(store *s);
+void store_set_log(store *s, store_log *log, void *arg);
+
+/* Inserts or replaces; returns 0 */
+int store_put(store *s, uint32_t id, char *key, size_t klen, char *value, size_t vlen);
+
+/* Inserts only if the key is absent; returns 0 if inserted, 1 if it was present */
+int store_put_new(store *s, uint32_t id, char *key, size_t klen, char *value, size_t vlen);
+
+/* Copies up to maxlen bytes of the value; returns its full length, or -1 if absent */
+ssize_t store_get(store *s, uint32_t id, char *key, size_t klen, char *value, size_t maxlen);
+
+/* Returns 0, or -1 if absent */
+int store_delete(store *s, uint32_t id, char *key, size_t klen);
+
+size_t store_count(store *s);
+size_t store_bytes(store *s);
+
+/* Encoded copy of the store's filter of keys present (filter_decode); Free it when done */
+char *store_filter(store *s, size_t *len);
+
+void store_foreach(store *s, store_visit *visit, void *arg);
+void store_foreach_id(store *s, uint32_t id, store_visit *visit, void *arg);
+
+/* Keys with IDs in [a, b] on the ring, as is_between(id, a, b) has it */
+void store_foreach_range(store *s, uint32_t a, uint32_t b, store_visit *visit, void *arg);
+
+/*
+ * Writes every key to fd in the snapshot layout, with stamp's result.
+ * Writers are held up only while the table is copied. Returns 0 or -1.
+ */
+int store_snapshot(store *s, int fd, store_stamp *stamp, void *arg);
+
+/*
+ * Maps the snapshot in fd into s, which must be empty; values are read
+ * from the mapping until replaced. Returns the snapshot's stamp, or 0
+ * with s unchanged if fd does not hold a snapshot.
+ */
+uint64_t store_map(store *s, int fd);
+
+#endif /* __STORE_H__ */
@@ -0,0 +1,642 @@
+/*
+ * wal.c - write-ahead log of a node's store
+ *
+ * The store reports every change under its write lock, so records are
+ * appended to an in-memory buffer in the order the changes were made.
+ * A flusher thread writes the buffer out and fdatasyncs it; whatever was
+ * appended while it waited (up to the flush interval) or while the
+ * previous flush ran goes out in the same write, so concurrent writers
+ * share one sync (group commit). A writer that needs its change durable
+ * before answering calls wal_commit, which waits for the flush covering
+ * the last record its thread appended. A failed write or sync leaves
+ * the log stopped where it was last durable: nothing more is written and
+ * every commit waiting past that point fails.
+ *
+ * Each record carries its length, a CRC32 of the rest and a sequence
+ * number. Replay reads the file in WAL_REPLAY_CHUNK blocks, cut at
+ * record boundaries, and hands every block to WAL_REPLAY_THREADS
+ * workers; each worker checks and applies only the records whose key ID
+ * falls in its share, so the changes to any one key are applied in log
+ * order. A truncated or corrupt record ends the log: the file is cut
+ * there before new records are appended. The workers check a whole block
+ * before any of them applies it, so nothing past a corrupt record is
+ * applied.
+ *
+ * Once the log has grown by WAL_SNAPSHOT_BYTES, a background thread
+ * writes a snapshot of the store, stamped with the sequence number of
+ * the last change it holds and the log's length at that point. When the
+ * snapshot is safely renamed into place, the log is cut down to the
+ * records after it: the bulk is copied to a new file while writes go on,
+ * and only the last few records are copied with appends held up. A
+ * restarted node maps the snapshot and replays just the records newer
+ * than its stamp, so restart time depends on the log, not the data.
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <time.h>
+#include "wal.h"
+#include "log.h"
+
+typedef struct record_header
+{
+  uint32_t len;           /* whole record, header included */
+  uint32_t crc;           /* of the record after this field */
+  uint64_t lsn;
+  uint32_t id;
+  uint32_t klen;
+  uint32_t vlen;
+  uint32_t op;
+} record_header;          /* followed by the key and value bytes */
+
+#define   RECORD_MAX  (1u << 30) // Longer lengths can only be garbage
+
+struct wal
+{
+  int fd;
+  char *path, *snapshot;
+  store *s;
+  int flush_ms;
+  pthread_mutex_t mutex;
+  pthread_cond_t appended, flushed;
+  char *buf, *spare;      /* appending into buf while spare is written */
+  size_t len, cap, spare_cap;
+  uint64_t lsn;           /* last appended */
+  uint64_t durable;       /* last on disk */
+  uint64_t size;          /* bytes appended, i.e. the log's length once flushed */
+  uint64_t written;       /* bytes in the file */
+  uint64_t mark;          /* log length when the last snapshot was stamped */
+  bool flushing;
+  bool failed;            /* a write or sync failed; nothing after durable is on disk */
+  bool cutting;           /* the log is being replaced; hold off flushing */
+  pthread_t flusher, snapshotter;
+};
+
+static __thread uint64_t last_appended;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table(void) {
+  uint32_t c;
+  int i, k;
+
+  for (i = 0; i < 256; i++) {
+    for (c = i, k = 0; k < 8; k++) {
+      c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc32(uint32_t crc, unsigned char *p, size_t len) {
+  crc = ~crc;
+  while (len-- > 0) {
+    crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+/* CRC of a record of len bytes at rec, which need not be aligned */
+static uint32_t record_crc(char *rec, uint32_t len) {
+  size_t skip = offsetof(record_header, lsn);
+  return crc32(0, (unsigned char *) rec + skip, len - skip);
+}
+
+/* A store_log: append one record; runs under the store's write lock */
+static void wal_append(void *arg, int op, uint32_t id, char *key, size_t klen, char *value, size_t vlen) {
+  wal *w = arg;
+  record_header h;
+  char *rec;
+
+  h.len = sizeof(h) + klen + vlen;
+  h.id = id;
+  h.klen = klen;
+  h.vlen = vlen;
+  h.op = op;
+
+  pthread_mutex_lock(&w->mutex);
+  if (w->len + h.len > w->cap) {
+    w->cap = w->len + h.len > 2 * w->cap ? w->len + h.len : 2 * w->cap;
+    w->buf = Realloc(w->buf, w->cap);
+  }
+  rec = w->buf + w->len;
+  h.lsn = ++w->lsn;
+  memcpy(rec, &h, sizeof(h));
+  memcpy(rec + sizeof(h), key, klen);
+  memcpy(rec + sizeof(h) + klen, value, vlen);
+  h.crc = record_crc(rec, h.len);
+  memcpy(rec + offsetof(record_header, crc), &h.crc, sizeof(h.crc));
+  w->len += h.len;
+  w->size += h.len;
+  last_appended = w->lsn;
+  if (w->len == h.len || w->len >= WAL_BUFFER) {
+    pthread_cond_signal(&w->appended);
+  }
+  pthread_mutex_unlock(&w->mutex);
+}
+
+int wal_commit(wal *w) {
+  int rc;
+
+  if (w == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&w->mutex);
+  while (w->durable < last_appended && !w->failed) {
+    pthread_cond_wait(&w->flushed, &w->mutex);
+  }
+  rc = w->durable < last_appended ? -1 : 0;
+  pthread_mutex_unlock(&w->mutex);
+  return rc;
+}
+
+/* Write out whatever has been appended, one write and one sync per round */
+static void *flush_loop(void *arg) {
+  wal *w = arg;
+  char *buf;
+  size_t len, cap;
+  uint64_t lsn;
+  bool ok;
+
+  pthread_mutex_lock(&w->mutex);
+  for (;;) {
+    while (w->len == 0 || w->cutting) {
+      pthread_cond_wait(&w->appended, &w->mutex);
+    }
+    if (w->flush_ms > 0 && w->len < WAL_BUFFER) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += w->flush_ms * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&w->appended, &w->mutex, &deadline);
+    }
+    buf = w->buf;
+    len = w->len;
+    cap = w->cap;
+    lsn = w->lsn;
+    w->buf = w->spare;
+    w->cap = w->spare_cap;
+    w->len = 0;
+    w->flushing = true;
+    pthread_mutex_unlock(&w->mutex);
+
+    /* Only the flusher sets failed, so it may look without the lock */
+    ok = !w->failed && rio_writen(w->fd, buf, len) == len && fdatasync(w->fd) == 0;
+    if (!ok && !w->failed) {
+      log_error("Write-ahead log error, no more changes will be logged: %s", strerror(errno));
+    }
+
+    pthread_mutex_lock(&w->mutex);
+    w->spare = buf;
+    w->spare_cap = cap;
+    if (ok) {
+      w->durable = lsn;
+      w->written += len;
+    } else {
+      w->failed = true;
+    }
+    w->flushing = false;
+    pthread_cond_broadcast(&w->flushed);
+  }
+  return NULL;
+}
+
+/* Replay */
+
+typedef struct block
+{
+  char *data;
+  size_t len;
+  off_t offset;           /* of data[0] in the file */
+  int pending;            /* workers yet to finish it */
+  int checking;           /* workers yet to check their share of it */
+  struct block *next;
+} block;
+
+typedef struct replay
+{
+  store *s;
+  int threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  block *head, *tail;     /* blocks some worker still needs */
+  int queued;
+  bool done;              /* no more blocks */
+  uint64_t from;          /* records up to this one are in the snapshot */
+  off_t bad;              /* first corrupt record, or -1 */
+  uint64_t lsn;           /* highest applied */
+  long applied;
+} replay;
+
+typedef struct replay_worker
+{
+  replay *r;
+  int index;
+} replay_worker;
+
+/* Check the CRCs of this worker's share of b, noting the first corrupt record */
+static void check_block(replay *r, int index, block *b) {
+  size_t pos;
+  record_header h;
+
+  for (pos = 0; pos < b->len; pos += h.len) {
+    memcpy(&h, b->data + pos, sizeof(h));
+    if (h.id % r->threads == index && record_crc(b->data + pos, h.len) != h.crc) {
+      pthread_mutex_lock(&r->mutex);
+      if (r->bad < 0 || b->offset + (off_t) pos < r->bad) {
+        r->bad = b->offset + pos;
+      }
+      pthread_mutex_unlock(&r->mutex);
+      return;
+    }
+  }
+}
+
+/* Apply this worker's share of b, up to bad, the first corrupt record if it is not -1 */
+static void apply_block(replay *r, int index, block *b, off_t bad, long *applied, uint64_t *lsn) {
+  size_t pos;
+  record_header h;
+
+  for (pos = 0; pos < b->len; pos += h.len) {
+    if (bad >= 0 && b->offset + (off_t) pos >= bad) {
+      break;
+    }
+    memcpy(&h, b->data + pos, sizeof(h));
+    if (h.id % r->threads != index || h.lsn <= r->from) {
+      continue;
+    }
+    char *key = b->data + pos + sizeof(h);
+    if (h.op == STORE_PUT) {
+      store_put(r->s, h.id, key, h.klen, key + h.klen, h.vlen);
+    } else {
+      store_delete(r->s, h.id, key, h.klen);
+    }
+    (*applied)++;
+    if (h.lsn > *lsn) {
+      *lsn = h.lsn;
+    }
+  }
+}
+
+static void *replay_loop(void *arg) {
+  replay_worker *rw = arg;
+  replay *r = rw->r;
+  block *b = NULL, *next;
+  uint64_t lsn = 0;
+  long applied = 0;
+  off_t bad;
+
+  pthread_mutex_lock(&r->mutex);
+  for (;;) {
+    next = b == NULL ? r->head : b->next;
+    if (next == NULL) {
+      if (r->done) {
+        break;
+      }
+      pthread_cond_wait(&r->cond, &r->mutex);
+      continue;
+    }
+    if (b != NULL && --b->pending == 0) {
+      /* Every worker is past b, and blocks finish in order */
+      r->head = next;
+      r->queued--;
+      Free(b->data);
+      Free(b);
+      pthread_cond_broadcast(&r->cond);
+    }
+    b = next;
+    pthread_mutex_unlock(&r->mutex);
+    check_block(r, rw->index, b);
+    pthread_mutex_lock(&r->mutex);
+    /* Blocks are checked in order, so once all of b is, bad is final up to its end */
+    if (--b->checking == 0) {
+      pthread_cond_broadcast(&r->cond);
+    }
+    while (b->checking > 0) {
+      pthread_cond_wait(&r->cond, &r->mutex);
+    }
+    bad = r->bad;
+    pthread_mutex_unlock(&r->mutex);
+    apply_block(r, rw->index, b, bad, &applied, &lsn);
+    pthread_mutex_lock(&r->mutex);
+  }
+  if (b != NULL && --b->pending == 0) {
+    r->head = NULL;
+    r->tail = NULL;
+    r->queued--;
+    Free(b->data);
+    Free(b);
+    pthread_cond_broadcast(&r->cond);
+  }
+  r->applied += applied;
+  if (lsn > r->lsn) {
+    r->lsn = lsn;
+  }
+  pthread_mutex_unlock(&r->mutex);
+  return NULL;
+}
+
+/* Hand a block to the workers, waiting while too many are unfinished */
+static void queue_block(replay *r, char *data, size_t len, off_t offset) {
+  block *b = Malloc(sizeof(block));
+
+  b->data = data;
+  b->len = len;
+  b->offset = offset;
+  b->pending = r->threads;
+  b->checking = r->threads;
+  b->next = NULL;
+  pthread_mutex_lock(&r->mutex);
+  while (r->queued >= 2 * r->threads) {
+    pthread_cond_wait(&r->cond, &r->mutex);
+  }
+  if (r->tail == NULL || r->head == NULL) {
+    r->head = b;
+  } else {
+    r->tail->next = b;
+  }
+  r->tail = b;
+  r->queued++;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->mutex);
+}
+
+/*
+ * replay_file - Apply the records of fd after from to s with
+ * WAL_REPLAY_THREADS workers, reading WAL_REPLAY_CHUNK bytes at a time.
+ * Returns the offset after the last intact record and sets *lsn to the
+ * highest applied.
+ */
+static off_t replay_file(int fd, store *s, uint64_t from, uint64_t *lsn, long *applied) {
+  replay_worker workers[WAL_REPLAY_THREADS];
+  pthread_t threads[WAL_REPLAY_THREADS];
+  replay r;
+  char *data = NULL;
+  size_t len = 0, cap = 0, whole;
+  off_t offset = 0;
+  ssize_t n;
+  int i;
+
+  memset(&r, 0, sizeof(r));
+  r.s = s;
+  r.from = from;
+  r.threads = WAL_REPLAY_THREADS;
+  r.bad = -1;
+  pthread_mutex_init(&r.mutex, NULL);
+  pthread_cond_init(&r.cond, NULL);
+  for (i = 0; i < WAL_REPLAY_THREADS; i++) {
+    workers[i].r = &r;
+    workers[i].index = i;
+    pthread_create(&threads[i], NULL, replay_loop, &workers[i]);
+  }
+
+  for (;;) {
+    if (cap - len < WAL_REPLAY_CHUNK) {
+      cap = len + WAL_REPLAY_CHUNK;
+      data = Realloc(data, cap);
+    }
+    if ((n = read(fd, data + len, cap - len)) <= 0) {
+      break;
+    }
+    len += n;
+
+    /* Cut the block after the last whole record; the rest starts the next one */
+    record_header h;
+    for (whole = 0; len - whole >= sizeof(h); whole += h.len) {
+      memcpy(&h, data + whole, sizeof(h));
+      if (h.len < sizeof(h) || h.len > RECORD_MAX || h.len != sizeof(h) + h.klen + h.vlen) {
+        len = whole; /* garbage: the log ends here */
+        n = 0;
+        break;
+      }
+      if (len - whole < h.len) {
+        break;
+      }
+    }
+    if (whole > 0) {
+      char *rest = Malloc(cap);
+      memcpy(rest, data + whole, len - whole);
+      queue_block(&r, data, whole, offset);
+      offset += whole;
+      data = rest;
+      len -= whole;
+    } else if (len >= RECORD_MAX) {
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+  }
+  Free(data);
+
+  pthread_mutex_lock(&r.mutex);
+  r.done = true;
+  pthread_cond_broadcast(&r.cond);
+  pthread_mutex_unlock(&r.mutex);
+  for (i = 0; i < WAL_REPLAY_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&r.mutex);
+  pthread_cond_destroy(&r.cond);
+
+  *lsn = r.lsn;
+  *applied = r.applied;
+  return r.bad >= 0 && r.bad < offset ? r.bad : offset;
+}
+
+/* Snapshots */
+
+/* A store_stamp: the last change in the snapshot, and where the log was then */
+static uint64_t wal_mark(void *arg) {
+  wal *w = arg;
+  uint64_t lsn;
+
+  pthread_mutex_lock(&w->mutex);
+  lsn = w->lsn;
+  w->mark = w->size;
+  pthread_mutex_unlock(&w->mutex);
+  return lsn;
+}
+
+/* Make a rename in path's directory durable */
+static int sync_directory(char *path) {
+  char dir[MAXLINE], *slash;
+  int fd, rc;
+
+  strcpy(dir, path);
+  if ((slash = strrchr(dir, '/')) == NULL) {
+    strcpy(dir, ".");
+  } else {
+    slash[1] = '\0';
+  }
+  if ((fd = open(dir, O_RDONLY)) < 0) {
+    return -1;
+  }
+  rc = fsync(fd);
+  close(fd);
+  return rc;
+}
+
+/* Append bytes [pos, end) of one file to another */
+static int copy_range(int from, int to, uint64_t pos, uint64_t end, char *buf) {
+  while (pos < end) {
+    size_t len = end - pos < WAL_REPLAY_CHUNK ? end - pos : WAL_REPLAY_CHUNK;
+    ssize_t n = pread(from, buf, len, pos);
+    if (n <= 0 || rio_writen(to, buf, n) != n) {
+      return -1;
+    }
+    pos += n;
+  }
+  return 0;
+}
+
+/*
+ * cut_log - Replace the log with its records from offset from on. The
+ * bulk is copied while the flusher goes on appending to the old file;
+ * the rest is copied, synced and renamed into place with appends held
+ * up, and later flushes go to the new file. The records up to from
+ * must be flushed first, so the copy starts on a record boundary.
+ */
+static int cut_log(wal *w, uint64_t from) {
+  char tmp[MAXLINE], *buf = Malloc(WAL_REPLAY_CHUNK);
+  uint64_t pos = from, end;
+  int fd, rc = -1;
+
+  sprintf(tmp, "%s.tmp", w->path);
+  if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+    Free(buf);
+    return -1;
+  }
+  pthread_mutex_lock(&w->mutex);
+  while (w->written < from && !w->failed) {
+    pthread_cond_wait(&w->flushed, &w->mutex);
+  }
+  if (w->failed) {
+    pthread_mutex_unlock(&w->mutex);
+    goto out;
+  }
+  while ((end = w->written) - pos >= WAL_BUFFER) {
+    pthread_mutex_unlock(&w->mutex);
+    if (copy_range(w->fd, fd, pos, end, buf) < 0) {
+      goto out;
+    }
+    pos = end;
+    pthread_mutex_lock(&w->mutex);
+  }
+  w->cutting = true;
+  while (w->flushing) {
+    pthread_cond_wait(&w->flushed, &w->mutex);
+  }
+  if (copy_range(w->fd, fd, pos, w->written, buf) == 0 && fdatasync(fd) == 0 &&
+      rename(tmp, w->path) == 0) {
+    sync_directory(w->path);
+    close(w->fd);
+    w->fd = fd;
+    w->written -= from;
+    w->size -= from;
+    fd = -1;
+    rc = 0;
+  }
+  w->cutting = false;
+  pthread_cond_signal(&w->appended);
+  pthread_mutex_unlock(&w->mutex);
+out:
+  if (fd >= 0) {
+    close(fd);
+    unlink(tmp);
+  }
+  Free(buf);
+  return rc;
+}
+
+/* Write a snapshot of the store next to the log, then cut the log down to what came after it */
+static int checkpoint(wal *w) {
+  char tmp[MAXLINE];
+  int fd;
+
+  sprintf(tmp, "%s.tmp", w->snapshot);
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    return -1;
+  }
+  if (store_snapshot(w->s, fd, wal_mark, w) < 0 || fsync(fd) < 0) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  close(fd);
+  if (rename(tmp, w->snapshot) < 0 || sync_directory(w->snapshot) < 0) {
+    return -1;
+  }
+  return cut_log(w, w->mark);
+}
+
+/* Take a snapshot whenever the log has grown by WAL_SNAPSHOT_BYTES */
+static void *snapshot_loop(void *arg) {
+  wal *w = arg;
+  uint64_t size;
+
+  for (;;) {
+    sleep(WAL_SNAPSHOT_CHECK);
+    pthread_mutex_lock(&w->mutex);
+    size = w->size;
+    pthread_mutex_unlock(&w->mutex);
+    if (size < WAL_SNAPSHOT_BYTES) {
+      continue;
+    }
+    if (checkpoint(w) < 0) {
+      log_error("Snapshot error: %s", strerror(errno));
+    } else {
+      log_info("Wrote a snapshot of %zu keys to %s", store_count(w->s), w->snapshot);
+    }
+  }
+  return NULL;
+}
+
+wal *wal_recover(char *path, char *snapshot, store *s, int flush_ms) {
+  uint64_t from = 0, lsn = 0;
+  long applied = 0;
+  off_t end;
+  wal *w;
+  int fd;
+
+  pthread_once(&crc_once, init_crc_table);
+  if ((fd = open(snapshot, O_RDONLY)) >= 0) {
+    from = store_map(s, fd);
+    close(fd);
+    if (store_count(s) > 0) {
+      log_info("Mapped %zu keys from %s", store_count(s), snapshot);
+    }
+  }
+  if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+    log_error("Write-ahead log open error: %s", strerror(errno));
+    return NULL;
+  }
+  end = replay_file(fd, s, from, &lsn, &applied);
+  if (ftruncate(fd, end) < 0 || lseek(fd, end, SEEK_SET) < 0) {
+    log_error("Write-ahead log error: %s", strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  log_info("Replayed %ld changes from %s", applied, path);
+
+  w = Calloc(1, sizeof(wal));
+  w->fd = fd;
+  w->path = strdup(path);
+  w->snapshot = strdup(snapshot);
+  w->s = s;
+  w->size = w->written = end;
+  w->flush_ms = flush_ms;
+  pthread_mutex_init(&w->mutex, NULL);
+  pthread_cond_init(&w->appended, NULL);
+  pthread_cond_init(&w->flushed, NULL);
+  w->cap = w->spare_cap = WAL_BUFFER;
+  w->buf = Malloc(w->cap);
+  w->spare = Malloc(w->spare_cap);
+  w->lsn = w->durable = lsn > from ? lsn : from;
+  pthread_create(&w->flusher, NULL, flush_loop, w);
+  pthread_create(&w->snapshotter, NULL, snapshot_loop, w);
+  store_set_log(s, wal_append, w);
+  return w;
+}
@@ -0,0 +1,37 @@
+/*
+ * wal.h - write-ahead log of a node's store
+ *
+ */
+
+#ifndef __WAL_H__
+#define __WAL_H__
+
+#include "store.h"
+
+#define   WAL_FILE            "chord-%d.wal" // Per node, by listening port
+#define   WAL_FLUSH_INTERVAL  0         // In milliseconds a flush waits for more writes; 0 for none
+#define   WAL_BUFFER          (1 << 20) // Bytes of appended records before a flush starts at once
+#define   WAL_REPLAY_THREADS  4
+#define   WAL_REPLAY_CHUNK    (1 << 20) // Bytes read at a time during replay
+#define   WAL_SNAPSHOT_FILE   "chord-%d.snap"
+#define   WAL_SNAPSHOT_BYTES  (64 << 20) // Log growth that brings on a snapshot
+#define   WAL_SNAPSHOT_CHECK  1         // In seconds between looks at the log's size
+
+typedef struct wal wal;
+
+/*
+ * Maps the snapshot at snapshot into s, if there is one, and replays the
+ * records of the log at path that it does not hold. Cuts off a torn
+ * tail, then opens the log for appending, makes it s's log and starts
+ * taking snapshots as it grows. Returns NULL if it cannot be opened; s
+ * then holds whatever could be recovered.
+ */
+wal *wal_recover(char *path, char *snapshot, store *s, int flush_ms);
+
+/*
+ * Waits until every change this thread made to the logged store is on
+ * disk. Returns -1 if the log failed before they all got there.
+ */
+int wal_commit(wal *w);
+
+#endif /* __WAL_H__ */
@@ -0,0 +1,344 @@
+/*
+ * wire.c - framed message protocol shared by chord and query
+ *
+ */
+
+#include "wire.h"
+
+bool wire_text = false;
+
+static char *opcode_names[OP_COUNT] = {
+  "reply",
+  "fetch_suc",
+  "fetch_pre",
+  "query_suc",
+  "query_pre",
+  "query_cpf",
+  "update_suc",
+  "update_pre",
+  "update_fin",
+  "remove_node",
+  "search_query",
+  "print_table",
+  "ping",
+  "find_suc",
+  "found_suc",
+  "query_hop",
+  "notify",
+  "put",
+  "get",
+  "delete",
+  "pull_keys",
+  "push_keys",
+  "keys_done",
+  "replicate",
+  "filter",
+  "stats",
+};
+
+/* wire_put_header - Encode a frame header into FRAME_HEADER_SIZE bytes at raw */
+void wire_put_header(unsigned char *raw, int opcode, int flags, size_t len) {
+  raw[0] = (len >> 24) & 0xff;
+  raw[1] = (len >> 16) & 0xff;
+  raw[2] = (len >> 8) & 0xff;
+  raw[3] = len & 0xff;
+  raw[4] = (opcode >> 8) & 0xff;
+  raw[5] = opcode & 0xff;
+  raw[6] = (flags >> 8) & 0xff;
+  raw[7] = flags & 0xff;
+}
+
+/* wire_get_header - Decode the FRAME_HEADER_SIZE bytes at raw */
+void wire_get_header(unsigned char *raw, frame_header *hdr) {
+  hdr->length = ((uint32_t) raw[0] << 24) | ((uint32_t) raw[1] << 16) |
+                ((uint32_t) raw[2] << 8) | (uint32_t) raw[3];
+  hdr->opcode = (uint16_t) ((raw[4] << 8) | raw[5]);
+  hdr->flags = (uint16_t) ((raw[6] << 8) | raw[7]);
+}
+
+/*
+ * rio_readframeb - Read exactly one frame. The payload is copied to
+ * payload and NUL terminated, so maxlen must leave room for the
+ * terminator. Returns 1 on a frame, 0 on a clean EOF before the header
+ * and -1 on error, truncation or a payload longer than maxlen-1.
+ */
+ssize_t rio_readframeb(rio_t *rp, frame_header *hdr, void *payload, size_t maxlen) {
+  unsigned char raw[FRAME_HEADER_SIZE];
+  ssize_t n;
+
+  if ((n = rio_readnb(rp, raw, FRAME_HEADER_SIZE)) != FRAME_HEADER_SIZE) {
+    return n == 0 ? 0 : -1;
+  }
+  wire_get_header(raw, hdr);
+
+  if (hdr->length > maxlen - 1) {
+    return -1;
+  }
+  if (rio_readnb(rp, payload, hdr->length) != hdr->length) {
+    return -1;
+  }
+  ((char *) payload)[hdr->length] = 0;
+  return 1;
+}
+
+/*
+ * rio_readframe_grow - Read one frame like rio_readframeb, but into
+ * *payload, a malloc'd buffer of *cap bytes (NULL and 0 at first) that is
+ * grown to fit any payload shorter than maxlen.
+ */
+ssize_t rio_readframe_grow(rio_t *rp, frame_header *hdr, char **payload, size_t *cap, size_t maxlen) {
+  unsigned char raw[FRAME_HEADER_SIZE];
+  char *grown;
+  ssize_t n;
+
+  if ((n = rio_readnb(rp, raw, FRAME_HEADER_SIZE)) != FRAME_HEADER_SIZE) {
+    return n == 0 ? 0 : -1;
+  }
+  wire_get_header(raw, hdr);
+
+  if (hdr->length > maxlen - 1) {
+    return -1;
+  }
+  if (hdr->length + 1 > *cap) {
+    if ((grown = realloc(*payload, hdr->length + 1)) == NULL) {
+      return -1;
+    }
+    *payload = grown;
+    *cap = hdr->length + 1;
+  }
+  if (rio_readnb(rp, *payload, hdr->length) != hdr->length) {
+    return -1;
+  }
+  (*payload)[hdr->length] = 0;
+  return 1;
+}
+
+/*
+ * rio_writeframev - Write a header and the iovcnt parts at iov (at most
+ * WIRE_IOV_MAX) as one frame, with writev so nothing is copied. Returns
+ * the number of bytes written or -1 on error.
+ */
+ssize_t rio_writeframev(int fd, int opcode, int flags, struct iovec *iov, int iovcnt) {
+  unsigned char raw[FRAME_HEADER_SIZE];
+  struct iovec parts[WIRE_IOV_MAX + 1], *p = parts;
+  size_t len = 0, total;
+  ssize_t n;
+  int i, count = iovcnt + 1;
+
+  if (iovcnt > WIRE_IOV_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < iovcnt; i++) {
+    parts[i + 1] = iov[i];
+    len += iov[i].iov_len;
+  }
+  wire_put_header(raw, opcode, flags, len);
+  parts[0].iov_base = raw;
+  parts[0].iov_len = FRAME_HEADER_SIZE;
+  total = FRAME_HEADER_SIZE + len;
+
+  /* Pick up after a short write where it stopped */
+  while (count > 0) {
+    if ((n = writev(fd, p, count)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    while (count > 0 && (size_t) n >= p->iov_len) {
+      n -= p->iov_len;
+      p++;
+      count--;
+    }
+    if (count > 0) {
+      p->iov_base = (char *) p->iov_base + n;
+      p->iov_len -= n;
+    }
+  }
+  return total;
+}
+
+/* rio_writeframe - Write a header and len payload bytes as one frame */
+ssize_t rio_writeframe(int fd, int opcode, int flags, void *payload, size_t len) {
+  struct iovec iov = { payload, len };
+  return rio_writeframev(fd, opcode, flags, &iov, 1);
+}
+
+void wire_reader_init(wire_reader *r, frame_header *hdr, char *payload) {
+  r->pos = payload;
+  r->end = payload + hdr->length;
+  r->text = (hdr->flags & FRAME_TEXT) != 0;
+}
+
+static void put_be32(unsigned char *p, uint32_t v) {
+  p[0] = (v >> 24) & 0xff;
+  p[1] = (v >> 16) & 0xff;
+  p[2] = (v >> 8) & 0xff;
+  p[3] = v & 0xff;
+}
+
+static uint32_t get_be32(unsigned char *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+         ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+/* Returns the next text line without its newline, or NULL at the end */
+static char *next_text_line(wire_reader *r) {
+  char *line = r->pos;
+  char *nl;
+
+  if (r->pos >= r->end) {
+    return NULL;
+  }
+  if ((nl = memchr(r->pos, '\n', r->end - r->pos)) == NULL) {
+    nl = r->end;
+    r->pos = r->end;
+  } else {
+    r->pos = nl + 1;
+  }
+  *nl = 0;
+  return line;
+}
+
+/* Write v in decimal and a newline at buf; returns the length */
+static size_t put_decimal(char *buf, uint32_t v) {
+  char digits[10];
+  size_t n = 0, i;
+
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v > 0);
+  for (i = 0; i < n; i++) {
+    buf[i] = digits[n - 1 - i];
+  }
+  buf[n] = '\n';
+  return n + 1;
+}
+
+/* wire_put_u32 - Encode v at buf; returns the encoded length */
+size_t wire_put_u32(char *buf, uint32_t v, bool text) {
+  if (text) {
+    return put_decimal(buf, v);
+  }
+  put_be32((unsigned char *) buf, v);
+  return 4;
+}
+
+/* wire_put_node - Encode n at buf; returns the encoded length */
+size_t wire_put_node(char *buf, Node n, bool text) {
+  unsigned char *p = (unsigned char *) buf;
+  struct in_addr addr;
+
+  if (text) {
+    size_t len = put_decimal(buf, n.key), ip = strlen(n.ip_address);
+    memcpy(buf + len, n.ip_address, ip);
+    len += ip;
+    buf[len++] = '\n';
+    return len + put_decimal(buf + len, n.port);
+  }
+  put_be32(p, n.key);
+  if (inet_pton(AF_INET, n.ip_address, &addr) != 1) {
+    addr.s_addr = 0;
+  }
+  memcpy(p + 4, &addr.s_addr, 4);
+  p[8] = (n.port >> 8) & 0xff;
+  p[9] = n.port & 0xff;
+  return WIRE_NODE_SIZE;
+}
+
+/* wire_put_bytes - Encode len bytes of data with their length; returns the encoded length */
+size_t wire_put_bytes(char *buf, char *data, size_t len, bool text) {
+  size_t n = wire_put_u32(buf, len, text);
+
+  memcpy(buf + n, data, len);
+  n += len;
+  if (text) {
+    buf[n++] = '\n';
+  }
+  return n;
+}
+
+/* wire_get_u32 - Decode a u32 at the cursor; returns 0, or -1 if truncated */
+int wire_get_u32(wire_reader *r, uint32_t *v) {
+  char *line;
+
+  if (r->text) {
+    if ((line = next_text_line(r)) == NULL) {
+      return -1;
+    }
+    *v = (uint32_t) strtoul(line, NULL, 10);
+    return 0;
+  }
+  if (r->end - r->pos < 4) {
+    return -1;
+  }
+  *v = get_be32((unsigned char *) r->pos);
+  r->pos += 4;
+  return 0;
+}
+
+/* wire_get_node - Decode a Node at the cursor; returns 0, or -1 if truncated */
+int wire_get_node(wire_reader *r, Node *n) {
+  unsigned char *p = (unsigned char *) r->pos;
+  char *line;
+
+  if (r->text) {
+    if (wire_get_u32(r, &n->key) < 0 || (line = next_text_line(r)) == NULL) {
+      return -1;
+    }
+    strncpy(n->ip_address, line, INET_ADDRSTRLEN - 1);
+    n->ip_address[INET_ADDRSTRLEN - 1] = 0;
+    if ((line = next_text_line(r)) == NULL) {
+      return -1;
+    }
+    n->port = atoi(line);
+    return 0;
+  }
+  if (r->end - r->pos < WIRE_NODE_SIZE) {
+    return -1;
+  }
+  n->key = get_be32(p);
+  inet_ntop(AF_INET, p + 4, n->ip_address, INET_ADDRSTRLEN);
+  n->port = (p[8] << 8) | p[9];
+  r->pos += WIRE_NODE_SIZE;
+  return 0;
+}
+
+/*
+ * wire_get_bytes - Point *data at a length-prefixed byte string in the
+ * payload (not copied or terminated); returns 0, or -1 if truncated
+ */
+int wire_get_bytes(wire_reader *r, char **data, size_t *len) {
+  uint32_t n;
+
+  if (wire_get_u32(r, &n) < 0 || (size_t) (r->end - r->pos) < n) {
+    return -1;
+  }
+  *data = r->pos;
+  *len = n;
+  r->pos += n;
+  if (r->text && r->pos < r->end && *r->pos == '\n') {
+    r->pos++;
+  }
+  return 0;
+}
+
+char *opcode_name(int opcode) {
+  if (opcode < 0 || opcode >= OP_COUNT) {
+    return "unknown";
+  }
+  return opcode_names[opcode];
+}
+
+/* Returns the opcode whose name prefixes name, or -1 */
+int opcode_of(char *name) {
+  int i;
+  for (i = 1; i < OP_COUNT; i++) {
+    if (strncmp(name, opcode_names[i], strlen(opcode_names[i])) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
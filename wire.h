@@ -0,0 +1,110 @@
+/*
+ * wire.h - framed message protocol shared by chord and query
+ *
+ * Every message is a fixed 8-byte header followed by exactly
+ * header.length payload bytes. Header fields are in network byte order.
+ *
+ * Routing payloads are fixed-layout binary: a Node is key (u32), IPv4
+ * address (u32) and port (u16), all in network byte order, and integers
+ * are u32. Frames flagged FRAME_TEXT carry the same fields as the old
+ * newline-separated ASCII lines instead, for debugging with a packet
+ * capture; replies use the encoding of the request.
+ */
+
+#ifndef __WIRE_H__
+#define __WIRE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "csapp.h"
+
+#define   FRAME_HEADER_SIZE  8
+#define   FRAME_TEXT         0x1 // Payload uses the text debug encoding
+#define   FRAME_RECURSIVE    0x2 // query_suc: resolve with a recursive lookup
+#define   FRAME_DIRECT       0x4 // put/get/delete: execute here or refuse, never forward
+#define   FRAME_HANDOFF      0x8 // get: answer from local data even if no longer the owner
+
+#define   WIRE_NODE_SIZE     10  // Binary encoded Node
+#define   WIRE_NODE_MAX      32  // Largest encoded Node in either encoding
+#define   WIRE_U32_MAX       12  // Largest encoded u32 in either encoding
+#define   WIRE_IOV_MAX       8   // Parts of a frame's payload written at once
+
+/* Opcodes */
+#define   OP_REPLY         0  // Response to any request
+#define   OP_FETCH_SUC     1
+#define   OP_FETCH_PRE     2
+#define   OP_QUERY_SUC     3
+#define   OP_QUERY_PRE     4
+#define   OP_QUERY_CPF     5
+#define   OP_UPDATE_SUC    6
+#define   OP_UPDATE_PRE    7
+#define   OP_UPDATE_FIN    8
+#define   OP_REMOVE_NODE   9
+#define   OP_SEARCH_QUERY  10
+#define   OP_PRINT_TABLE   11
+#define   OP_PING          12
+#define   OP_FIND_SUC      13 // Recursive lookup, forwarded towards the owner
+#define   OP_FOUND_SUC     14 // Result of a recursive lookup, sent to its origin
+#define   OP_QUERY_HOP     15 // Closest preceding finger and that finger's successor
+#define   OP_NOTIFY        16 // Sender may be the receiver's predecessor
+#define   OP_PUT           17 // Data requests, executed on the key's owner
+#define   OP_GET           18
+#define   OP_DELETE        19
+#define   OP_PULL_KEYS     20 // Stream the keys a joining node now owns
+#define   OP_PUSH_KEYS     21 // Chunk of keys handed over by a leaving node
+#define   OP_KEYS_DONE     22 // Pulled keys arrived; the source may drop them
+#define   OP_REPLICATE     23 // Batch of updates for a replica; answered once applied
+#define   OP_FILTER        24 // Encoded filter of the keys the receiver holds
+#define   OP_STATS         25 // Table of the receiver's RPC latencies and lookup hops, as text
+#define   OP_COUNT         26
+
+/* Status leading the reply to a data request */
+#define   STATUS_OK         0
+#define   STATUS_NOT_FOUND  1
+#define   STATUS_NOT_OWNER  2 // Receiver does not own the key (FRAME_DIRECT)
+#define   STATUS_ERROR      3
+
+typedef struct Node 
+{
+  uint32_t key;
+  char ip_address[INET_ADDRSTRLEN];
+  int port;
+} Node;
+
+typedef struct frame_header
+{
+  uint32_t length;  /* payload bytes following the header */
+  uint16_t opcode;
+  uint16_t flags;   /* FRAME_* bits */
+} frame_header;
+
+/* Cursor over a received payload */
+typedef struct wire_reader
+{
+  char *pos;
+  char *end;
+  bool text;
+} wire_reader;
+
+extern bool wire_text; /* send requests in the text debug encoding */
+
+void wire_put_header(unsigned char *raw, int opcode, int flags, size_t len);
+void wire_get_header(unsigned char *raw, frame_header *hdr);
+ssize_t rio_readframeb(rio_t *rp, frame_header *hdr, void *payload, size_t maxlen);
+ssize_t rio_readframe_grow(rio_t *rp, frame_header *hdr, char **payload, size_t *cap, size_t maxlen);
+ssize_t rio_writeframe(int fd, int opcode, int flags, void *payload, size_t len);
+ssize_t rio_writeframev(int fd, int opcode, int flags, struct iovec *iov, int iovcnt);
+
+void wire_reader_init(wire_reader *r, frame_header *hdr, char *payload);
+size_t wire_put_u32(char *buf, uint32_t v, bool text);
+size_t wire_put_node(char *buf, Node n, bool text);
+size_t wire_put_bytes(char *buf, char *data, size_t len, bool text);
+int wire_get_u32(wire_reader *r, uint32_t *v);
+int wire_get_node(wire_reader *r, Node *n);
+int wire_get_bytes(wire_reader *r, char **data, size_t *len);
+
+char *opcode_name(int opcode);
+int opcode_of(char *name);
+
+#endif /* __WIRE_H__ */